@@ -0,0 +1,506 @@
+/* ------------------------------------------------------------------------
+ *
+ * columnar.c
+ *		Columnar batch format of the exchange traffic.
+ *
+ *		Rows, sent to one destination, are accumulated into the batch and
+ *		packed column by column: by-value columns as arrays of values,
+ *		fixed-length by-reference columns as arrays of aligned values,
+ *		variable-length columns as offsets and values. Low-cardinality
+ *		variable-length columns are dictionary encoded: each distinct value
+ *		is sent once per batch.
+ *		Receiver reads rows of the block into virtual slots in place: values
+ *		point into the block.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ * ------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/hash.h"
+#include "access/htup_details.h"
+#include "access/tupmacs.h"
+#include "fmgr.h"
+#include "utils/datum.h"
+#include "utils/memutils.h"
+
+#include "columnar.h"
+#include "connection.h"
+
+
+typedef struct
+{
+	uint32	t_len; /* EXCHANGE_MSG_COLUMNAR | size of the block */
+	uint32	nrows;
+	uint32	natts;
+	uint32	padding;
+} BlockHeader;
+
+typedef struct
+{
+	uint32	encoding;
+	uint32	size; /* size of the column section with this header */
+	uint32	hasnulls;
+	uint32	ndict;
+} ColumnHeader;
+
+#define COLUMN_NULL		(0) /* all values are NULL */
+#define COLUMN_BYVAL	(1) /* array of attlen-sized values */
+#define COLUMN_FIXED	(2) /* array of aligned by-reference values */
+#define COLUMN_VARLEN	(3) /* offsets array and values */
+#define COLUMN_DICT		(4) /* dictionary offsets, codes array and values */
+
+/* Dictionary is used if distinct values are no more than 1/DICT_RATIO */
+#define DICT_RATIO		(4)
+#define DICT_MIN_ROWS	(16)
+#define DICT_SLOTS		(2 * COLUMNAR_BATCH_ROWS)
+
+#define BATCH_VALUE(batch, row, attno) \
+	((batch)->values[(row) * (batch)->tupdesc->natts + (attno)])
+#define BATCH_ISNULL(batch, row, attno) \
+	((batch)->isnull[(row) * (batch)->tupdesc->natts + (attno)])
+
+
+ColumnarBatch *
+COLUMNAR_Create_batch(TupleDesc tupdesc)
+{
+	ColumnarBatch	*batch = palloc0(sizeof(ColumnarBatch));
+	int				natts = tupdesc->natts;
+
+	batch->tupdesc = tupdesc;
+	batch->nrows = 0;
+	batch->values = palloc(COLUMNAR_BATCH_ROWS * natts * sizeof(Datum));
+	batch->isnull = palloc(COLUMNAR_BATCH_ROWS * natts * sizeof(bool));
+	batch->mcxt = AllocSetContextCreate(CurrentMemoryContext,
+										"PargresColumnarBatch",
+										ALLOCSET_DEFAULT_SIZES);
+	return batch;
+}
+
+/*
+ * Add the row into the batch. By-reference values are copied, toasted
+ * values are detoasted.
+ * Returns true if the batch is full.
+ */
+bool
+COLUMNAR_Add_row(ColumnarBatch *batch, Datum *values, bool *isnull)
+{
+	MemoryContext	oldCxt = MemoryContextSwitchTo(batch->mcxt);
+	int				attno;
+
+	Assert(batch->nrows < COLUMNAR_BATCH_ROWS);
+
+	for (attno = 0; attno < batch->tupdesc->natts; attno++)
+	{
+		Form_pg_attribute	att = TupleDescAttr(batch->tupdesc, attno);
+		Datum				value = values[attno];
+
+		BATCH_ISNULL(batch, batch->nrows, attno) = isnull[attno];
+
+		if (isnull[attno])
+			value = (Datum) 0;
+		else if (att->attlen == -1)
+		{
+			struct varlena *detoasted;
+
+			detoasted = pg_detoast_datum_packed(
+									(struct varlena *) DatumGetPointer(value));
+
+			if ((Pointer) detoasted == DatumGetPointer(value))
+				value = datumCopy(value, false, -1);
+			else
+				value = PointerGetDatum(detoasted);
+		}
+		else if (!att->attbyval)
+			value = datumCopy(value, false, att->attlen);
+
+		BATCH_VALUE(batch, batch->nrows, attno) = value;
+	}
+
+	MemoryContextSwitchTo(oldCxt);
+	return (++batch->nrows >= COLUMNAR_BATCH_ROWS);
+}
+
+/*
+ * Reserve zeroed space at the tail of the buffer. Returns offset of the space:
+ * pointers into the buffer are invalidated by the next reservation.
+ */
+static int
+reserve(StringInfo out, int size)
+{
+	int offset = out->len;
+
+	enlargeStringInfo(out, size);
+	memset(out->data + out->len, 0, size);
+	out->len += size;
+	out->data[out->len] = '\0';
+	return offset;
+}
+
+static void
+pad(StringInfo out, int start, int alignment)
+{
+	int size = TYPEALIGN(alignment, out->len - start) - (out->len - start);
+
+	if (size > 0)
+		reserve(out, size);
+}
+
+static int
+value_length(Form_pg_attribute att, Datum value)
+{
+	if (att->attlen == -1)
+		return VARSIZE_ANY(DatumGetPointer(value));
+
+	Assert(att->attlen == -2);
+	return strlen(DatumGetCString(value)) + 1;
+}
+
+/*
+ * Append the value to the data area, started at offset start.
+ * Returns offset of the value into the data area.
+ */
+static uint32
+append_value(StringInfo out, int start, Form_pg_attribute att, Datum value)
+{
+	uint32 offset;
+
+	/* Values with 4-byte header are accessed by int */
+	pad(out, start, ALIGNOF_INT);
+	offset = out->len - start;
+	appendBinaryStringInfo(out, DatumGetPointer(value),
+						   value_length(att, value));
+	return offset;
+}
+
+/*
+ * Try to encode the variable-length column with the dictionary.
+ * Returns false if the column has too many distinct values.
+ */
+static bool
+encode_dict(ColumnarBatch *batch, int attno, StringInfo out,
+			ColumnHeader *header)
+{
+	Form_pg_attribute	att = TupleDescAttr(batch->tupdesc, attno);
+	int					nrows = batch->nrows;
+	int					slots[DICT_SLOTS];
+	Datum				entries[COLUMNAR_BATCH_ROWS];
+	int					lens[COLUMNAR_BATCH_ROWS];
+	uint16				codes[COLUMNAR_BATCH_ROWS];
+	int					ndict = 0;
+	int					dictpos;
+	int					codespos;
+	int					start;
+	int					row;
+	int					i;
+
+	if (nrows < DICT_MIN_ROWS)
+		return false;
+
+	memset(slots, 0, sizeof(slots));
+
+	for (row = 0; row < nrows; row++)
+	{
+		Datum	value = BATCH_VALUE(batch, row, attno);
+		char	*ptr = DatumGetPointer(value);
+		int		len;
+		uint32	h;
+
+		codes[row] = 0;
+		if (BATCH_ISNULL(batch, row, attno))
+			continue;
+
+		len = value_length(att, value);
+		h = DatumGetUInt32(hash_any((unsigned char *) ptr, len)) %
+																DICT_SLOTS;
+
+		/* Open addressing: slots contain index of the entry plus one */
+		while (slots[h] != 0)
+		{
+			int entry = slots[h] - 1;
+
+			if ((lens[entry] == len) &&
+				(memcmp(DatumGetPointer(entries[entry]), ptr, len) == 0))
+				break;
+			h = (h + 1) % DICT_SLOTS;
+		}
+
+		if (slots[h] == 0)
+		{
+			if (ndict >= nrows / DICT_RATIO)
+				return false;
+
+			entries[ndict] = value;
+			lens[ndict] = len;
+			slots[h] = ++ndict;
+		}
+
+		codes[row] = slots[h] - 1;
+	}
+
+	dictpos = reserve(out, MAXALIGN(ndict * sizeof(uint32)));
+	codespos = reserve(out, MAXALIGN(nrows * sizeof(uint16)));
+	memcpy(out->data + codespos, codes, nrows * sizeof(uint16));
+
+	start = out->len;
+	for (i = 0; i < ndict; i++)
+	{
+		uint32 offset = append_value(out, start, att, entries[i]);
+
+		((uint32 *) (out->data + dictpos))[i] = offset;
+	}
+
+	header->encoding = COLUMN_DICT;
+	header->ndict = ndict;
+	return true;
+}
+
+static void
+encode_column(ColumnarBatch *batch, int attno, StringInfo out)
+{
+	Form_pg_attribute	att = TupleDescAttr(batch->tupdesc, attno);
+	int					nrows = batch->nrows;
+	int					start = out->len;
+	ColumnHeader		header;
+	int					nnulls = 0;
+	int					row;
+	int					pos;
+
+	for (row = 0; row < nrows; row++)
+		if (BATCH_ISNULL(batch, row, attno))
+			nnulls++;
+
+	header.hasnulls = (nnulls > 0);
+	header.ndict = 0;
+	reserve(out, sizeof(ColumnHeader));
+
+	if (header.hasnulls)
+	{
+		/* Bitmap like t_bits: set bit means not null value */
+		pos = reserve(out, MAXALIGN(BITMAPLEN(nrows)));
+		for (row = 0; row < nrows; row++)
+			if (!BATCH_ISNULL(batch, row, attno))
+				((bits8 *) (out->data + pos))[row >> 3] |= (1 << (row & 0x07));
+	}
+
+	if (nnulls == nrows)
+		header.encoding = COLUMN_NULL;
+	else if (att->attbyval)
+	{
+		header.encoding = COLUMN_BYVAL;
+		pos = reserve(out, MAXALIGN(nrows * att->attlen));
+
+		for (row = 0; row < nrows; row++)
+		{
+			if (BATCH_ISNULL(batch, row, attno))
+				continue;
+
+			store_att_byval(out->data + pos + row * att->attlen,
+							BATCH_VALUE(batch, row, attno), att->attlen);
+		}
+	}
+	else if (att->attlen > 0)
+	{
+		int stride = att_align_nominal(att->attlen, att->attalign);
+
+		header.encoding = COLUMN_FIXED;
+		pos = reserve(out, MAXALIGN(nrows * stride));
+
+		for (row = 0; row < nrows; row++)
+		{
+			if (BATCH_ISNULL(batch, row, attno))
+				continue;
+
+			memcpy(out->data + pos + row * stride,
+				   DatumGetPointer(BATCH_VALUE(batch, row, attno)),
+				   att->attlen);
+		}
+	}
+	else if (!encode_dict(batch, attno, out, &header))
+	{
+		int datapos;
+
+		header.encoding = COLUMN_VARLEN;
+		pos = reserve(out, MAXALIGN(nrows * sizeof(uint32)));
+
+		datapos = out->len;
+		for (row = 0; row < nrows; row++)
+		{
+			uint32 offset = 0;
+
+			if (!BATCH_ISNULL(batch, row, attno))
+				offset = append_value(out, datapos, att,
+									  BATCH_VALUE(batch, row, attno));
+
+			((uint32 *) (out->data + pos))[row] = offset;
+		}
+	}
+
+	pad(out, start, MAXIMUM_ALIGNOF);
+	header.size = out->len - start;
+	memcpy(out->data + start, &header, sizeof(ColumnHeader));
+}
+
+/*
+ * Append the block with rows of the batch to the out buffer and reset the
+ * batch. The block is a message of the exchange protocol.
+ */
+void
+COLUMNAR_Encode(ColumnarBatch *batch, StringInfo out)
+{
+	int			start = out->len;
+	BlockHeader	header;
+	int			attno;
+
+	Assert(batch->nrows > 0);
+	Assert(start == MAXALIGN(start));
+
+	header.t_len = 0;
+	header.nrows = batch->nrows;
+	header.natts = batch->tupdesc->natts;
+	header.padding = 0;
+	appendBinaryStringInfo(out, (char *) &header, sizeof(BlockHeader));
+
+	for (attno = 0; attno < batch->tupdesc->natts; attno++)
+		encode_column(batch, attno, out);
+
+	((BlockHeader *) (out->data + start))->t_len =
+									EXCHANGE_MSG_COLUMNAR | (out->len - start);
+
+	batch->nrows = 0;
+	MemoryContextReset(batch->mcxt);
+}
+
+void
+COLUMNAR_Init_reader(ColumnarReader *reader, TupleDesc tupdesc)
+{
+	int natts = tupdesc->natts;
+
+	reader->tupdesc = tupdesc;
+	reader->nrows = 0;
+	reader->row = 0;
+	reader->encoding = palloc0(natts * sizeof(uint32));
+	reader->nulls = palloc0(natts * sizeof(bits8 *));
+	reader->data = palloc0(natts * sizeof(char *));
+	reader->offsets = palloc0(natts * sizeof(uint32 *));
+	reader->codes = palloc0(natts * sizeof(uint16 *));
+}
+
+/*
+ * Prepare the reader for the received block. The block must be valid until
+ * all rows will be read and used.
+ */
+void
+COLUMNAR_Open(ColumnarReader *reader, char *block)
+{
+	BlockHeader	*header = (BlockHeader *) block;
+	char		*ptr = block + sizeof(BlockHeader);
+	int			attno;
+
+	if (header->natts != reader->tupdesc->natts)
+		elog(ERROR, "Columnar block with %u attributes, expected %d",
+			 header->natts, reader->tupdesc->natts);
+
+	for (attno = 0; attno < header->natts; attno++)
+	{
+		ColumnHeader	*column = (ColumnHeader *) ptr;
+		char			*cur = ptr + sizeof(ColumnHeader);
+
+		reader->encoding[attno] = column->encoding;
+		reader->nulls[attno] = NULL;
+
+		if (column->hasnulls)
+		{
+			reader->nulls[attno] = (bits8 *) cur;
+			cur += MAXALIGN(BITMAPLEN(header->nrows));
+		}
+
+		switch (column->encoding)
+		{
+		case COLUMN_NULL:
+			break;
+		case COLUMN_BYVAL:
+		case COLUMN_FIXED:
+			reader->data[attno] = cur;
+			break;
+		case COLUMN_VARLEN:
+			reader->offsets[attno] = (uint32 *) cur;
+			reader->data[attno] = cur +
+									MAXALIGN(header->nrows * sizeof(uint32));
+			break;
+		case COLUMN_DICT:
+			reader->offsets[attno] = (uint32 *) cur;
+			cur += MAXALIGN(column->ndict * sizeof(uint32));
+			reader->codes[attno] = (uint16 *) cur;
+			reader->data[attno] = cur +
+									MAXALIGN(header->nrows * sizeof(uint16));
+			break;
+		default:
+			elog(ERROR, "Unknown column encoding: %u", column->encoding);
+		}
+
+		ptr += column->size;
+	}
+
+	reader->nrows = header->nrows;
+	reader->row = 0;
+}
+
+/*
+ * Store next row of the block into the slot as a virtual tuple.
+ * Returns false if all rows were read.
+ */
+bool
+COLUMNAR_Next(ColumnarReader *reader, TupleTableSlot *slot)
+{
+	int row = reader->row;
+	int attno;
+
+	if (row >= reader->nrows)
+		return false;
+
+	ExecClearTuple(slot);
+
+	for (attno = 0; attno < reader->tupdesc->natts; attno++)
+	{
+		Form_pg_attribute	att = TupleDescAttr(reader->tupdesc, attno);
+		char				*data = reader->data[attno];
+
+		if ((reader->encoding[attno] == COLUMN_NULL) ||
+			((reader->nulls[attno] != NULL) &&
+			 att_isnull(row, reader->nulls[attno])))
+		{
+			slot->tts_values[attno] = (Datum) 0;
+			slot->tts_isnull[attno] = true;
+			continue;
+		}
+
+		switch (reader->encoding[attno])
+		{
+		case COLUMN_BYVAL:
+			slot->tts_values[attno] = fetch_att(data + row * att->attlen,
+												true, att->attlen);
+			break;
+		case COLUMN_FIXED:
+			slot->tts_values[attno] = PointerGetDatum(data + row *
+							att_align_nominal(att->attlen, att->attalign));
+			break;
+		case COLUMN_VARLEN:
+			slot->tts_values[attno] = PointerGetDatum(data +
+											reader->offsets[attno][row]);
+			break;
+		case COLUMN_DICT:
+			slot->tts_values[attno] = PointerGetDatum(data +
+							reader->offsets[attno][reader->codes[attno][row]]);
+			break;
+		}
+
+		slot->tts_isnull[attno] = false;
+	}
+
+	reader->row++;
+	ExecStoreVirtualTuple(slot);
+	return true;
+}
@@ -0,0 +1,56 @@
+/*-------------------------------------------------------------------------
+ *
+ * columnar.h
+ *	Columnar batch format of the exchange traffic
+ *
+ * Copyright (c) 2018, PostgreSQL Global Development Group
+ * Author: Andrey Lepikhov <a.lepikhov@postgrespro.ru>
+ *
+ * IDENTIFICATION
+ *	contrib/pargres/columnar.h
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef COLUMNAR_H_
+#define COLUMNAR_H_
+
+#include "executor/tuptable.h"
+#include "lib/stringinfo.h"
+
+
+/* Max number of rows in the batch */
+#define COLUMNAR_BATCH_ROWS	(1024)
+
+/* Rows accumulated for one destination */
+typedef struct
+{
+	TupleDesc		tupdesc;
+	int				nrows;
+	Datum			*values; /* COLUMNAR_BATCH_ROWS x natts */
+	bool			*isnull;
+	MemoryContext	mcxt; /* copies of by-reference values */
+} ColumnarBatch;
+
+/* Decoder of the received columnar block */
+typedef struct
+{
+	TupleDesc	tupdesc;
+	int			nrows;
+	int			row;
+	uint32		*encoding;
+	bits8		**nulls;
+	char		**data;
+	uint32		**offsets;
+	uint16		**codes;
+} ColumnarReader;
+
+extern ColumnarBatch *COLUMNAR_Create_batch(TupleDesc tupdesc);
+extern bool COLUMNAR_Add_row(ColumnarBatch *batch, Datum *values,
+							 bool *isnull);
+extern void COLUMNAR_Encode(ColumnarBatch *batch, StringInfo out);
+extern void COLUMNAR_Init_reader(ColumnarReader *reader, TupleDesc tupdesc);
+extern void COLUMNAR_Open(ColumnarReader *reader, char *block);
+extern bool COLUMNAR_Next(ColumnarReader *reader, TupleTableSlot *slot);
+
+#endif /* COLUMNAR_H_ */
@@ -29,6 +29,12 @@ int nodes_at_cluster;
 char	*pargres_hosts_string = NULL;
 char	*pargres_ports_string = NULL;
 int		eports_pool_size = 100;
+int		exchange_queue_size = 1024;
+bool	exchange_unix_sockets = true;
+int		exchange_compression_min_width = -1;
+bool	exchange_columnar = false;
+bool	pargres_trace = false;
+char	*trace_directory = NULL;
 
 int CoordNode = -1;
 bool PargresInitialized = false;
@@ -19,6 +19,12 @@
 #include "storage/lock.h"
 
 
+/* Name of relation with fragmentation options */
+#define RELATIONS_FRAG_CONFIG		"relsfrag"
+
+/* Name of relation with colocation groups */
+#define RELATIONS_COLOCATION_CONFIG	"colocation_groups"
+
 typedef struct
 {
 	LWLock	lock;
@@ -34,6 +40,12 @@ extern int		nodes_at_cluster;
 extern char		*pargres_hosts_string;
 extern char		*pargres_ports_string;
 extern int		eports_pool_size;
+extern int		exchange_queue_size;
+extern bool		exchange_unix_sockets;
+extern int		exchange_compression_min_width;
+extern bool		exchange_columnar;
+extern bool		pargres_trace;
+extern char		*trace_directory;
 
 extern PortStack *PORTS;
 extern int CoordNode;
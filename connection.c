@@ -11,20 +11,38 @@
 
 #include "postgres.h"
 
+#include "access/parallel.h"
+#include "access/xact.h"
+#include "catalog/pg_type.h"
 #include "common/ip.h"
+#include "common/pg_lzcompress.h"
 #include "libpq/libpq.h"
 #include "libpq-fe.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/latch.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/timestamp.h"
 #include "utils/varlena.h"
 
 #include "common.h"
 #include "connection.h"
+#include "stats.h"
+#include "trace.h"
 
 #include "stdio.h"
+#include "sys/un.h"
 #include "unistd.h"
 
 typedef PGconn* ppgconn;
 
+/*
+ * Time to wait for the Unix socket of a co-located instance. If the instance
+ * could not listen it, the TCP port is used.
+ */
+#define LOCAL_CONNECT_TIMEOUT_MS	(1000)
+
 
 MemoryContext	ParGRES_context;
 
@@ -34,7 +52,7 @@ pgsocket	CoordSock = PGINVALID_SOCKET;
 in_addr_t	pargres_hosts[NODES_MAX_NUM];
 in_addr_t	pargres_ports[NODES_MAX_NUM];
 List		*pargres_host_names = NULL;
-ConnInfoPool ProcessSharedConnInfoPool;
+ConnInfoPool *ProcessSharedConnInfoPool = NULL;
 
 /*
  * Connection descriptors of Coordinator node for a system message passing.
@@ -45,15 +63,38 @@ pgsocket	ServiceSock[NODES_MAX_NUM];
 
 static ppgconn *conn = NULL;
 
+/* The statement is launched at remote instances and not completed yet */
+static bool query_launched = false;
+static instr_time query_launch_time;
+
+/* Statements with parameters, prepared at remote instances by the session */
+typedef struct
+{
+	char	*query;
+	int		nparams;
+	Oid		*types;
+	char	name[NAMEDATALEN];
+} RemoteStatement;
+
+static List *remote_statements = NIL;
+
+/* Names of the prepared statements are not reused after a failure */
+static int remote_statement_counter = 0;
+
 ConnInfo	*BackendConnInfo = NULL;
 
 
 static int _select(int nfds, fd_set *readfds, fd_set *writefds,
 				   struct timeval *timeout);
+static int _wait(uint32 wait_event_info, int nfds, fd_set *readfds,
+				 fd_set *writefds);
+static void on_xact_event(XactEvent event, void *arg);
 static int _accept(pgsocket socket, struct sockaddr *addr,
 				   socklen_t *length_ptr);
 static int _send(int socket, void *buffer, size_t size, int flags);
 static int _recv(int socket, void *buffer, size_t size, int flags);
+static char *reserve_queue(ex_conn_t *conn, int node, int size);
+static void flush_batch(ex_conn_t *conn, int node);
 
 #define HOST_NAME(node)	((char *)(list_nth(pargres_host_names, node)))
 #define PORT_NUM(node)	(pargres_ports[node])
@@ -108,6 +149,23 @@ CONN_Init_module(void)
 	}
 
 	MemoryContextSwitchTo(oldCxt);
+
+	RegisterXactCallback(on_xact_event, NULL);
+}
+
+/*
+ * Failed statement will not wait for remote results. Next statement must be
+ * launched again. The executor of the statement is not ended, so its trace is
+ * dropped.
+ */
+static void
+on_xact_event(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_ABORT)
+	{
+		query_launched = false;
+		TRACE_Reset();
+	}
 }
 
 /*
@@ -185,6 +243,127 @@ ListenPort(int port, pgsocket *sock)
 	return actual_port_num;
 }
 
+/*
+ * Create, bind and listen Unix domain socket for the port number. It is used
+ * by co-located instances instead of the TCP loopback.
+ */
+int
+ListenUnixPort(int port, pgsocket *sock)
+{
+	struct sockaddr_un	addr;
+
+	Assert(sock != NULL);
+	Assert(port > 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	UNIXSOCK_PATH_BUILD(addr.sun_path, port);
+
+	/* Socket file can be left by a crashed backend */
+	unlink(addr.sun_path);
+
+	*sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (*sock < 0)
+	{
+		perror("Error on unix socket creation");
+		return -1;
+	}
+
+	if (bind(*sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+	{
+		perror("Error on unix socket binding");
+		closesocket(*sock);
+		*sock = PGINVALID_SOCKET;
+		return -1;
+	}
+
+	if (listen(*sock, 1024) != 0)
+	{
+		perror("Error on unix socket listening");
+		closesocket(*sock);
+		*sock = PGINVALID_SOCKET;
+		return -1;
+	}
+
+	if (!pg_set_noblock(*sock))
+		elog(ERROR, "Nonblocking socket failed. ");
+
+	return port;
+}
+
+/*
+ * Is the node placed on the same host with this instance?
+ */
+bool
+CONN_Is_local_node(int node)
+{
+	in_addr_t host = ntohl(pargres_hosts[node]);
+	in_addr_t myhost = ntohl(pargres_hosts[node_number]);
+
+	if (!exchange_unix_sockets)
+		return false;
+
+	if (host == myhost)
+		return true;
+
+	/* All 127.x.x.x addresses are loopback */
+	return ((host >> 24) == 127) && ((myhost >> 24) == 127);
+}
+
+/*
+ * Establish connection with a co-located instance by the Unix domain socket.
+ * Returns PGINVALID_SOCKET, if the instance does not listen the socket during
+ * LOCAL_CONNECT_TIMEOUT_MS. The caller connects to the TCP port then.
+ */
+pgsocket
+CONN_Connect_local(int port)
+{
+	pgsocket			sock;
+	struct sockaddr_un	addr;
+	int					res;
+	TimestampTz			start = GetCurrentTimestamp();
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(sock < 0)
+	{
+		perror("ERROR on connect");
+		return PGINVALID_SOCKET;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	UNIXSOCK_PATH_BUILD(addr.sun_path, port);
+
+	/* Socket file is absent until the server will bind it */
+	pgstat_report_wait_start(WAIT_EVENT_EXCHANGE_CONNECT);
+	for (;;)
+	{
+		res = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+
+		if (res == 0)
+			break;
+		if (errno == EINTR)
+			continue;
+		if (((errno != ECONNREFUSED) && (errno != ENOENT)) ||
+			TimestampDifferenceExceeds(start, GetCurrentTimestamp(),
+									   LOCAL_CONNECT_TIMEOUT_MS))
+			break;
+
+		CHECK_FOR_INTERRUPTS();
+		pg_usleep(1000L);
+	}
+	pgstat_report_wait_end();
+
+	if (res < 0)
+	{
+		perror("CONNECT");
+		closesocket(sock);
+		return PGINVALID_SOCKET;
+	}
+
+	return sock;
+}
+
 /*
  * Low-level routine to establish connection with server, defined by the pair
  * (host, port).
@@ -207,10 +386,12 @@ CONN_Connect(int port, in_addr_t host)
 	addr.sin_port = htons(port);
 	addr.sin_addr.s_addr = host;
 
+	pgstat_report_wait_start(WAIT_EVENT_EXCHANGE_CONNECT);
 	do
 	{
 		res = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
 	} while (res < 0 && ((errno == EINTR) || (errno == ECONNREFUSED)));
+	pgstat_report_wait_end();
 
 	if (res < 0)
 		perror("CONNECT");
@@ -234,16 +415,21 @@ InstanceConnectionsSetup(void)
 
 	PostmasterConnectionsSetup();
 	QueryExecutionInitialize(CoordinatorPort);
+	STATS_Count(STAT_CLUSTER_SETUPS);
 }
 
 /*
- * Initialize connections to all another instances
+ * Initialize connections to all another instances.
+ * Connections are established concurrently by PQconnectPoll(). So the setup
+ * time is bounded by the slowest instance, not by the sum of them.
  */
 int
 PostmasterConnectionsSetup(void)
 {
-	int node;
-	char conninfo[STRING_SIZE_MAX];
+	int						node;
+	char					conninfo[STRING_SIZE_MAX];
+	PostgresPollingStatusType	status[NODES_MAX_NUM];
+	int						nactive = 0;
 
 	if (!conn)
 		/* Also, which set conn[node] to NULL value*/
@@ -254,47 +440,131 @@ PostmasterConnectionsSetup(void)
 
 	for (node = 0; node < nodes_at_cluster; node++)
 	{
-		if ((node != node_number) && (conn[node] == NULL))
+		status[node] = PGRES_POLLING_OK;
+
+		if ((node == node_number) || (conn[node] != NULL))
+			continue;
+
+		sprintf(conninfo, "host=%s port=%d%c", HOST_NAME(node),
+													PORT_NUM(node), '\0');
+		conn[node] = PQconnectStart(conninfo);
+		if ((conn[node] == NULL) || (PQstatus(conn[node]) == CONNECTION_BAD))
+		{
+			elog(LOG, "Connection error. conninfo: %s", conninfo);
+			return -1;
+		}
+
+		/* Poll the socket for writing first, like PQconnectdb() */
+		status[node] = PGRES_POLLING_WRITING;
+		nactive++;
+	}
+
+	while (nactive > 0)
+	{
+		fd_set	readset;
+		fd_set	writeset;
+		int		high_sock = -1;
+
+		FD_ZERO(&readset);
+		FD_ZERO(&writeset);
+
+		for (node = 0; node < nodes_at_cluster; node++)
+		{
+			if (status[node] == PGRES_POLLING_READING)
+				FD_SET(PQsocket(conn[node]), &readset);
+			else if (status[node] == PGRES_POLLING_WRITING)
+				FD_SET(PQsocket(conn[node]), &writeset);
+			else
+				continue;
+
+			high_sock = Max(high_sock, PQsocket(conn[node]));
+		}
+
+		CHECK_FOR_INTERRUPTS();
+		if (_wait(WAIT_EVENT_EXCHANGE_CONNECT, high_sock + 1, &readset,
+				  &writeset) < 0)
+			elog(ERROR, "Connection setup error: %m");
+
+		for (node = 0; node < nodes_at_cluster; node++)
 		{
-			sprintf(conninfo, "host=%s port=%d%c", HOST_NAME(node),
-														PORT_NUM(node), '\0');
-			conn[node] = PQconnectdb(conninfo);
-			if (PQstatus(conn[node]) == CONNECTION_BAD)
+			if (((status[node] != PGRES_POLLING_READING) ||
+				 !FD_ISSET(PQsocket(conn[node]), &readset)) &&
+				((status[node] != PGRES_POLLING_WRITING) ||
+				 !FD_ISSET(PQsocket(conn[node]), &writeset)))
+				continue;
+
+			/* Socket can be changed by the poll call */
+			status[node] = PQconnectPoll(conn[node]);
+
+			if (status[node] == PGRES_POLLING_FAILED)
 			{
-				elog(LOG, "Connection error. conninfo: %s", conninfo);
+				elog(LOG, "Connection error to node %d: %s", node,
+					 PQerrorMessage(conn[node]));
 				return -1;
 			}
+
+			if (status[node] != PGRES_POLLING_OK)
+				continue;
+
+			nactive--;
+
+			/* Queries and results are passed by the event loop */
+			if (PQsetnonblocking(conn[node], 1) != 0)
+				elog(ERROR, "Nonblocking connection failed: %s",
+					 PQerrorMessage(conn[node]));
 		}
 	}
+
 	return 0;
 }
 
+/*
+ * Accept cnum connections from any of listening sockets.
+ */
 static void
-accept_connections(pgsocket sock, int cnum, pgsocket *incoming_socks)
+accept_connections(pgsocket *lsocks, int nlsocks, int cnum,
+				   pgsocket *incoming_socks)
 {
 	fd_set readset;
 
-	Assert(sock > 0);
+	Assert(lsocks != NULL);
 	Assert(incoming_socks != NULL);
 
 	for (; (cnum > 0); )
 	{
+		int high_sock = 0;
+		int i;
+
 		FD_ZERO(&readset);
-		FD_SET(sock, &readset);
+		for (i = 0; i < nlsocks; i++)
+		{
+			if (lsocks[i] == PGINVALID_SOCKET)
+				continue;
+
+			FD_SET(lsocks[i], &readset);
+			if (high_sock < lsocks[i])
+				high_sock = lsocks[i];
+		}
+		Assert(high_sock > 0);
 
-		if(_select(sock+1, &readset, NULL, NULL) <= 0)
+		if (_wait(WAIT_EVENT_EXCHANGE_CONNECT, high_sock+1, &readset, NULL) <= 0)
 			perror("select");
 
-		Assert(FD_ISSET(sock, &readset));
+		for (i = 0; (i < nlsocks) && (cnum > 0); i++)
+		{
+			if ((lsocks[i] == PGINVALID_SOCKET) ||
+				!FD_ISSET(lsocks[i], &readset))
+				continue;
 
-		cnum--;
-		incoming_socks[cnum] = _accept(sock, NULL, NULL);
+			cnum--;
+			incoming_socks[cnum] = _accept(lsocks[i], NULL, NULL);
 
-		if (incoming_socks[cnum] < 0)
-			perror("  accept() failed");
+			if (incoming_socks[cnum] < 0)
+				perror("  accept() failed");
 
-		if (!pg_set_noblock(incoming_socks[cnum]))
-			elog(ERROR, "Nonblocking socket failed. ");
+			if (!pg_set_noblock(incoming_socks[cnum]))
+				elog(ERROR, "Nonblocking socket failed. ");
+		}
 	}
 }
 
@@ -306,14 +576,16 @@ ServiceConnectionSetup(void)
 		pgsocket	*isocks = palloc((nodes_at_cluster-1)*sizeof(pgsocket));
 		int			i;
 
-		accept_connections(ServiceSock[node_number], nodes_at_cluster-1, isocks);
+		accept_connections(&ServiceSock[node_number], 1, nodes_at_cluster-1,
+						   isocks);
 		for (i = 0; i < nodes_at_cluster-1; i++)
 		{
-			int nodenum;
+			int *nodenum;
 
-			CONN_Recv(isocks, nodes_at_cluster-1, &nodenum, sizeof(int));
-			Assert(nodenum != node_number);
-			ServiceSock[nodenum] = isocks[i];
+			nodenum = CONN_Recv_message(isocks[i], CONN_MSG_HELLO, NULL);
+			Assert(*nodenum != node_number);
+			ServiceSock[*nodenum] = isocks[i];
+			pfree(nodenum);
 		}
 
 		pfree(isocks);
@@ -325,7 +597,263 @@ ServiceConnectionSetup(void)
 	{
 		CoordSock = CONN_Connect(CoordinatorPort, pargres_hosts[CoordNode]);
 		Assert(CoordSock > 0);
-		CONN_Send(CoordSock, &node_number, sizeof(int));
+		CONN_Send_message(CoordSock, CONN_MSG_HELLO, &node_number,
+						  sizeof(int));
+	}
+}
+
+/*
+ * Send the control message to the service channel.
+ */
+void
+CONN_Send_message(pgsocket sock, conn_msg_type type, void *data, int size)
+{
+	ConnMsgHeader	header;
+
+	Assert(size >= 0);
+	header.type = type;
+	header.size = size;
+
+	if ((CONN_Send(sock, &header, sizeof(ConnMsgHeader)) < 0) ||
+		((size > 0) && (CONN_Send(sock, data, size) < 0)))
+		elog(ERROR, "Control message %d sending error: %m", type);
+}
+
+static void
+recv_exactly(pgsocket sock, char *buf, int size)
+{
+	while (size > 0)
+	{
+		int res = _recv(sock, buf, size, 0);
+
+		if ((res < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+		{
+			fd_set readset;
+
+			FD_ZERO(&readset);
+			FD_SET(sock, &readset);
+			CHECK_FOR_INTERRUPTS();
+			_wait(WAIT_EVENT_EXCHANGE_CONNECT, sock + 1, &readset, NULL);
+			continue;
+		}
+
+		if (res < 0)
+			elog(ERROR, "Control message receiving error: %m");
+		if (res == 0)
+			elog(ERROR, "Service connection is closed by the peer");
+
+		buf += res;
+		size -= res;
+	}
+}
+
+/*
+ * Statistics of the statement are sent by the remote instances at the end of
+ * the exchange or execution. They can arrive at any time.
+ */
+static bool
+store_statistics(uint32 type, char *data)
+{
+	switch (type)
+	{
+	case CONN_MSG_EXEC_STATS:
+		STATS_Store_execution((ExecutionStats *) data);
+		return true;
+	case CONN_MSG_KEY_TRAFFIC:
+		STATS_Store_key_traffic((KeyTraffic *) data);
+		return true;
+	default:
+		return false;
+	}
+}
+
+static char *
+recv_message(pgsocket sock, ConnMsgHeader *header)
+{
+	char *data;
+
+	recv_exactly(sock, (char *) header, sizeof(ConnMsgHeader));
+
+	data = palloc(header->size + 1);
+	recv_exactly(sock, data, header->size);
+	data[header->size] = '\0';
+	return data;
+}
+
+/*
+ * Receive the control message of the given type from the service channel.
+ * Returns the palloc'ed payload and its size.
+ */
+void *
+CONN_Recv_message(pgsocket sock, conn_msg_type type, int *size)
+{
+	ConnMsgHeader	header;
+	char			*data;
+
+	for (;;)
+	{
+		data = recv_message(sock, &header);
+
+		if (header.type == type)
+			break;
+
+		if (!store_statistics(header.type, data))
+			elog(ERROR, "Unexpected control message %u, expected %d",
+				 header.type, type);
+
+		pfree(data);
+	}
+
+	if (size != NULL)
+		*size = header.size;
+	return data;
+}
+
+/*
+ * Store statistics, sent by the remote instances. Messages, which are not
+ * arrived yet, are not waited for.
+ */
+void
+CONN_Receive_statistics(void)
+{
+	int node;
+
+	for (node = 0; node < nodes_at_cluster; node++)
+	{
+		pgsocket sock = ServiceSock[node];
+
+		if ((node == node_number) || (sock == PGINVALID_SOCKET))
+			continue;
+
+		for (;;)
+		{
+			fd_set			readset;
+			struct timeval	timeout = {0, 0};
+			ConnMsgHeader	header;
+			char			*data;
+
+			FD_ZERO(&readset);
+			FD_SET(sock, &readset);
+			if (_select(sock + 1, &readset, NULL, &timeout) <= 0)
+				break;
+
+			data = recv_message(sock, &header);
+			if (!store_statistics(header.type, data))
+				elog(ERROR, "Unexpected control message %u", header.type);
+			pfree(data);
+		}
+	}
+}
+
+/*
+ * Check the condition at all instances, which execute the statement. Each
+ * instance must call it at the same point of the statement. Remote instances
+ * send their vote to the coordinator, which replies by the result to all of
+ * them. Returns true if the condition holds at each instance.
+ */
+bool
+CONN_Vote(bool vote)
+{
+	int		result = vote;
+	int		*data;
+	int		size;
+	int		node;
+
+	if (nodes_at_cluster == 1)
+		return vote;
+
+	if (CoordNode == node_number)
+	{
+		for (node = 0; node < nodes_at_cluster; node++)
+		{
+			if (node == node_number)
+				continue;
+
+			Assert(ServiceSock[node] > 0);
+			data = CONN_Recv_message(ServiceSock[node], CONN_MSG_VOTE, &size);
+			if (size != sizeof(int))
+				elog(ERROR, "Wrong size of the vote message: %d", size);
+			result = result && *data;
+			pfree(data);
+		}
+
+		for (node = 0; node < nodes_at_cluster; node++)
+		{
+			if (node == node_number)
+				continue;
+
+			CONN_Send_message(ServiceSock[node], CONN_MSG_VOTE, &result,
+							  sizeof(int));
+		}
+	}
+	else
+	{
+		Assert(CoordSock > 0);
+		CONN_Send_message(CoordSock, CONN_MSG_VOTE, &result, sizeof(int));
+
+		data = CONN_Recv_message(CoordSock, CONN_MSG_VOTE, &size);
+		if (size != sizeof(int))
+			elog(ERROR, "Wrong size of the vote message: %d", size);
+		result = *data;
+		pfree(data);
+	}
+
+	return (result != 0);
+}
+
+/*
+ * Push queries to all remote instances concurrently. A node, which does not
+ * read its socket, does not delay sending to another nodes.
+ */
+static void
+flush_queries(void)
+{
+	for (;;)
+	{
+		fd_set	readset;
+		fd_set	writeset;
+		int		high_sock = -1;
+		int		node;
+
+		FD_ZERO(&readset);
+		FD_ZERO(&writeset);
+
+		for (node = 0; node < nodes_at_cluster; node++)
+		{
+			int res;
+
+			if (conn[node] == NULL)
+				continue;
+
+			if ((res = PQflush(conn[node])) < 0)
+				elog(ERROR, "Query sending error: %s",
+					 PQerrorMessage(conn[node]));
+
+			if (res == 0)
+				continue;
+
+			/* Server can wait for reading of its output by us */
+			FD_SET(PQsocket(conn[node]), &readset);
+			FD_SET(PQsocket(conn[node]), &writeset);
+			high_sock = Max(high_sock, PQsocket(conn[node]));
+		}
+
+		if (high_sock < 0)
+			return;
+
+		CHECK_FOR_INTERRUPTS();
+		if (_wait(WAIT_EVENT_DISPATCH_SEND, high_sock + 1, &readset,
+				  &writeset) < 0)
+			elog(ERROR, "Query sending error: %m");
+
+		for (node = 0; node < nodes_at_cluster; node++)
+		{
+			if ((conn[node] != NULL) &&
+				FD_ISSET(PQsocket(conn[node]), &readset) &&
+				!PQconsumeInput(conn[node]))
+				elog(ERROR, "Query sending error: %s",
+					 PQerrorMessage(conn[node]));
+		}
 	}
 }
 
@@ -354,6 +882,8 @@ QueryExecutionInitialize(int port)
 		Assert(status > 0);
 	}
 
+	/* Instances connect to the service socket after receiving the query */
+	flush_queries();
 	ServiceConnectionSetup();
 	CONN_Check_query_result();
 
@@ -361,9 +891,21 @@ QueryExecutionInitialize(int port)
 }
 
 int
-CONN_Launch_query(const char *query)
+CONN_Launch_query(const char *query, uint64 queryId)
 {
-	int node;
+	int		node;
+	char	*text;
+
+	/* Nested statements are executed by the remote instances themselves */
+	if (query_launched)
+		return 0;
+
+	/* Statistics of the previous statements, if not received yet */
+	CONN_Receive_statistics();
+
+	/* Remote instances get the distributed id of the statement */
+	TRACE_New_query(queryId, query);
+	text = psprintf("%s%s", TRACE_Query_comment(0), query);
 
 	for (node = 0; node < nodes_at_cluster; node++)
 	{
@@ -372,7 +914,7 @@ CONN_Launch_query(const char *query)
 		if (node == node_number)
 			continue;
 
-		result = PQsendQuery(conn[node], query);
+		result = PQsendQuery(conn[node], text);
 
 		if (result == 0)
 			elog(ERROR, "Query sending error: %s", PQerrorMessage(conn[node]));
@@ -380,33 +922,293 @@ CONN_Launch_query(const char *query)
 		Assert(result >= 0);
 	}
 
+	flush_queries();
+	query_launched = true;
+	INSTR_TIME_SET_CURRENT(query_launch_time);
+	pfree(text);
 	return 0;
 }
 
-void
-CONN_Check_query_result(void)
+static RemoteStatement *
+find_remote_statement(const char *query, int nparams, Oid *types)
 {
-	int node;
-	PGresult *result;
+	ListCell *lc;
 
-	if (!conn)
-		return;
-
-	do
+	foreach(lc, remote_statements)
 	{
+		RemoteStatement *stmt = (RemoteStatement *) lfirst(lc);
+
+		if ((stmt->nparams == nparams) && (strcmp(stmt->query, query) == 0) &&
+			(memcmp(stmt->types, types, nparams * sizeof(Oid)) == 0))
+			return stmt;
+	}
+
+	return NULL;
+}
+
+/*
+ * Prepare the statement at all remote instances. Waits for the completion.
+ * The last of nparams + 1 types is the type of the distributed id parameter.
+ */
+static RemoteStatement *
+prepare_remote_statement(const char *query, int nparams, Oid *types)
+{
+	MemoryContext	oldCxt;
+	RemoteStatement	*stmt;
+	char			name[NAMEDATALEN];
+	int				node;
+	char			*text;
+
+	snprintf(name, NAMEDATALEN, "pargres_%d", remote_statement_counter++);
+
+	/* Id of each execution is passed by the additional parameter */
+	text = psprintf("%s%s", TRACE_Query_comment(nparams + 1), query);
+
+	for (node = 0; node < nodes_at_cluster; node++)
+	{
+		if (node == node_number)
+			continue;
+
+		if (!PQsendPrepare(conn[node], name, text, nparams + 1, types))
+			elog(ERROR, "Statement preparing error: %s",
+				 PQerrorMessage(conn[node]));
+	}
+
+	/* Raises an error if the preparation failed at any of the instances */
+	flush_queries();
+	CONN_Check_query_result();
+	pfree(text);
+
+	/* The statement is prepared at all instances, cache it */
+	oldCxt = MemoryContextSwitchTo(ParGRES_context);
+	stmt = palloc(sizeof(RemoteStatement));
+	stmt->query = pstrdup(query);
+	stmt->nparams = nparams;
+	stmt->types = palloc(nparams * sizeof(Oid));
+	memcpy(stmt->types, types, nparams * sizeof(Oid));
+	strlcpy(stmt->name, name, NAMEDATALEN);
+	remote_statements = lappend(remote_statements, stmt);
+	MemoryContextSwitchTo(oldCxt);
+	return stmt;
+}
+
+/*
+ * Launch the statement with parameters. It is prepared at each instance once
+ * per session. Next executions send values of the parameters only, in the text
+ * format.
+ */
+int
+CONN_Launch_prepared(const char *query, ParamListInfo params, uint64 queryId)
+{
+	RemoteStatement	*stmt;
+	int				nparams = (params != NULL) ? params->numParams : 0;
+	Oid				*types;
+	char			**values;
+	int				i;
+	int				node;
+
+	if (query_launched)
+		return 0;
+
+	if (nparams == 0)
+		return CONN_Launch_query(query, queryId);
+
+	CONN_Receive_statistics();
+	TRACE_New_query(queryId, query);
+	types = palloc((nparams + 1) * sizeof(Oid));
+	values = palloc((nparams + 1) * sizeof(char *));
+
+	for (i = 0; i < nparams; i++)
+	{
+		ParamExternData	*prm;
+		ParamExternData	prmdata;
+
+		if (params->paramFetch != NULL)
+			prm = params->paramFetch(params, i + 1, false, &prmdata);
+		else
+			prm = &params->params[i];
+
+		types[i] = prm->ptype;
+		values[i] = NULL;
+
+		if (!prm->isnull && OidIsValid(prm->ptype))
+		{
+			Oid		typoutput;
+			bool	typisvarlena;
+
+			getTypeOutputInfo(prm->ptype, &typoutput, &typisvarlena);
+			values[i] = OidOutputFunctionCall(typoutput, prm->value);
+		}
+	}
+
+	types[nparams] = TEXTOID;
+	values[nparams] = TRACE_Query_value();
+
+	if ((stmt = find_remote_statement(query, nparams, types)) == NULL)
+		stmt = prepare_remote_statement(query, nparams, types);
+
+	for (node = 0; node < nodes_at_cluster; node++)
+	{
+		if (node == node_number)
+			continue;
+
+		if (!PQsendQueryPrepared(conn[node], stmt->name, nparams + 1,
+								 (const char *const *) values, NULL, NULL, 0))
+			elog(ERROR, "Query sending error: %s", PQerrorMessage(conn[node]));
+	}
+
+	flush_queries();
+	query_launched = true;
+	INSTR_TIME_SET_CURRENT(query_launch_time);
+
+	pfree(types);
+	pfree(values);
+	return 0;
+}
+
+/*
+ * Wait for completion of the query at all remote instances. Results are
+ * collected by one event loop over all sockets. So we wait for the slowest
+ * node only, not for the sum of waits.
+ * If texts is not NULL, first column of the result rows of each node is
+ * appended to texts[node] line by line.
+ * A failure at a remote instance raises an error, after the results of all
+ * instances are collected: connections stay ready for the next statement.
+ */
+static void
+collect_results(StringInfo texts)
+{
+	bool	active[NODES_MAX_NUM];
+	int		nactive = 0;
+	int		node;
+	int		failed_node = -1;
+	char	*failure = NULL;
+
+	if (!conn)
+		return;
+
+	for (node = 0; node < nodes_at_cluster; node++)
+	{
+		active[node] = (conn[node] != NULL);
+		if (active[node])
+			nactive++;
+	}
+
+	for (;;)
+	{
+		fd_set	readset;
+		fd_set	writeset;
+		int		high_sock = -1;
+
+		FD_ZERO(&readset);
+		FD_ZERO(&writeset);
+
 		for (node = 0; node < nodes_at_cluster; node++)
 		{
-			if (conn[node] == NULL)
+			int res;
+
+			if (!active[node])
 				continue;
 
-			if ((result = PQgetResult(conn[node])) != NULL)
+			/* Take all results, which are arrived already */
+			while (!PQisBusy(conn[node]))
 			{
+				PGresult *result = PQgetResult(conn[node]);
+
+				if (result == NULL)
+				{
+					active[node] = false;
+					nactive--;
+					break;
+				}
+
 				elog(LOG, "[%d]: %s", node, PQcmdStatus(result));
-				Assert(PQresultStatus(result) != PGRES_FATAL_ERROR);
-				break;
+
+				if ((PQresultStatus(result) == PGRES_FATAL_ERROR) &&
+					(failure == NULL))
+				{
+					failed_node = node;
+					failure = pstrdup(PQresultErrorMessage(result));
+				}
+
+				if ((texts != NULL) &&
+					(PQresultStatus(result) == PGRES_TUPLES_OK))
+				{
+					int row;
+
+					for (row = 0; row < PQntuples(result); row++)
+						appendStringInfo(&texts[node], "%s\n",
+										 PQgetvalue(result, row, 0));
+				}
+				PQclear(result);
 			}
+
+			if (!active[node])
+				continue;
+
+			if ((res = PQflush(conn[node])) < 0)
+				elog(ERROR, "Query sending error: %s",
+					 PQerrorMessage(conn[node]));
+
+			FD_SET(PQsocket(conn[node]), &readset);
+			if (res > 0)
+				FD_SET(PQsocket(conn[node]), &writeset);
+			high_sock = Max(high_sock, PQsocket(conn[node]));
 		}
-	} while (result);
+
+		if (nactive == 0)
+			break;
+
+		CHECK_FOR_INTERRUPTS();
+		if (_wait(WAIT_EVENT_DISPATCH_RESULT, high_sock + 1, &readset,
+				  &writeset) < 0)
+			elog(ERROR, "Query result receiving error: %m");
+
+		for (node = 0; node < nodes_at_cluster; node++)
+		{
+			if (active[node] && FD_ISSET(PQsocket(conn[node]), &readset) &&
+				!PQconsumeInput(conn[node]))
+				elog(ERROR, "Query result receiving error: %s",
+					 PQerrorMessage(conn[node]));
+		}
+	}
+
+	if (query_launched)
+	{
+		instr_time	elapsed;
+
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, query_launch_time);
+		STATS_Report_dispatch(elapsed);
+	}
+
+	query_launched = false;
+
+	if (failure != NULL)
+		elog(ERROR, "Remote execution error at node %d: %s", failed_node,
+			 failure);
+}
+
+void
+CONN_Check_query_result(void)
+{
+	collect_results(NULL);
+}
+
+/*
+ * Wait for completion of the query and return its results. Used by EXPLAIN
+ * ANALYZE to show plans of the remote instances. texts is an array of
+ * nodes_at_cluster initialized strings.
+ * Returns false if the results were collected already.
+ */
+bool
+CONN_Get_query_result(StringInfo texts)
+{
+	if (!query_launched)
+		return false;
+
+	collect_results(texts);
+	return true;
 }
 
 static int
@@ -418,6 +1220,16 @@ sendall(int s, char *buf, int len, int flags)
     while(total < len)
     {
         n = _send(s, buf+total, len-total, flags);
+        if ((n == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+        {
+            fd_set writeset;
+
+            /* Nonblocking socket is overflowed. Wait for free space. */
+            FD_ZERO(&writeset);
+            FD_SET(s, &writeset);
+            _wait(WAIT_EVENT_EXCHANGE_SEND, s+1, NULL, &writeset);
+            continue;
+        }
         if(n == -1) { break; }
         total += n;
     }
@@ -425,7 +1237,14 @@ sendall(int s, char *buf, int len, int flags)
     return (n==-1 ? -1 : total);
 }
 
-static pgsocket BackendExchangeListenSock = PGINVALID_SOCKET;
+/*
+ * Listening sockets of the exchange port: TCP socket for remote instances and
+ * Unix domain socket for co-located instances.
+ */
+#define EXCHANGE_LISTEN_TCP		(0)
+#define EXCHANGE_LISTEN_UNIX	(1)
+static pgsocket BackendExchangeListenSock[2] = {PGINVALID_SOCKET,
+												PGINVALID_SOCKET};
 
 void
 CONN_Init_exchange(ConnInfo *pool, ex_conn_t *exconn, int mynum, int nnodes)
@@ -439,24 +1258,57 @@ CONN_Init_exchange(ConnInfo *pool, ex_conn_t *exconn, int mynum, int nnodes)
 	exconn->rsIsOpened = palloc(sizeof(pgsocket) * nnodes);
 	exconn->wsock = palloc(sizeof(pgsocket) * nnodes);
 	exconn->wsIsOpened = palloc(sizeof(pgsocket) * nnodes);
+	exconn->wbuf = palloc0(sizeof(StringInfoData) * nnodes);
+	exconn->rbuf = palloc0(sizeof(StringInfoData) * nnodes);
+	exconn->cbuf = palloc0(sizeof(StringInfoData) * nnodes);
+	exconn->dbuf = palloc0(sizeof(StringInfoData) * nnodes);
+	exconn->stats = palloc0(sizeof(ExchangePeerStats) * nnodes);
+	exconn->wset = NULL;
+	exconn->wevents = NULL;
+	exconn->wmask = palloc0(sizeof(uint8) * nnodes);
+	STATS_Count(STAT_EXCHANGES_OPENED);
+	INSTR_TIME_SET_ZERO(exconn->send_wait);
+	INSTR_TIME_SET_ZERO(exconn->recv_wait);
+	exconn->compress = false;
+	exconn->rnext = 0;
+	exconn->rnode = 0;
 	exconn->rsock[mynum] = PGINVALID_SOCKET;
 	exconn->rsIsOpened[mynum] = false;
 	exconn->wsock[mynum] = PGINVALID_SOCKET;
 	exconn->wsIsOpened[mynum] = false;
 
-	if (BackendExchangeListenSock == PGINVALID_SOCKET)
-		ListenPort(pool->port[mynum], &BackendExchangeListenSock);
+	if (BackendExchangeListenSock[EXCHANGE_LISTEN_TCP] == PGINVALID_SOCKET)
+	{
+		ListenPort(pool->port[mynum],
+				   &BackendExchangeListenSock[EXCHANGE_LISTEN_TCP]);
+
+		/*
+		 * Listen Unix socket regardless of the pargres.unix_sockets value: it
+		 * defines the behaviour of a connecting side only.
+		 */
+		if (ListenUnixPort(pool->port[mynum],
+						   &BackendExchangeListenSock[EXCHANGE_LISTEN_UNIX]) < 0)
+			elog(LOG, "Exchange port %d is not listened by the Unix socket, co-located instances will connect by TCP",
+				 pool->port[mynum]);
+	}
 
 	/* Init sockets for connection for foreign servers */
 	for (node = 0; node < nnodes; node++)
 	{
 		if (node == node_number)
 			continue;
-		exconn->wsock[node] = CONN_Connect(pool->port[node], pargres_hosts[node]);
+
+		/* Co-located instances bypass the TCP stack */
+		exconn->wsock[node] = PGINVALID_SOCKET;
+		if (CONN_Is_local_node(node))
+			exconn->wsock[node] = CONN_Connect_local(pool->port[node]);
+		if (exconn->wsock[node] == PGINVALID_SOCKET)
+			exconn->wsock[node] = CONN_Connect(pool->port[node],
+											   pargres_hosts[node]);
 		Assert(exconn->wsock[node] > 0);
 	}
 
-	accept_connections(BackendExchangeListenSock, nnodes-1, incoming_socks);
+	accept_connections(BackendExchangeListenSock, 2, nnodes-1, incoming_socks);
 	for (node = 0; node < nnodes; node++)
 	{
 		if (node == node_number)
@@ -464,6 +1316,15 @@ CONN_Init_exchange(ConnInfo *pool, ex_conn_t *exconn, int mynum, int nnodes)
 
 		exconn->wsIsOpened[node] = true;
 		CONN_Send(exconn->wsock[node], &node_number, sizeof(int));
+
+		/*
+		 * Tuples are sent through the queue without blocking. It allows to
+		 * receive incoming tuples while the peer do not read our data.
+		 */
+		if (!pg_set_noblock(exconn->wsock[node]))
+			elog(ERROR, "Nonblocking socket failed. ");
+		initStringInfo(&exconn->wbuf[node]);
+		initStringInfo(&exconn->cbuf[node]);
 	}
 
 	for (node = 0; node < nnodes-1; node++)
@@ -475,6 +1336,8 @@ CONN_Init_exchange(ConnInfo *pool, ex_conn_t *exconn, int mynum, int nnodes)
 		Assert(nodenum != node_number);
 		exconn->rsock[nodenum] = incoming_socks[node];
 		exconn->rsIsOpened[nodenum] = true;
+		initStringInfo(&exconn->rbuf[nodenum]);
+		initStringInfo(&exconn->dbuf[nodenum]);
 	}
 
 	pfree(incoming_socks);
@@ -483,21 +1346,42 @@ CONN_Init_exchange(ConnInfo *pool, ex_conn_t *exconn, int mynum, int nnodes)
 void
 OnExecutionEnd(void)
 {
-	if (BackendExchangeListenSock != PGINVALID_SOCKET)
+	if (BackendExchangeListenSock[EXCHANGE_LISTEN_TCP] != PGINVALID_SOCKET)
 	{
-		if (closesocket(BackendExchangeListenSock) < 0)
+		if (closesocket(BackendExchangeListenSock[EXCHANGE_LISTEN_TCP]) < 0)
 			perror("CLOSE");
-		BackendExchangeListenSock = PGINVALID_SOCKET;
+		BackendExchangeListenSock[EXCHANGE_LISTEN_TCP] = PGINVALID_SOCKET;
+
+		if (BackendExchangeListenSock[EXCHANGE_LISTEN_UNIX] != PGINVALID_SOCKET)
+		{
+			char path[UNIXSOCK_PATH_BUFLEN];
+
+			if (closesocket(BackendExchangeListenSock[EXCHANGE_LISTEN_UNIX]) < 0)
+				perror("CLOSE");
+			BackendExchangeListenSock[EXCHANGE_LISTEN_UNIX] = PGINVALID_SOCKET;
+
+			UNIXSOCK_PATH_BUILD(path, BackendConnInfo->port[node_number]);
+			unlink(path);
+		}
 
 		Assert((BackendConnInfo->port[node_number] > 0) &&
 			   (BackendConnInfo->port[node_number] < PG_UINT16_MAX));
-		STACK_Push(PORTS, BackendConnInfo->port[node_number]);
+
+		/* Port of the worker is returned by the leader */
+		if (!IsParallelWorker())
+			STACK_Push(PORTS, BackendConnInfo->port[node_number]);
 		BackendConnInfo = NULL;
 	}
 	else
 	{
 		/* For EXPLAIN operation */
 	}
+
+	if (!IsParallelWorker() && (ProcessSharedConnInfoPool != NULL))
+	{
+		ReleaseConnectionPool(ProcessSharedConnInfoPool);
+		ProcessSharedConnInfoPool = NULL;
+	}
 }
 
 void
@@ -509,13 +1393,19 @@ CONN_Exchange_close(ex_conn_t *conn)
 
 	for (node = 0; node < nodes_at_cluster; node++)
 	{
-		char close_sig = 'C';
+		char close_sig[EXCHANGE_CLOSE_SIZE];
 
 		if (conn->wsIsOpened[node] == false)
 			continue;
 
+		/* Zero-length tuple is the "End of Tuples" command */
+		memset(close_sig, 0, EXCHANGE_CLOSE_SIZE);
+
 		Assert(conn->wsock[node] > 0);
-		CONN_Send(conn->wsock[node], &close_sig, 1);
+		if (conn->compress)
+			flush_batch(conn, node);
+		memcpy(reserve_queue(conn, node, EXCHANGE_CLOSE_SIZE), close_sig,
+			   EXCHANGE_CLOSE_SIZE);
 		conn->wsIsOpened[node] = false;
 	}
 }
@@ -534,6 +1424,425 @@ CONN_Send(pgsocket sock, void *buf, int size)
 	return 0;
 }
 
+/*
+ * Add the message into the queue of the stream to the node. The queue is
+ * pushed into the socket without blocking after EXCHANGE_FLUSH_SIZE bytes
+ * are accumulated.
+ */
+void
+CONN_Send_async(ex_conn_t *conn, int node, void *buf, int size)
+{
+	memcpy(CONN_Reserve(conn, node, size), buf, size);
+}
+
+/*
+ * Reserve size bytes at the tail of the send queue to the node. The queue is
+ * pushed into the socket without blocking after EXCHANGE_FLUSH_SIZE bytes
+ * are accumulated.
+ */
+static char *
+reserve_queue(ex_conn_t *conn, int node, int size)
+{
+	StringInfo	queue = &conn->wbuf[node];
+	char		*ptr;
+
+	Assert(conn->wsock[node] != PGINVALID_SOCKET);
+
+	if (queue->len - queue->cursor >= EXCHANGE_FLUSH_SIZE)
+		CONN_Flush(conn, node);
+
+	/* Cut off the sent part of the queue before it grows too much */
+	if ((queue->cursor > 0) && (queue->cursor >= queue->len / 2))
+	{
+		queue->len -= queue->cursor;
+		memmove(queue->data, queue->data + queue->cursor, queue->len);
+		queue->data[queue->len] = '\0';
+		queue->cursor = 0;
+	}
+
+	enlargeStringInfo(queue, size);
+	ptr = queue->data + queue->len;
+	queue->len += size;
+	queue->data[queue->len] = '\0';
+
+	return ptr;
+}
+
+/*
+ * Compress accumulated batch of messages to the node and move it into the
+ * send queue. Incompressible batch is moved as is.
+ */
+static void
+flush_batch(ex_conn_t *conn, int node)
+{
+	StringInfo	batch = &conn->cbuf[node];
+	char		*ptr;
+	int32		complen;
+	int			size;
+
+	if (batch->len == 0)
+		return;
+
+	size = EXCHANGE_MSG_SIZE(EXCHANGE_BLOCK_HEADER_SIZE +
+							 PGLZ_MAX_OUTPUT(batch->len));
+	ptr = reserve_queue(conn, node, size);
+	complen = pglz_compress(batch->data, batch->len,
+							ptr + EXCHANGE_BLOCK_HEADER_SIZE,
+							PGLZ_strategy_default);
+
+	/* Return unused space of the reservation back to the queue */
+	conn->wbuf[node].len -= size;
+
+	if (complen < 0)
+		memcpy(reserve_queue(conn, node, batch->len), batch->data,
+			   batch->len);
+	else
+	{
+		/* The block header: compressed and raw sizes */
+		((uint32 *) ptr)[0] = EXCHANGE_MSG_COMPRESSED | (uint32) complen;
+		((uint32 *) ptr)[1] = (uint32) batch->len;
+
+		size = EXCHANGE_MSG_SIZE(EXCHANGE_BLOCK_HEADER_SIZE + complen);
+		memset(ptr + EXCHANGE_BLOCK_HEADER_SIZE + complen, 0,
+			   size - EXCHANGE_BLOCK_HEADER_SIZE - complen);
+		conn->wbuf[node].len += size;
+		conn->wbuf[node].data[conn->wbuf[node].len] = '\0';
+	}
+
+	conn->stats[node].batches++;
+	resetStringInfo(batch);
+}
+
+/*
+ * Reserve size bytes for a message to the node.
+ * The caller forms the message directly in the queue: the space must be
+ * filled before the next operation with the queue.
+ * If compression is enabled, messages are accumulated in the batch, which is
+ * compressed as a whole after EXCHANGE_BATCH_SIZE bytes.
+ */
+char *
+CONN_Reserve(ex_conn_t *conn, int node, int size)
+{
+	StringInfo	batch = &conn->cbuf[node];
+	char		*ptr;
+
+	if (!conn->compress)
+		return reserve_queue(conn, node, size);
+
+	if (batch->len >= EXCHANGE_BATCH_SIZE)
+		flush_batch(conn, node);
+
+	enlargeStringInfo(batch, size);
+	ptr = batch->data + batch->len;
+	batch->len += size;
+	batch->data[batch->len] = '\0';
+
+	return ptr;
+}
+
+/*
+ * Push queued messages of the stream to the node into the socket without
+ * blocking. Returns true if the queue is empty.
+ */
+bool
+CONN_Flush(ex_conn_t *conn, int node)
+{
+	StringInfo	queue = &conn->wbuf[node];
+
+	while (queue->cursor < queue->len)
+	{
+		int res = _send(conn->wsock[node], queue->data + queue->cursor,
+						queue->len - queue->cursor, 0);
+
+		if (res < 0)
+		{
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return false;
+
+			elog(ERROR, "Exchange sending error to node %d: %m", node);
+		}
+
+		queue->cursor += res;
+		conn->stats[node].bytes_sent += res;
+		conn->stats[node].flushes++;
+	}
+
+	resetStringInfo(queue);
+	return true;
+}
+
+/*
+ * Try to flush all queues. Returns true if all of them are empty.
+ */
+bool
+CONN_Flush_all(ex_conn_t *conn)
+{
+	int		node;
+	bool	result = true;
+
+	for (node = 0; node < nodes_at_cluster; node++)
+	{
+		if ((conn->wsock[node] == PGINVALID_SOCKET) ||
+			(conn->wbuf[node].len == 0))
+			continue;
+
+		if (!CONN_Flush(conn, node))
+			result = false;
+	}
+
+	return result;
+}
+
+/*
+ * Flow control: a stream may not keep more than exchange_queue_size kilobytes
+ * of data in flight. Returns true if any stream reached the limit. Caller
+ * must stop the production of tuples and drain incoming streams until
+ * the network unloads queues.
+ */
+bool
+CONN_Queue_is_full(ex_conn_t *conn)
+{
+	int node;
+
+	for (node = 0; node < nodes_at_cluster; node++)
+	{
+		StringInfo	queue = &conn->wbuf[node];
+
+		if (conn->wsock[node] == PGINVALID_SOCKET)
+			continue;
+
+		if ((queue->len - queue->cursor) >= exchange_queue_size * 1024L)
+		{
+			if (!CONN_Flush(conn, node))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Charge the wait to the direction, which ended it. Data to receive ends the
+ * wait of a receiver, even if the queues were flushed meanwhile. A wait, which
+ * was ended by the latch only, is not charged.
+ */
+static void
+charge_wait(ex_conn_t *conn, bool readable, bool writeable,
+			instr_time start, instr_time end)
+{
+	if (readable)
+	{
+		INSTR_TIME_ACCUM_DIFF(conn->recv_wait, end, start);
+		STATS_Count(STAT_RECV_WAITS);
+	}
+	else if (writeable)
+	{
+		INSTR_TIME_ACCUM_DIFF(conn->send_wait, end, start);
+		STATS_Count(STAT_SEND_WAITS);
+	}
+}
+
+/*
+ * Sleep until any of opened incoming streams (if forRead) has data or any
+ * socket with queued messages is ready for writing. Flushes queues of
+ * writable sockets.
+ */
+void
+CONN_Wait(ex_conn_t *conn, bool forRead)
+{
+	fd_set	readset;
+	fd_set	writeset;
+	int		high_sock = 0;
+	int		node;
+	bool	readable = false;
+	bool	writeable = false;
+	instr_time	start;
+	instr_time	end;
+
+	FD_ZERO(&readset);
+	FD_ZERO(&writeset);
+
+	for (node = 0; node < nodes_at_cluster; node++)
+	{
+		if (forRead && conn->rsIsOpened[node])
+		{
+			FD_SET(conn->rsock[node], &readset);
+			if (high_sock < conn->rsock[node])
+				high_sock = conn->rsock[node];
+		}
+
+		if ((conn->wsock[node] != PGINVALID_SOCKET) &&
+			(conn->wbuf[node].len > conn->wbuf[node].cursor))
+		{
+			FD_SET(conn->wsock[node], &writeset);
+			if (high_sock < conn->wsock[node])
+				high_sock = conn->wsock[node];
+		}
+	}
+
+	/* Nothing to wait */
+	if (high_sock == 0)
+		return;
+
+	INSTR_TIME_SET_CURRENT(start);
+	if (_wait(forRead ? WAIT_EVENT_EXCHANGE_RECV : WAIT_EVENT_EXCHANGE_SEND,
+			  high_sock+1, &readset, &writeset) < 0)
+	{
+		perror("WAIT Select error");
+		return;
+	}
+	INSTR_TIME_SET_CURRENT(end);
+
+	for (node = 0; node < nodes_at_cluster; node++)
+	{
+		if (forRead && conn->rsIsOpened[node] &&
+			FD_ISSET(conn->rsock[node], &readset))
+			readable = true;
+
+		if ((conn->wsock[node] != PGINVALID_SOCKET) &&
+			FD_ISSET(conn->wsock[node], &writeset))
+		{
+			writeable = true;
+			CONN_Flush(conn, node);
+		}
+	}
+
+	charge_wait(conn, readable, writeable, start, end);
+}
+
+#define WAIT_READ	(0x01)
+#define WAIT_WRITE	(0x02)
+
+static void
+free_wait_events(void *arg)
+{
+	ex_conn_t *conn = (ex_conn_t *) arg;
+
+	if (conn->wset != NULL)
+		FreeWaitEventSet(conn->wset);
+	conn->wset = NULL;
+}
+
+/*
+ * Create the event set of CONN_Wait_latch() for the sockets of wmask. The set
+ * lives in the memory context of the exchange. A callback of the context
+ * frees it, if the exchange is not ended because of an error: the set holds a
+ * file descriptor.
+ */
+static void
+create_wait_events(ex_conn_t *conn)
+{
+	MemoryContext	cxt = GetMemoryChunkContext(conn->wmask);
+	int				node;
+
+	if (conn->wset != NULL)
+		FreeWaitEventSet(conn->wset);
+
+	conn->wset = CreateWaitEventSet(cxt, 2 * nodes_at_cluster + 1);
+	AddWaitEventToSet(conn->wset, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch,
+					  NULL);
+
+	for (node = 0; node < nodes_at_cluster; node++)
+	{
+		if (conn->wmask[node] & WAIT_READ)
+			AddWaitEventToSet(conn->wset, WL_SOCKET_READABLE,
+							  conn->rsock[node], NULL, NULL);
+
+		if (conn->wmask[node] & WAIT_WRITE)
+			AddWaitEventToSet(conn->wset, WL_SOCKET_WRITEABLE,
+							  conn->wsock[node], NULL,
+							  (void *) (intptr_t) node);
+	}
+
+	if (conn->wevents == NULL)
+	{
+		MemoryContextCallback *cb;
+
+		conn->wevents = MemoryContextAlloc(cxt, sizeof(WaitEvent) *
+											(2 * nodes_at_cluster + 1));
+		cb = MemoryContextAlloc(cxt, sizeof(MemoryContextCallback));
+		cb->func = free_wait_events;
+		cb->arg = conn;
+		MemoryContextRegisterResetCallback(cxt, cb);
+	}
+}
+
+/*
+ * Like CONN_Wait(), but returns also when the process latch is set. Local
+ * queues of the worker routed exchange wake up the participant by the latch
+ * (see exchange.c). The caller resets the latch before checking the queues.
+ * The event set is built once and reused while the same sockets are waited
+ * for. PostgreSQL can't disable a socket event of the set, so the set is
+ * built again when a socket is added or removed.
+ */
+void
+CONN_Wait_latch(ex_conn_t *conn, bool forRead)
+{
+	int				nevents;
+	int				node;
+	int				i;
+	bool			changed = (conn->wset == NULL);
+	bool			readable = false;
+	bool			writeable = false;
+	instr_time		start;
+	instr_time		end;
+
+	for (node = 0; node < nodes_at_cluster; node++)
+	{
+		uint8 mask = 0;
+
+		if (forRead && conn->rsIsOpened[node])
+			mask |= WAIT_READ;
+
+		if ((conn->wsock[node] != PGINVALID_SOCKET) &&
+			(conn->wbuf[node].len > conn->wbuf[node].cursor))
+			mask |= WAIT_WRITE;
+
+		if (mask != conn->wmask[node])
+		{
+			conn->wmask[node] = mask;
+			changed = true;
+		}
+	}
+
+	if (changed)
+		create_wait_events(conn);
+
+	INSTR_TIME_SET_CURRENT(start);
+	nevents = WaitEventSetWait(conn->wset, -1, conn->wevents,
+							   2 * nodes_at_cluster + 1,
+							   forRead ? WAIT_EVENT_EXCHANGE_RECV :
+										 WAIT_EVENT_EXCHANGE_SEND);
+	INSTR_TIME_SET_CURRENT(end);
+
+	for (i = 0; i < nevents; i++)
+	{
+		WaitEvent *event = &conn->wevents[i];
+
+		if (event->events & WL_LATCH_SET)
+			ResetLatch(MyLatch);
+		else if (event->events & WL_SOCKET_READABLE)
+			readable = true;
+		else if (event->events & WL_SOCKET_WRITEABLE)
+		{
+			writeable = true;
+			CONN_Flush(conn, (int) (intptr_t) event->user_data);
+		}
+	}
+
+	charge_wait(conn, readable, writeable, start, end);
+}
+
+/*
+ * Free the event set of CONN_Wait_latch(). Called before the sockets of the
+ * exchange are closed.
+ */
+void
+CONN_Release_wait_events(ex_conn_t *conn)
+{
+	free_wait_events(conn);
+}
+
 static int
 _select(int nfds, fd_set *readfds, fd_set *writefds,
 				   struct timeval *timeout)
@@ -548,6 +1857,21 @@ _select(int nfds, fd_set *readfds, fd_set *writefds,
 	return res;
 }
 
+/*
+ * Blocking select(), reported as the wait event.
+ */
+static int
+_wait(uint32 wait_event_info, int nfds, fd_set *readfds, fd_set *writefds)
+{
+	int res;
+
+	pgstat_report_wait_start(wait_event_info);
+	res = _select(nfds, readfds, writefds, NULL);
+	pgstat_report_wait_end();
+
+	return res;
+}
+
 static int
 _accept(pgsocket socket, struct sockaddr *addr, socklen_t *length_ptr)
 {
@@ -604,7 +1928,7 @@ CONN_Recv(pgsocket *socks, int nsocks, void *buf, int expected_size)
 			high_sock = socks[i];
 	}
 
-	if(_select(high_sock+1, &readset, NULL, NULL) <= 0)
+	if (_wait(WAIT_EVENT_EXCHANGE_RECV, high_sock+1, &readset, NULL) <= 0)
 		perror("RECV Select error");
 
 	for (i = 0; (i < nsocks) && !FD_ISSET(socks[i], &readset); i++);
@@ -614,23 +1938,152 @@ CONN_Recv(pgsocket *socks, int nsocks, void *buf, int expected_size)
 }
 
 /*
- * Receive a tuple from any other EXCHANGE instances. One byte length message is
+ * Read all available data of the incoming stream from the node into its
+ * receive buffer by one system call.
+ */
+static void
+fill_recv_buffer(ex_conn_t *conn, int node)
+{
+	StringInfo	buf = &conn->rbuf[node];
+	int			res;
+
+	/* Cut off consumed messages */
+	if (buf->cursor == buf->len)
+		resetStringInfo(buf);
+	else if (buf->cursor > 0)
+	{
+		buf->len -= buf->cursor;
+		memmove(buf->data, buf->data + buf->cursor, buf->len);
+		buf->cursor = 0;
+	}
+
+	enlargeStringInfo(buf, EXCHANGE_RECV_SIZE);
+
+	res = _recv(conn->rsock[node], buf->data + buf->len,
+				buf->maxlen - buf->len - 1, 0);
+
+	if (res < 0)
+	{
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+			elog(ERROR, "Exchange receiving error from node %d: %m", node);
+	}
+	else if (res == 0)
+		elog(ERROR, "Exchange connection to node %d was closed", node);
+	else
+	{
+		buf->len += res;
+		conn->stats[node].bytes_received += res;
+	}
+}
+
+/*
+ * Extract next message from the buffer.
+ * Returns 0 if the message is not arrived completely, -1 in the case of
+ * "End of Tuples" command, -2 in the case of compressed block and size of the
+ * message, if the tuple is extracted.
+ */
+static int
+extract_message(StringInfo buf, MinimalTuple *tuple)
+{
+	uint32		len;
+
+	if (buf->len - buf->cursor < sizeof(uint32))
+		return 0;
+
+	/* Messages are aligned in the buffer. See EXCHANGE_MSG_SIZE. */
+	len = ((MinimalTuple) (buf->data + buf->cursor))->t_len;
+
+	if (len == 0)
+	{
+		if (buf->len - buf->cursor < EXCHANGE_CLOSE_SIZE)
+			return 0;
+
+		buf->cursor += EXCHANGE_CLOSE_SIZE;
+		return -1;
+	}
+
+	if (len & EXCHANGE_MSG_COMPRESSED)
+	{
+		len = EXCHANGE_BLOCK_HEADER_SIZE + (len & ~EXCHANGE_MSG_COMPRESSED);
+
+		return (buf->len - buf->cursor < EXCHANGE_MSG_SIZE(len)) ? 0 : -2;
+	}
+
+	/* Columnar block is returned as a tuple. Caller checks the flag. */
+	len &= ~EXCHANGE_MSG_COLUMNAR;
+
+	if (buf->len - buf->cursor < EXCHANGE_MSG_SIZE(len))
+		return 0;
+
+	*tuple = (MinimalTuple) (buf->data + buf->cursor);
+	buf->cursor += EXCHANGE_MSG_SIZE(len);
+
+	return len;
+}
+
+/*
+ * Extract next message from the receive buffers of the node.
+ * Returns 0 if the message is not arrived completely, -1 in the case of
+ * "End of Tuples" command and size of the message, if the tuple is extracted.
+ * The tuple is not copied: it is valid until the next call of
+ * CONN_Recv_tuple().
+ */
+static int
+extract_tuple(ex_conn_t *conn, int node, MinimalTuple *tuple)
+{
+	StringInfo	buf = &conn->rbuf[node];
+	StringInfo	dbuf = &conn->dbuf[node];
+	uint32		*header;
+	int			res;
+
+	/* Decompressed batch contains complete messages only */
+	if (dbuf->cursor < dbuf->len)
+		return extract_message(dbuf, tuple);
+
+	if ((res = extract_message(buf, tuple)) != -2)
+		return res;
+
+	/* Decompress the block into the decompression buffer */
+	header = (uint32 *) (buf->data + buf->cursor);
+	resetStringInfo(dbuf);
+	enlargeStringInfo(dbuf, header[1]);
+
+	if (pglz_decompress(buf->data + buf->cursor + EXCHANGE_BLOCK_HEADER_SIZE,
+						header[0] & ~EXCHANGE_MSG_COMPRESSED, dbuf->data,
+						header[1]) != header[1])
+		elog(ERROR, "Compressed exchange data from node %d is corrupted", node);
+
+	dbuf->len = header[1];
+	buf->cursor += EXCHANGE_MSG_SIZE(EXCHANGE_BLOCK_HEADER_SIZE +
+									 (header[0] & ~EXCHANGE_MSG_COMPRESSED));
+
+	return extract_message(dbuf, tuple);
+}
+
+/*
+ * Receive a tuple from any other EXCHANGE instances. Zero-length tuple is
  * a "End of Tuples" command.
- * This function returns iff message was arrived.
+ * Incoming streams are read into the receive buffers by large chunks. So
+ * socket is touched once per many tuples. Returned tuple points into the
+ * receive buffer and is valid until the next call.
  */
-HeapTuple
-CONN_Recv_tuple(pgsocket *socks, bool *isopened,  int *res)
+MinimalTuple
+CONN_Recv_tuple(ex_conn_t *conn, int *res)
 {
 	int				i;
 	struct timeval	timeout;
-	HeapTupleData	htHeader;
-	HeapTuple		tuple;
+	MinimalTuple	tuple;
 	fd_set			readset;
-	int				counter = 0;
+	pgsocket		*socks;
+	bool			*isopened;
 
+	Assert(conn != NULL);
+	Assert(res != NULL);
+
+	socks = conn->rsock;
+	isopened = conn->rsIsOpened;
 	Assert(socks != NULL);
 	Assert(isopened != NULL);
-	Assert(res != NULL);
 
 	timeout.tv_sec = 0;
 	timeout.tv_usec = 0;
@@ -638,13 +2091,35 @@ CONN_Recv_tuple(pgsocket *socks, bool *isopened,  int *res)
 	/*
 	 * In this cycle we wait one from events:
 	 * 1. Tuple arrived, return it to the caller immediately.
-	 * 2. high_sock == 0: all connections closed. Returns -1.
+	 * 2. high_sock == 0: all connections closed. Returns -2.
 	 * 3. No messages received. Returns 0.
 	 */
 	for (;;)
 	{
 		int high_sock = 0;
 
+		/* Look for buffered tuples. Start from the next node for fairness */
+		for (i = 0; i < nodes_at_cluster; i++)
+		{
+			int node = (conn->rnext + i) % nodes_at_cluster;
+
+			if (!isopened[node])
+				continue;
+
+			*res = extract_tuple(conn, node, &tuple);
+
+			if (*res > 0)
+			{
+				conn->rnext = (node + 1) % nodes_at_cluster;
+				conn->rnode = node;
+				conn->stats[node].tuples_received++;
+				return tuple;
+			}
+			else if (*res < 0)
+				/* "End of Tuples" command was arrived */
+				isopened[node] = false;
+		}
+
 		FD_ZERO(&readset);
 
 		for (i = 0; i < nodes_at_cluster; i++)
@@ -677,50 +2152,12 @@ CONN_Recv_tuple(pgsocket *socks, bool *isopened,  int *res)
 			/* No one message was arrived */
 			return NULL;
 
-		/* Search for socket triggered */
+		/* Read data of triggered sockets */
 		for (i = 0; i < nodes_at_cluster; i++)
 		{
-			if (!isopened[i])
-				continue;
-
-			if (FD_ISSET(socks[i], &readset))
-			{
-				if ((*res = _recv(socks[i], &htHeader,
-								  offsetof(HeapTupleData, t_data), 0)) > 1)
-				{
-					int res1;
-
-					FD_ZERO(&readset);
-					FD_SET(socks[i], &readset);
-
-					/* Wait for 'Body' of the tuple */
-					if ((res1 = _select(socks[i]+1, &readset, NULL, NULL)) <= 0)
-						Assert(0);
-
-					tuple = (HeapTuple) palloc0(HEAPTUPLESIZE + htHeader.t_len);
-					memcpy(tuple, &htHeader, HEAPTUPLESIZE);
-					tuple->t_data = (HeapTupleHeader)
-											((char *) tuple + HEAPTUPLESIZE);
-					res1 = _recv(socks[i], tuple->t_data, tuple->t_len, 0);
-					Assert(res1 == tuple->t_len);
-					*res += res1;
-					return tuple;
-				}
-				else if (*res == 1)
-				{
-//					elog(LOG, "READ SOCK Close: %d (%d)", socks[i], i);
-					isopened[i] = false;
-					continue;
-				}
-				else if (*res < 0)
-					perror("RECEIVE ERROR");
-				else
-					Assert(0);
-			}
+			if (isopened[i] && FD_ISSET(socks[i], &readset))
+				fill_recv_buffer(conn, i);
 		}
-		pg_usleep(1);
-		if (++counter >= 1000000)
-			elog(ERROR, "Exchange receiving timeout was exceeded.");
 	}
 
 	return NULL;
@@ -734,65 +2171,115 @@ GetConnInfo(ConnInfoPool *pool)
 	Assert(pool != NULL);
 
 	current = pg_atomic_fetch_add_u32(&pool->current, 1);
-	Assert(current != pool->size);
+	if (current >= pool->size)
+		elog(ERROR, "Exchange connection pool of %d workers is exhausted",
+			 pool->size);
 	return &pool->info[current];
 }
 
 /*
  * Call by Leader backend at initialization process of shared memory for
  * parallel workers.
+ * Ports of all slots are negotiated by one message from each instance to the
+ * coordinator and one reply with the ports of all instances.
  */
-void
-CreateConnectionPool(ConnInfoPool *pool, int nconns, int nnodes, int mynode)
+ConnInfoPool *
+CreateConnectionPool(int nconns, int nnodes, int mynode)
 {
-	int i;
+	ConnInfoPool	*pool;
+	int				*ports;
+	int				i;
+	int				j;
 
-	Assert(pool != NULL);
 	Assert(nconns > 0);
 	Assert(nnodes > 0);
 	Assert((mynode >= 0) && (mynode < nnodes));
 
+	pool = palloc(CONN_POOL_SIZE(nconns));
 	pool->CoordinatorNode = CoordNode;
 
 	for (i = 0; i < nconns; i++)
 	{
-		int j;
+		pool->info[i].port[mynode] = STACK_Pop(PORTS);
 
-		if (mynode == CoordNode)
-		{
-			pool->info[i].port[mynode] = STACK_Pop(PORTS);
+		Assert((pool->info[i].port[mynode] > 0) &&
+			   (pool->info[i].port[mynode] < PG_UINT16_MAX));
+	}
 
-			Assert((pool->info[i].port[mynode] > 0) &&
-				   (pool->info[i].port[mynode] < PG_UINT16_MAX));
+	if (mynode == CoordNode)
+	{
+		for (j = 0; j < nnodes; j++)
+		{
+			int size;
 
-			for (j = 0; j < nnodes; j++)
-			{
-				if (j == mynode)
-					continue;
+			if (j == mynode)
+				continue;
 
-				CONN_Recv(&ServiceSock[j], 1, &(pool->info[i].port[j]),
-																sizeof(int));
-			}
+			Assert(ServiceSock[j] > 0);
+			ports = CONN_Recv_message(ServiceSock[j], CONN_MSG_PORTS, &size);
+			if (size != (int) (nconns * sizeof(int)))
+				elog(ERROR, "Node %d offers %d exchange ports instead of %d",
+					 j, (int) (size / sizeof(int)), nconns);
 
-			for (j = 0; j < nnodes; j++)
-			{
-				if (j == node_number)
-					continue;
-				Assert(ServiceSock[j] > 0);
-				CONN_Send(ServiceSock[j], pool->info[i].port, nnodes*sizeof(int));
-			}
+			for (i = 0; i < nconns; i++)
+				pool->info[i].port[j] = ports[i];
+			pfree(ports);
 		}
-		else
-		{
-			int port = STACK_Pop(PORTS);
 
-			Assert((port > 0) && (port < PG_UINT16_MAX));
-			Assert(CoordSock > 0);
+		/* Reply by the ports matrix: nconns rows by nnodes ports */
+		ports = palloc(nconns * nnodes * sizeof(int));
+		for (i = 0; i < nconns; i++)
+			memcpy(&ports[i * nnodes], pool->info[i].port, nnodes * sizeof(int));
+
+		for (j = 0; j < nnodes; j++)
+		{
+			if (j == node_number)
+				continue;
 
-			CONN_Send(CoordSock, &port, sizeof(int));
-			CONN_Recv(&CoordSock, 1, pool->info[i].port, nnodes*sizeof(int));
+			CONN_Send_message(ServiceSock[j], CONN_MSG_PORTS, ports,
+							  nconns * nnodes * sizeof(int));
 		}
 	}
+	else
+	{
+		int size;
+
+		Assert(CoordSock > 0);
+
+		ports = palloc(nconns * sizeof(int));
+		for (i = 0; i < nconns; i++)
+			ports[i] = pool->info[i].port[mynode];
+		CONN_Send_message(CoordSock, CONN_MSG_PORTS, ports,
+						  nconns * sizeof(int));
+		pfree(ports);
+
+		ports = CONN_Recv_message(CoordSock, CONN_MSG_PORTS, &size);
+		if (size != (int) (nconns * nnodes * sizeof(int)))
+			elog(ERROR, "Wrong size of the exchange ports message: %d", size);
+
+		for (i = 0; i < nconns; i++)
+			memcpy(pool->info[i].port, &ports[i * nnodes], nnodes * sizeof(int));
+	}
+	pfree(ports);
+
 	pg_atomic_write_u32(&pool->current, 0);
 	pool->size = nconns;
+	return pool;
+}
+
+/*
+ * Return ports of the pool to the stack. Called by the leader at the end of
+ * the query, when all workers are finished.
+ */
+void
+ReleaseConnectionPool(ConnInfoPool *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->size; i++)
+	{
+		Assert((pool->info[i].port[node_number] > 0) &&
+			   (pool->info[i].port[node_number] < PG_UINT16_MAX));
+		STACK_Push(PORTS, pool->info[i].port[node_number]);
+	}
 }
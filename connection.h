@@ -16,61 +16,181 @@
 #define CONNECTION_H_
 
 #include "access/htup.h"
+#include "lib/stringinfo.h"
+#include "nodes/params.h"
+#include "pgstat.h"
 #include "port/atomics.h"
+#include "portability/instr_time.h"
+#include "storage/latch.h"
 
 
 #define NODES_MAX_NUM	(1024)
 #define STRING_SIZE_MAX	(1024)
 
+/*
+ * Tuples are passed as MinimalTuple padded to MAXALIGN. So the receiver can
+ * use tuples in place of the receive buffer. Zero t_len is the "End of Tuples"
+ * command.
+ */
+#define EXCHANGE_MSG_SIZE(len)	(MAXALIGN(len))
+#define EXCHANGE_CLOSE_SIZE		(EXCHANGE_MSG_SIZE(sizeof(uint32)))
+
+/*
+ * Batch of messages can be sent as a compressed block. The block header
+ * contains two uint32: the compressed size with EXCHANGE_MSG_COMPRESSED flag
+ * at the place of t_len and the raw size of the batch.
+ */
+#define EXCHANGE_MSG_COMPRESSED		(0x80000000)
+#define EXCHANGE_BLOCK_HEADER_SIZE	(2 * sizeof(uint32))
+#define EXCHANGE_BATCH_SIZE			(65536)
+
+/*
+ * Block of rows in the columnar format. It is passed like a tuple: the size of
+ * the block with EXCHANGE_MSG_COLUMNAR flag is at the place of t_len.
+ * See columnar.c.
+ */
+#define EXCHANGE_MSG_COLUMNAR		(0x40000000)
+
+/* Unix domain sockets of exchange ports for co-located instances */
+#define UNIXSOCK_PATH_BUFLEN	(64)
+#define UNIXSOCK_PATH_BUILD(path, port) \
+	snprintf((path), UNIXSOCK_PATH_BUFLEN, "/tmp/.s.PARGRES.%d", (port))
+
+/*
+ * Wait events of the blocking points. PostgreSQL reports all events of the
+ * extension class by the "Extension" name, but the events can be told apart
+ * by wait_event_info codes, as sampled by pg_wait_sampling.
+ */
+#define WAIT_EVENT_EXCHANGE_RECV	(PG_WAIT_EXTENSION | 1)
+#define WAIT_EVENT_EXCHANGE_SEND	(PG_WAIT_EXTENSION | 2)
+#define WAIT_EVENT_EXCHANGE_CONNECT	(PG_WAIT_EXTENSION | 3)
+#define WAIT_EVENT_DISPATCH_RESULT	(PG_WAIT_EXTENSION | 4)
+#define WAIT_EVENT_DISPATCH_SEND	(PG_WAIT_EXTENSION | 5)
+
+/* Queued data is pushed to the socket since this size only */
+#define EXCHANGE_FLUSH_SIZE	(8192)
+
+/* Minimal free space of the receive buffer before reading from socket */
+#define EXCHANGE_RECV_SIZE	(65536)
+
 
+/*
+ * Control messages of the service channel (ServiceSock and CoordSock). Each
+ * message is a header and a payload of the header size.
+ */
+typedef enum
+{
+	CONN_MSG_HELLO = 1,	/* node number of the connected instance */
+	CONN_MSG_PORTS,		/* exchange ports of the connection pool */
+	CONN_MSG_EXEC_STATS,	/* statistics of the statement at the remote node */
+	CONN_MSG_KEY_TRAFFIC,	/* traffic of the exchange by distribution key */
+	CONN_MSG_VOTE		/* condition checked by the instance */
+} conn_msg_type;
+
+typedef struct
+{
+	uint32	type;
+	uint32	size;
+} ConnMsgHeader;
 
 typedef struct
 {
 	int	port[NODES_MAX_NUM];
 } ConnInfo;
 
-#define POOL_MAX_SIZE		(10)
-
+/*
+ * Ports of parallel workers. The pool is sized by the number of planned
+ * workers and copied into DSM of each EXCHANGE node. Ports are owned by the
+ * leader: it returns them at the end of the query. So the pool can be used
+ * again by workers, launched for a rescan.
+ */
 typedef struct
 {
 	int					size;
 	pg_atomic_uint32	current;
 	int					CoordinatorNode;
-	ConnInfo			info[POOL_MAX_SIZE];
+	ConnInfo			info[FLEXIBLE_ARRAY_MEMBER];
 } ConnInfoPool;
 
+#define CONN_POOL_SIZE(nconns) \
+	(offsetof(ConnInfoPool, info) + (nconns) * sizeof(ConnInfo))
+
+/* Traffic of the exchange with one peer. Reported by EXPLAIN ANALYZE. */
+typedef struct
+{
+	uint64	tuples_sent;
+	uint64	bytes_sent;
+	uint64	tuples_received;
+	uint64	bytes_received;
+	uint64	flushes; /* successful send() calls */
+	uint64	batches; /* compressed batches */
+} ExchangePeerStats;
+
 typedef struct
 {
 	pgsocket	*rsock; /* incoming messages */
 	bool		*rsIsOpened;
 	pgsocket	*wsock; /* outcoming messages */
 	bool		*wsIsOpened;
+	StringInfoData	*wbuf; /* queues of messages are not sent yet */
+	StringInfoData	*rbuf; /* received data are not extracted yet */
+	int				rnext; /* node to start search of the received tuple */
+	bool			compress; /* compress outgoing batches */
+	StringInfoData	*cbuf; /* batches are not compressed yet */
+	StringInfoData	*dbuf; /* decompressed batches */
+	int				rnode; /* node of the last received message */
+	ExchangePeerStats	*stats;
+	instr_time		send_wait; /* time blocked by full queues */
+	instr_time		recv_wait; /* time blocked by waiting for messages */
+	WaitEventSet	*wset; /* events waited by CONN_Wait_latch() */
+	WaitEvent		*wevents; /* occurred events of wset */
+	uint8			*wmask; /* sockets of each node in wset */
 } ex_conn_t;
 
 extern ConnInfo	*BackendConnInfo;
 extern int		CoordinatorPort;
 extern pgsocket	CoordSock;
 extern pgsocket	ServiceSock[NODES_MAX_NUM];
-extern ConnInfoPool ProcessSharedConnInfoPool;
+extern ConnInfoPool *ProcessSharedConnInfoPool;
 
 
 extern void CONN_Init_module(void);
 extern void InstanceConnectionsSetup(void);
 extern int ListenPort(int port, pgsocket *sock);
+extern int ListenUnixPort(int port, pgsocket *sock);
+extern bool CONN_Is_local_node(int node);
 extern pgsocket CONN_Connect(int port, in_addr_t host);
+extern pgsocket CONN_Connect_local(int port);
 extern int PostmasterConnectionsSetup(void);
 extern int QueryExecutionInitialize(int port);
-extern int CONN_Launch_query(const char *query);
+extern int CONN_Launch_query(const char *query, uint64 queryId);
+extern int CONN_Launch_prepared(const char *query, ParamListInfo params,
+								uint64 queryId);
 extern void CONN_Check_query_result(void);
+extern bool CONN_Get_query_result(StringInfo texts);
 extern void CONN_Init_exchange(ConnInfo *pool, ex_conn_t *exconn, int mynum,
 																  int nnodes);
 extern void CONN_Exchange_close(ex_conn_t *conn);
 extern int CONN_Send(pgsocket sock, void *buf, int size);
+extern void CONN_Send_async(ex_conn_t *conn, int node, void *buf, int size);
+extern char *CONN_Reserve(ex_conn_t *conn, int node, int size);
+extern bool CONN_Flush(ex_conn_t *conn, int node);
+extern bool CONN_Flush_all(ex_conn_t *conn);
+extern bool CONN_Queue_is_full(ex_conn_t *conn);
+extern void CONN_Wait(ex_conn_t *conn, bool forRead);
+extern void CONN_Wait_latch(ex_conn_t *conn, bool forRead);
+extern void CONN_Release_wait_events(ex_conn_t *conn);
 extern int CONN_Recv(pgsocket *socks, int nsocks, void *buf, int expected_size);
-extern HeapTuple CONN_Recv_tuple(pgsocket *socks, bool *isopened, int *res);
+extern MinimalTuple CONN_Recv_tuple(ex_conn_t *conn, int *res);
+extern void CONN_Send_message(pgsocket sock, conn_msg_type type, void *data,
+							  int size);
+extern void *CONN_Recv_message(pgsocket sock, conn_msg_type type, int *size);
+extern void CONN_Receive_statistics(void);
+extern bool CONN_Vote(bool vote);
 extern void ServiceConnectionSetup(void);
 extern void OnExecutionEnd(void);
 extern ConnInfo* GetConnInfo(ConnInfoPool *pool);
-extern void CreateConnectionPool(ConnInfoPool *pool, int nconns, int nnodes, int mynode);
+extern ConnInfoPool *CreateConnectionPool(int nconns, int nnodes, int mynode);
+extern void ReleaseConnectionPool(ConnInfoPool *pool);
 
 #endif /* CONNECTION_H_ */
@@ -9,9 +9,30 @@
  *		Connections each-by-each are established by EXCHANGE_Begin() and in
  *		parallel worker initializer routine.
  *		Connections are closed by EXCHANGE_End().
- *		After receiving NULL slot from local storage EXCHANGE node sends char
- *		'C' to the another. It is not closed connection immediately for
- *		possible rescan() calling.
+ *		After receiving NULL slot from local storage EXCHANGE node sends
+ *		the header of zero-length tuple to the another. It is not closed
+ *		connection immediately for possible rescan() calling.
+ *		Tuples are sent through per-peer queues without blocking. If any
+ *		queue is overflowed, the node stops to produce local tuples and
+ *		drains incoming streams. So two nodes can not wait for each other.
+ *		In the columnar mode rows are accumulated into per-destination
+ *		batches and sent as columnar blocks (see columnar.c). Partial
+ *		batches are sent before the "End of Tuples" command.
+ *		In a parallel plan each participant has own mesh of connections,
+ *		paired with the participants of the same slot of the connection pool
+ *		at another nodes. By default routing is node-level: a tuple routed to
+ *		the node is returned by the participant, which received it. So a
+ *		consumer above the exchange must share its state between the
+ *		participants of the node (Parallel Hash, or a private hash over the
+ *		whole inner).
+ *		Inputs of a parallel oblivious join are routed to (node, worker)
+ *		pairs instead: each worker of the node owns a disjoint key range.
+ *		A worker sends its tuples over the network to the worker of the same
+ *		slot at another node. The tuple of another key range is dropped, if
+ *		each worker produces the whole subplan, or forwarded to the owner
+ *		through the local shm_mq queue. The owner routes it to the node.
+ *		Like the pairing of the slots, it needs all planned workers to be
+ *		launched at each node.
  *
  * Copyright (c) 2018, Postgres Professional
  *
@@ -22,19 +43,61 @@
 #include "unistd.h"
 
 #include "access/hash.h"
+#include "access/parallel.h"
 #include "access/htup_details.h"
 #include "catalog/pg_am.h"
 #include "catalog/pg_opclass.h"
 #include "commands/defrem.h"
+#include "miscadmin.h"
 #include "nodes/makefuncs.h"
+#include "parser/parsetree.h"
+#include "pgstat.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "utils/builtins.h"
+#include "utils/fmgroids.h"
 #include "utils/lsyscache.h"
 #include "utils/syscache.h"
+#include "utils/uuid.h"
 
 #include "common.h"
 #include "connection.h"
 #include "exchange.h"
 #include "pargres.h"
+#include "stats.h"
+#include "trace.h"
+
+
+/* Record the event of the exchange into the trace */
+#define TRACE_EXCHANGE(state, event, start) \
+	do { \
+		if (trace_active) \
+		{ \
+			char name[NAMEDATALEN]; \
+			snprintf(name, NAMEDATALEN, "exchange %d: %s", \
+					 (state)->number, (event)); \
+			if ((start) != 0) \
+				TRACE_Span(name, (start)); \
+			else \
+				TRACE_Instant(name); \
+		} \
+	} while (0)
 
+/*
+ * Key traffic of workers follows the connection pool. Shared broadcast or local
+ * queues of the worker routing are placed after it.
+ */
+#define EXCHANGE_WORKER_TRAFFIC(coordinate) \
+	((WorkerTraffic *) ((char *) (coordinate) + \
+		MAXALIGN(CONN_POOL_SIZE(((ConnInfoPool *) (coordinate))->size))))
+#define EXCHANGE_SHARED_AREA(coordinate) \
+	((char *) EXCHANGE_WORKER_TRAFFIC(coordinate) + \
+		MAXALIGN(sizeof(WorkerTraffic)))
+#define EXCHANGE_SHARED_BROADCAST(coordinate) \
+	((SharedBroadcast *) EXCHANGE_SHARED_AREA(coordinate))
+#define EXCHANGE_LOCAL_QUEUE(queues, nworkers, sender, receiver) \
+	((shm_mq *) ((queues) + \
+		((sender) * (nworkers) + (receiver)) * EXCHANGE_LOCAL_QUEUE_SIZE))
 
 static CustomScanMethods	exchange_plan_methods;
 static CustomExecMethods	exchange_exec_methods;
@@ -42,6 +105,7 @@ static CustomExecMethods	exchange_exec_methods;
 static void EXCHANGE_Begin(CustomScanState *node, EState *estate, int eflags);
 static TupleTableSlot *EXCHANGE_Execute(CustomScanState *node);
 static void EXCHANGE_End(CustomScanState *node);
+static void EXCHANGE_Shutdown(CustomScanState *node);
 static void EXCHANGE_Rescan(CustomScanState *node);
 static void EXCHANGE_ReInitializeDSM(CustomScanState *node,
 									 ParallelContext *pcxt,
@@ -55,7 +119,15 @@ static void EXCHANGE_InitializeWorker(CustomScanState *node,
 									  shm_toc *toc,
 									  void *coordinate);
 static Node *EXCHANGE_Create_state(CustomScan *node);
-
+static TupleTableSlot *ExchangeNext(CustomScanState *node);
+static void create_local_queues(ExchangeState *state, ParallelContext *pcxt,
+								void *coordinate);
+static void explain_exchange_stats(ExchangeState *state, ExplainState *es);
+static void report_key_traffic(ExchangeState *state);
+
+static bool has_exchange(Plan *plan);
+static int route_tuple(ExchangeState *state, TupleTableSlot *slot,
+					   int *worker);
 static int fragmentation_fn_default(int value, int nnodes, int mynum);
 static int fragmentation_fn_gather(int value, int nodenum, int nnodes);
 
@@ -79,7 +151,7 @@ EXCHANGE_Init_methods(void)
 	exchange_exec_methods.InitializeDSMCustomScan 	= EXCHANGE_InitializeDSM;
 	exchange_exec_methods.InitializeWorkerCustomScan= EXCHANGE_InitializeWorker;
 	exchange_exec_methods.ReInitializeDSMCustomScan = EXCHANGE_ReInitializeDSM;
-	exchange_exec_methods.ShutdownCustomScan		= NULL;
+	exchange_exec_methods.ShutdownCustomScan		= EXCHANGE_Shutdown;
 	exchange_exec_methods.ExplainCustomScan			= EXCHANGE_Explain;
 }
 
@@ -113,13 +185,44 @@ EXCHANGE_Create_state(CustomScan *node)
 	/* Extract necessary variables */
 	state->frOpts.attno = intVal(list_nth(node->custom_private, 4));
 	state->frOpts.funcId = intVal(list_nth(node->custom_private, 5));
+	state->frOpts.colocation = intVal(list_nth(node->custom_private, 12));
 
 	state->broadcast_mode = intVal(list_nth(node->custom_private, 2));
 	state->drop_duplicates = intVal(list_nth(node->custom_private, 3));
 	state->mynode = intVal(list_nth(node->custom_private, 1));
 	state->nnodes = intVal(list_nth(node->custom_private, 0));
+	state->compress = intVal(list_nth(node->custom_private, 7));
+	state->columnar = intVal(list_nth(node->custom_private, 8));
+	state->shared_broadcast = intVal(list_nth(node->custom_private, 9));
+	state->rescannable = intVal(list_nth(node->custom_private, 10));
+	state->keyattno = intVal(list_nth(node->custom_private, 11));
+	state->worker_route = intVal(list_nth(node->custom_private, 14));
+	state->pcxt = NULL;
+	state->nworkers = 1;
+	state->myslot = 0;
+	state->outq = NULL;
+	state->inq = NULL;
+	state->pending = NULL;
+	state->closed = false;
+	state->traffic = NULL;
+	state->worker_tuples = 0;
+	state->worker_bytes = 0;
+	state->cache = NULL;
+	state->eof_underlying = false;
+	state->shared = NULL;
+	state->chunk = InvalidDsaPointer;
+	state->project = (list_nth(node->custom_private, 6) != NIL);
+	state->projection = NULL;
+	foreach(lc, (List *) list_nth(node->custom_private, 6))
+	{
+		/* Zero is the mark of the empty projection */
+		if (intVal(lfirst(lc)) > 0)
+			state->projection = bms_add_member(state->projection,
+											   intVal(lfirst(lc)));
+	}
 	state->connPool = NULL;
 	state->conn.rsock = NULL;
+	state->conn.stats = NULL;
 	state->conn.wsock = NULL;
 
 	Assert(!node->scan.plan.qual);
@@ -143,37 +246,57 @@ EXCHANGE_Begin(CustomScanState *node, EState *estate, int eflags)
 	node->ss.ss_ScanTupleSlot = ExecInitExtraTupleSlot(estate, tupDesc);
 	node->ss.ps.ps_ResultTupleSlot = ExecInitExtraTupleSlot(estate, tupDesc);
 
+	/* Workspace for the projection of sent tuples */
+	if (state->project)
+	{
+		state->values = palloc(tupDesc->natts * sizeof(Datum));
+		state->isnull = palloc(tupDesc->natts * sizeof(bool));
+	}
+
+	/* Rows are accumulated into per-destination batches */
+	if (state->columnar)
+	{
+		int i;
+
+		state->batches = palloc(nodes_at_cluster * sizeof(ColumnarBatch *));
+		for (i = 0; i < nodes_at_cluster; i++)
+			state->batches[i] = COLUMNAR_Create_batch(tupDesc);
+		initStringInfo(&state->block);
+	}
+
+	/* Peers can send columnar blocks independently of our settings */
+	COLUMNAR_Init_reader(&state->reader, tupDesc);
+
 	/* If we use hash function, we need to prepare info for fmgr */
 	if (state->frOpts.funcId == FR_FUNC_HASH)
 	{
-		Oid				atttypid;
-		Oid				opclass;
-		Oid				funcid;
-		FmgrInfo		*hashfunction = palloc0(sizeof(FmgrInfo));
-		Oid				opcfamily,
-						opcintype;
-
+		Oid atttypid;
 
 		atttypid = TupleDescAttr(tupDesc, state->frOpts.attno-1)->atttypid;
-		opclass = GetDefaultOpClass(atttypid, HASH_AM_OID);
-		opcfamily = get_opclass_family(opclass);
-		opcintype = get_opclass_input_type(opclass);
-		funcid = get_opfamily_proc(opcfamily,
-								   opcintype,
-								   opcintype,
-								   HASHEXTENDED_PROC);
-
-		fmgr_info(funcid, hashfunction);
-		state->data = hashfunction;
+		state->data = make_hash_route(atttypid);
+		set_hash_route_buckets((HashRouteData *) state->data,
+			(List *) list_nth(((CustomScan *) node->ss.ps.plan)->custom_private,
+							  13));
 	}
 	else
 		state->data = NULL;
 
+	/*
+	 * Peers do not repeat their streams on our rescan. So the output is cached
+	 * to replay it locally.
+	 */
+	if (state->rescannable || (eflags & EXEC_FLAG_REWIND))
+		state->cache = tuplestore_begin_heap(false, false, work_mem);
+
 	state->NetworkIsActive = true;
 	state->LocalStorageIsActive = true;
 	state->NetworkStorageTuple = 0;
 	state->LocalStorageTuple = 0;
 	state->number = number++;
+	state->relid = exchange_source_relation(outerPlan(node->ss.ps.plan),
+											estate->es_range_table);
+	state->keyattno = exchange_source_attribute(outerPlan(node->ss.ps.plan),
+												state->keyattno);
 
 	/* Need to establish connection on the first call */
 	Assert(!state->conn.rsock);
@@ -183,6 +306,9 @@ EXCHANGE_Begin(CustomScanState *node, EState *estate, int eflags)
 		/* EXCHANGE_Begin: escape for the worker initialization */
 		return;
 
+	state->started = GetCurrentTimestamp();
+	state->sent = false;
+
 	if (!BackendConnInfo)
 	{
 		if (!state->connPool)
@@ -193,15 +319,16 @@ EXCHANGE_Begin(CustomScanState *node, EState *estate, int eflags)
 			 * Otherwise, the connection pool was created by the
 			 * ExecParallelInitializeDSM () function earlier.
 			 */
-			state->connPool = palloc(sizeof(ConnInfoPool));
-			CreateConnectionPool(state->connPool, 1, state->nnodes,
-																state->mynode);
+			state->connPool = CreateConnectionPool(1, state->nnodes,
+												   state->mynode);
 		}
 		BackendConnInfo = GetConnInfo(state->connPool);
 	}
 
 	CONN_Init_exchange(BackendConnInfo , &state->conn, state->mynode,
 																state->nnodes);
+	state->conn.compress = state->compress;
+	TRACE_EXCHANGE(state, "setup", state->started);
 }
 
 static TupleTableSlot *
@@ -209,10 +336,15 @@ GetTupleFromNetwork(ExchangeState *state, TupleTableSlot *slot,
 					bool *NetworkIsActive)
 {
 	int res;
-	HeapTuple tuple;
+	MinimalTuple tuple;
 
 	Assert(state->conn.rsock > 0);
-	tuple = CONN_Recv_tuple(state->conn.rsock, state->conn.rsIsOpened, &res);
+
+	/* Rows of the received columnar block go before the next message */
+	if (COLUMNAR_Next(&state->reader, slot))
+		return slot;
+
+	tuple = CONN_Recv_tuple(&state->conn, &res);
 
 	if (res < 0)
 	{
@@ -223,270 +355,1454 @@ GetTupleFromNetwork(ExchangeState *state, TupleTableSlot *slot,
 	{
 		return ExecClearTuple(slot);
 	}
+	else if (tuple->t_len & EXCHANGE_MSG_COLUMNAR)
+	{
+		/* Rows are read from the receive buffer in place */
+		COLUMNAR_Open(&state->reader, (char *) tuple);
+		/* The block was counted by the connection as one tuple */
+		state->conn.stats[state->conn.rnode].tuples_received +=
+													state->reader.nrows - 1;
+		COLUMNAR_Next(&state->reader, slot);
+		return slot;
+	}
 	else
 	{
-		ExecStoreHeapTuple(tuple, slot, false);
+		/* Tuple is placed in the receive buffer. Do not copy it. */
+		ExecStoreMinimalTuple(tuple, slot, false);
 		return slot;
 	}
 }
 
-static TupleTableSlot *
-EXCHANGE_Execute(CustomScanState *node)
+/*
+ * Form the minimal tuple from values directly in the send queue of the node.
+ * Like heap_form_minimal_tuple().
+ */
+static MinimalTuple
+form_message(ExchangeState *state, TupleDesc tupDesc, Datum *values,
+			 bool *isnull, int node, int *size)
 {
-	PlanState		*child_ps = outerPlanState(node);
-	TupleTableSlot	*slot = node->ss.ss_ScanTupleSlot;
-	bool			isnull;
-	Datum			value;
-	ExchangeState	*state = (ExchangeState *)node;
-	int				destnode;
+	MinimalTuple	tuple;
+	int				natts = tupDesc->natts;
+	bool			hasnull = false;
+	Size			hoff;
+	Size			data_len;
+	int				i;
 
-	for (;;)
+	for (i = 0; i < natts; i++)
 	{
-		if (state->NetworkIsActive)
+		if (isnull[i])
 		{
-			slot = GetTupleFromNetwork(state, node->ss.ss_ScanTupleSlot,
-									   &state->NetworkIsActive);
-
-			if (!TupIsNull(slot))
-			{
-				state->NetworkStorageTuple++;
-				break;
-			}
+			hasnull = true;
+			break;
 		}
+	}
 
-		if (state->LocalStorageIsActive)
-		{
-			slot = ExecProcNode(child_ps);
+	hoff = SizeofMinimalTupleHeader;
+	if (hasnull)
+		hoff += BITMAPLEN(natts);
+	if (tupDesc->tdhasoid)
+		hoff += sizeof(Oid);
+	hoff = MAXALIGN(hoff);
+
+	data_len = heap_compute_data_size(tupDesc, values, isnull);
+	*size = EXCHANGE_MSG_SIZE(hoff + data_len);
+
+	tuple = (MinimalTuple) CONN_Reserve(&state->conn, node, *size);
+	memset(tuple, 0, hoff);
+	tuple->t_len = hoff + data_len;
+	HeapTupleHeaderSetNatts(tuple, natts);
+	tuple->t_hoff = hoff + MINIMAL_TUPLE_OFFSET;
+	if (tupDesc->tdhasoid)
+		tuple->t_infomask = HEAP_HASOID;
+
+	heap_fill_tuple(tupDesc, values, isnull, (char *) tuple + hoff, data_len,
+					&tuple->t_infomask, (hasnull ? tuple->t_bits : NULL));
+	return tuple;
+}
 
-			if (TupIsNull(slot))
-			{
-				CONN_Exchange_close(&state->conn);
-				state->LocalStorageIsActive = false;
-			} else
-				state->LocalStorageTuple++;
-		}
+/*
+ * Form the message with the tuple of the slot directly in the send queue of
+ * the node. Returns the message and its size.
+ * A physical tuple is copied once as a minimal tuple. A virtual tuple (after
+ * an aggregate or a projection) is formed from tts_values/tts_isnull without
+ * an intermediate heap tuple.
+ * Attributes, which are not used above the exchange, are sent as NULLs.
+ */
+static char *
+send_slot(ExchangeState *state, TupleTableSlot *slot, int node, int *size)
+{
+	MinimalTuple	tuple;
 
-		if (TupIsNull(slot))
+	Assert(!TupIsNull(slot));
+
+	if (state->project)
+	{
+		int natts = slot->tts_tupleDescriptor->natts;
+		int attno;
+
+		slot_getallattrs(slot);
+
+		for (attno = 0; attno < natts; attno++)
 		{
-			if (!state->NetworkIsActive && !state->LocalStorageIsActive)
+			if (bms_is_member(attno + 1, state->projection))
 			{
-				return slot;
+				state->values[attno] = slot->tts_values[attno];
+				state->isnull[attno] = slot->tts_isnull[attno];
 			}
 			else
-				continue;
+			{
+				state->values[attno] = (Datum) 0;
+				state->isnull[attno] = true;
+			}
 		}
 
-		if (slot->tts_nvalid > 0)
-			/*
-			 * If slot contains virtual tuple (after aggregate, for example),
-			 * we need to materialize it.
-			 */
-			ExecMaterializeSlot(slot);
+		tuple = form_message(state, slot->tts_tupleDescriptor, state->values,
+							 state->isnull, node, size);
+	}
+	else if (slot->tts_tuple != NULL)
+	{
+		HeapTuple	htup = slot->tts_tuple;
+		uint32		len = htup->t_len - MINIMAL_TUPLE_OFFSET;
 
-		if (state->broadcast_mode)
-		{
-			int destnode;
-			int tupsize = offsetof(HeapTupleData, t_data);
+		*size = EXCHANGE_MSG_SIZE(len);
+		tuple = (MinimalTuple) CONN_Reserve(&state->conn, node, *size);
+		memcpy(tuple, (char *) htup->t_data + MINIMAL_TUPLE_OFFSET, len);
+		tuple->t_len = len;
+	}
+	else
+	{
+		slot_getallattrs(slot);
+		tuple = form_message(state, slot->tts_tupleDescriptor,
+							 slot->tts_values, slot->tts_isnull, node, size);
+	}
 
-			for (destnode = 0; destnode < nodes_at_cluster; destnode++)
-			{
-				if (state->conn.wsock[destnode] == PGINVALID_SOCKET)
-					continue;
+	/* Zero the alignment padding */
+	memset((char *) tuple + tuple->t_len, 0, *size - tuple->t_len);
+	return (char *) tuple;
+}
 
-				CONN_Send(state->conn.wsock[destnode], slot->tts_tuple, tupsize);
-				CONN_Send(state->conn.wsock[destnode], slot->tts_tuple->t_data,
-						  slot->tts_tuple->t_len);
-			}
+/*
+ * Send the batch of the node as a columnar block. The broadcast batch is sent
+ * to all another nodes.
+ */
+static void
+flush_columnar(ExchangeState *state, int node)
+{
+	ColumnarBatch	*batch = state->batches[node];
+	int				destnode;
 
-			/* Send tuple to myself */
-			break;
-		}
-		else if (state->frOpts.funcId == FR_FUNC_GATHER)
-		{
-			destnode = CoordNode;
-		}
-		else
-		{
-			/* Extract value of cell in a distribution domain */
-			value = slot_getattr(slot, state->frOpts.attno, &isnull);
-			Assert(!isnull);
+	if (batch->nrows == 0)
+		return;
 
-			destnode = get_tuple_node(state->frOpts.funcId, value,
-									  state->mynode, state->nnodes,
-									  state->data);
-		}
+	resetStringInfo(&state->block);
+	COLUMNAR_Encode(batch, &state->block);
 
-		if (destnode == state->mynode)
-			break;
-		else if (state->drop_duplicates)
-			continue;
-		else
-		{
-			int tupsize = offsetof(HeapTupleData, t_data);
+	if (!state->broadcast_mode)
+	{
+		CONN_Send_async(&state->conn, node, state->block.data,
+						state->block.len);
+		state->conn.stats[node].tuples_sent += batch->nrows;
+		return;
+	}
 
-			Assert(state->conn.wsock[destnode] > 0);
-			CONN_Send(state->conn.wsock[destnode], slot->tts_tuple, tupsize);
-			CONN_Send(state->conn.wsock[destnode], slot->tts_tuple->t_data,
-					  slot->tts_tuple->t_len);
+	for (destnode = 0; destnode < nodes_at_cluster; destnode++)
+	{
+		if ((destnode == state->mynode) ||
+			(state->conn.wsock[destnode] == PGINVALID_SOCKET))
 			continue;
-		}
+
+		CONN_Send_async(&state->conn, destnode, state->block.data,
+						state->block.len);
+		state->conn.stats[destnode].tuples_sent += batch->nrows;
 	}
-	return slot;
 }
 
+/*
+ * Add the tuple of the slot to the batch of the node. Attributes, which are
+ * not used above the exchange, are added as NULLs.
+ */
 static void
-EXCHANGE_End(CustomScanState *node)
+send_columnar(ExchangeState *state, TupleTableSlot *slot, int node)
 {
-	ExchangeState	*state = (ExchangeState *)node;
-	int i;
-
-	/*
-	 * clean out the tuple table
-	 */
-	ExecClearTuple(node->ss.ps.ps_ResultTupleSlot);
-	ExecClearTuple(node->ss.ss_ScanTupleSlot);
+	Datum	*values = slot->tts_values;
+	bool	*isnull = slot->tts_isnull;
 
-	Assert(state->conn.rsock);
-	Assert(state->conn.wsock);
+	slot_getallattrs(slot);
 
-	for (i = 0; i < nodes_at_cluster; i++)
+	if (state->project)
 	{
-		if (i == node_number)
-			continue;
-
-		Assert(state->conn.rsock[i] != PGINVALID_SOCKET);
-		Assert(state->conn.wsock[i] != PGINVALID_SOCKET);
-		if (state->conn.rsIsOpened[i] != false)
-			elog(LOG,
-			"Read socket %d to node %d is not closed. It is explain query?",
-			state->conn.rsock[i], i);
+		int attno;
 
-		closesocket(state->conn.rsock[i]);
-		state->conn.rsock[i] = PGINVALID_SOCKET;
+		for (attno = 0; attno < slot->tts_tupleDescriptor->natts; attno++)
+		{
+			bool used = bms_is_member(attno + 1, state->projection);
 
-		if (state->conn.wsIsOpened[i] != false)
-			elog(LOG,
-			"Write socket %d to node %d is not closed. It is explain query?",
-			state->conn.wsock[i], i);
+			state->values[attno] = used ? values[attno] : (Datum) 0;
+			state->isnull[attno] = used ? isnull[attno] : true;
+		}
 
-		closesocket(state->conn.wsock[i]);
-		state->conn.wsock[i] = PGINVALID_SOCKET;
+		values = state->values;
+		isnull = state->isnull;
 	}
-	ExecEndNode(outerPlanState(node));
+
+	if (COLUMNAR_Add_row(state->batches[node], values, isnull))
+		flush_columnar(state, node);
 }
 
+/*
+ * Store the tuple, returned by the leader, into the shared broadcast list.
+ */
 static void
-EXCHANGE_Rescan(CustomScanState *node)
+store_shared_broadcast(ExchangeState *state, SharedBroadcast *shared,
+					   TupleTableSlot *slot)
 {
-	PlanState		*outerPlan = outerPlanState(node);
-	ExchangeState	*state = (ExchangeState *)node;
-	int				i;
-
-	if (outerPlan->chgParam == NULL)
-		ExecReScan(outerPlan);
+	dsa_area		*area = state->css.ss.ps.state->es_query_dsa;
+	MinimalTuple	tuple = ExecFetchSlotMinimalTuple(slot);
+	Size			size = MAXALIGN(tuple->t_len);
+	BroadcastChunk	*chunk = NULL;
 
-	Assert(state->conn.rsock != NULL);
-	Assert(state->conn.wsock != NULL);
+	if (DsaPointerIsValid(state->chunk))
+		chunk = (BroadcastChunk *) dsa_get_address(area, state->chunk);
 
-	for (i = 0; i < nodes_at_cluster; i++)
+	if ((chunk == NULL) || (chunk->size - chunk->used < size))
 	{
-		if (i == node_number)
-			continue;
+		Size			chunksize = Max(BROADCAST_CHUNK_SIZE, size);
+		dsa_pointer		next;
+		BroadcastChunk	*newchunk;
+
+		next = dsa_allocate(area, offsetof(BroadcastChunk, data) + chunksize);
+		newchunk = (BroadcastChunk *) dsa_get_address(area, next);
+		newchunk->next = InvalidDsaPointer;
+		newchunk->size = chunksize;
+		newchunk->used = 0;
+
+		if (chunk == NULL)
+			shared->head = next;
+		else
+			chunk->next = next;
 
-		state->conn.rsIsOpened[i] = true;
-		state->conn.wsIsOpened[i] = true;
+		state->chunk = next;
+		chunk = newchunk;
 	}
+
+	memcpy(chunk->data + chunk->used, tuple, tuple->t_len);
+	chunk->used += size;
 }
 
+/*
+ * The leader executes the exchange up to the end and stores the result into
+ * the shared list. It is called before the launch of workers, so the loading
+ * does not depend on whether the leader executes the plan itself: it may not
+ * participate, skip the inner side of a join or stop by a limit.
+ */
 static void
-EXCHANGE_ReInitializeDSM(CustomScanState *node, ParallelContext *pcxt,
-		  	  	  	  	 void *coordinate)
+load_shared_broadcast(ExchangeState *state, SharedBroadcast *shared)
 {
-	/* ToDo */
-	elog(LOG, "I am in ReInitializeDSM()!");
-	Assert(0);
+	TupleTableSlot *slot;
+
+	Assert(state->shared == NULL);
+
+	state->chunk = InvalidDsaPointer;
+	while (!TupIsNull(slot = ExchangeNext(&state->css)))
+		store_shared_broadcast(state, shared, slot);
+
+	pg_write_barrier();
+	pg_atomic_write_u32(&shared->loaded, 1);
+
+	state->chunk = shared->head;
+	state->offset = 0;
 }
 
+/*
+ * Close streams of the participant, which sends nothing, and wait for the end
+ * of incoming streams. Participants of the same slot at another nodes do the
+ * same, so no tuples are expected.
+ */
 static void
-EXCHANGE_Explain(CustomScanState *node, List *ancestors, ExplainState *es)
+close_empty_streams(ExchangeState *state, TupleTableSlot *slot)
 {
-	CustomScan			*cscan = (CustomScan *) node->ss.ps.plan;
-	int					nnodes = intVal(list_nth(cscan->custom_private, 0));
-	int					mynode = intVal(list_nth(cscan->custom_private, 1));
-	bool				bcast_mode = intVal(list_nth(cscan->custom_private, 2));
-	bool				ddrop = intVal(list_nth(cscan->custom_private, 3));
-	fr_options_t		frOpts;
-	StringInfoData		str;
+	CONN_Exchange_close(&state->conn);
+	state->LocalStorageIsActive = false;
 
-	frOpts.attno = intVal(list_nth(cscan->custom_private, 4));
-	frOpts.funcId = intVal(list_nth(cscan->custom_private, 5));
-	initStringInfo(&str);
+	while (state->NetworkIsActive)
+	{
+		if (!TupIsNull(GetTupleFromNetwork(state, slot,
+										   &state->NetworkIsActive)))
+			elog(ERROR, "Unexpected tuple in the closed exchange stream");
 
-	appendStringInfo(&str,
-					 "attno: %d, fid: %d, nnum=%d, nn=%d, ddrop: %u, bcast: %u",
-					 frOpts.attno,
-					 frOpts.funcId,
-					 mynode,
-					 nnodes,
-					 ddrop, bcast_mode);
+		if (state->NetworkIsActive)
+			CONN_Wait(&state->conn, true);
+	}
 
-	ExplainPropertyText("Exchange node", str.data, es);
+	while (!CONN_Flush_all(&state->conn))
+		CONN_Wait(&state->conn, false);
 }
 
 /*
- * --------------------------------
- *  Exchange implementation
- * --------------------------------
+ * Participants read the broadcast, loaded by the leader. Workers at another
+ * nodes do the same, so streams of the worker are closed without data.
  */
-
-Plan *
-make_exchange(Plan *subplan, fr_options_t frOpts,
-							bool drop_duplicates,
-							bool broadcast_mode,
-							int mynode, int nnodes)
+static TupleTableSlot *
+GetTupleFromSharedBroadcast(ExchangeState *state, TupleTableSlot *slot)
 {
-	CustomScan			*node = makeNode(CustomScan);
-	Plan				*plan = &node->scan.plan;
+	SharedBroadcast	*shared = state->shared;
+	dsa_area		*area = state->css.ss.ps.state->es_query_dsa;
 
-	/* Init plan by GATHER analogy */
-	plan->initPlan = subplan->initPlan;
-	subplan->initPlan = NIL;
+	if (state->LocalStorageIsActive)
+	{
+		close_empty_streams(state, slot);
 
-	/* Copy costs etc */
-	plan->startup_cost = subplan->startup_cost;
-	plan->total_cost = subplan->total_cost;
-	plan->plan_rows = subplan->plan_rows;
-	plan->plan_width = subplan->plan_width;
-	plan->qual = NIL;
-	plan->lefttree = subplan;
-	plan->righttree = NULL;
-	plan->parallel_aware = true; /* Use Shared Memory in parallel worker */
-	plan->parallel_safe = false;
-	plan->targetlist = NULL;
+		if (pg_atomic_read_u32(&shared->loaded) == 0)
+			elog(ERROR, "Shared broadcast is not loaded by the leader");
+		pg_read_barrier();
 
-	/* Setup methods and child plan */
-	node->methods = &exchange_plan_methods;
-	node->custom_scan_tlist = NIL;
-	node->scan.scanrelid = 0;
-	node->custom_plans = NIL;
-	node->custom_exprs = NIL;
-	node->custom_private = NIL;
+		state->chunk = shared->head;
+		state->offset = 0;
+	}
 
-	/* Pack private info */
-	node->custom_private = lappend(node->custom_private, makeInteger(nnodes));
-	node->custom_private = lappend(node->custom_private, makeInteger(mynode));
-	node->custom_private = lappend(node->custom_private, makeInteger(broadcast_mode));
-	node->custom_private = lappend(node->custom_private, makeInteger(drop_duplicates));
-	node->custom_private = lappend(node->custom_private, makeInteger(frOpts.attno));
-	node->custom_private = lappend(node->custom_private, makeInteger(frOpts.funcId));
+	while (DsaPointerIsValid(state->chunk))
+	{
+		BroadcastChunk *chunk = dsa_get_address(area, state->chunk);
 
-	return plan;
-}
+		if (state->offset < chunk->used)
+		{
+			MinimalTuple tuple = (MinimalTuple) (chunk->data + state->offset);
 
-static int
-fragmentation_fn_default(int value, int mynum, int nnodes)
-{
-	return value%nnodes;
+			state->offset += MAXALIGN(tuple->t_len);
+			/* The leader has counted the tuples at loading */
+			if (IsParallelWorker())
+				state->NetworkStorageTuple++;
+			return ExecStoreMinimalTuple(tuple, slot, false);
+		}
+
+		state->chunk = chunk->next;
+		state->offset = 0;
+	}
+
+	return ExecClearTuple(slot);
+}
+
+/*
+ * Send the tuple of the slot to another node.
+ */
+static void
+send_to_node(ExchangeState *state, TupleTableSlot *slot, int destnode)
+{
+	int size;
+
+	Assert(state->conn.wsock[destnode] > 0);
+	if (!state->sent)
+	{
+		state->sent = true;
+		TRACE_EXCHANGE(state, "first tuple sent", 0);
+	}
+
+	if (state->columnar)
+		send_columnar(state, slot, destnode);
+	else
+	{
+		send_slot(state, slot, destnode, &size);
+		state->conn.stats[destnode].tuples_sent++;
+	}
+}
+
+/*
+ * The leader does not own a key range of the worker routed exchange. If no
+ * workers are launched, the leader is the only participant and routes tuples
+ * to nodes. Returns false, if the leader has no tuples.
+ */
+static bool
+leader_of_workers(ExchangeState *state, TupleTableSlot *slot)
+{
+	if ((state->pcxt == NULL) || (state->pcxt->nworkers_launched == 0))
+	{
+		state->worker_route = WORKER_ROUTE_NONE;
+		return true;
+	}
+
+	if (state->pcxt->nworkers_launched < ProcessSharedConnInfoPool->size)
+		elog(ERROR, "Only %d of %d workers are launched for the exchange",
+			 state->pcxt->nworkers_launched, ProcessSharedConnInfoPool->size);
+
+	if (state->LocalStorageIsActive)
+		close_empty_streams(state, slot);
+	return false;
+}
+
+/*
+ * Place the tuple into the local queue of the worker. If the queue is full,
+ * the copy of the tuple waits for the place. A tuple of the detached worker
+ * is dropped: it has finished the plan and does not need tuples anymore.
+ */
+static void
+forward_tuple(ExchangeState *state, TupleTableSlot *slot, int worker)
+{
+	MinimalTuple	tuple = ExecFetchSlotMinimalTuple(slot);
+	shm_mq_result	res;
+
+	Assert(state->pending[worker] == NULL);
+
+	if (state->outq[worker] == NULL)
+		return;
+
+	res = shm_mq_send(state->outq[worker], tuple->t_len, tuple, true);
+
+	if (res == SHM_MQ_WOULD_BLOCK)
+		state->pending[worker] = heap_copy_minimal_tuple(tuple);
+	else if (res == SHM_MQ_DETACHED)
+	{
+		shm_mq_detach(state->outq[worker]);
+		state->outq[worker] = NULL;
+	}
+}
+
+/*
+ * Try to place pending tuples into the local queues. Returns true, if no
+ * tuples are pending.
+ */
+static bool
+flush_forwarded(ExchangeState *state)
+{
+	bool	flushed = true;
+	int		worker;
+
+	for (worker = 0; worker < state->nworkers; worker++)
+	{
+		MinimalTuple	tuple = state->pending[worker];
+		shm_mq_result	res;
+
+		if (tuple == NULL)
+			continue;
+
+		res = shm_mq_send(state->outq[worker], tuple->t_len, tuple, true);
+
+		if (res == SHM_MQ_WOULD_BLOCK)
+		{
+			flushed = false;
+			continue;
+		}
+		else if (res == SHM_MQ_DETACHED)
+		{
+			shm_mq_detach(state->outq[worker]);
+			state->outq[worker] = NULL;
+		}
+
+		pfree(tuple);
+		state->pending[worker] = NULL;
+	}
+
+	return flushed;
+}
+
+/*
+ * Receive the tuple, forwarded by another worker of the node. Returns NULL, if
+ * no tuples are ready. The tuple is valid up to the next call.
+ */
+static TupleTableSlot *
+receive_forwarded(ExchangeState *state, TupleTableSlot *slot)
+{
+	int worker;
+
+	for (worker = 0; worker < state->nworkers; worker++)
+	{
+		shm_mq_result	res;
+		Size			nbytes;
+		void			*data;
+
+		if (state->inq[worker] == NULL)
+			continue;
+
+		res = shm_mq_receive(state->inq[worker], &nbytes, &data, true);
+
+		if (res == SHM_MQ_SUCCESS)
+			return ExecStoreMinimalTuple((MinimalTuple) data, slot, false);
+		else if (res == SHM_MQ_DETACHED)
+		{
+			shm_mq_detach(state->inq[worker]);
+			state->inq[worker] = NULL;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Detach local queues of the worker. Receivers get the end of the stream
+ * after the rest of the queue. Senders drop tuples for us.
+ */
+static void
+detach_local_queues(ExchangeState *state, bool incoming)
+{
+	int worker;
+
+	for (worker = 0; worker < state->nworkers; worker++)
+	{
+		if (state->outq[worker] != NULL)
+		{
+			shm_mq_detach(state->outq[worker]);
+			state->outq[worker] = NULL;
+		}
+
+		if (incoming && (state->inq[worker] != NULL))
+		{
+			shm_mq_detach(state->inq[worker]);
+			state->inq[worker] = NULL;
+		}
+	}
+}
+
+static bool
+local_queues_are_attached(shm_mq_handle **queues, int nworkers)
+{
+	int worker;
+
+	for (worker = 0; worker < nworkers; worker++)
+	{
+		if (queues[worker] != NULL)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Next tuple of the worker with the WORKER_ROUTE_FORWARD routing. Tuples of
+ * another key range are forwarded to their worker through the local queue.
+ * The owner routes forwarded tuples to nodes. So the network streams are
+ * closed when the subplan is finished and all local senders are detached.
+ * Each step does not block: a full local queue or network queue stops the
+ * production of tuples, but incoming streams are drained meanwhile.
+ */
+static TupleTableSlot *
+ExchangeNextForward(ExchangeState *state)
+{
+	PlanState		*child_ps = outerPlanState(&state->css);
+	TupleTableSlot	*slot;
+	int				destnode;
+	int				worker;
+
+	for (;;)
+	{
+		CHECK_FOR_INTERRUPTS();
+		ResetLatch(MyLatch);
+
+		if (state->NetworkIsActive)
+		{
+			slot = GetTupleFromNetwork(state, state->css.ss.ss_ScanTupleSlot,
+									   &state->NetworkIsActive);
+
+			if (!TupIsNull(slot))
+			{
+				if (++state->NetworkStorageTuple == 1)
+					TRACE_EXCHANGE(state, "first tuple received", 0);
+				return slot;
+			}
+		}
+
+		if (!CONN_Queue_is_full(&state->conn))
+		{
+			bool flushed = flush_forwarded(state);
+
+			slot = receive_forwarded(state, state->css.ss.ss_ScanTupleSlot);
+			if (slot != NULL)
+			{
+				destnode = route_tuple(state, slot, &worker);
+				Assert(worker == state->myslot);
+
+				if (destnode == state->mynode)
+					return slot;
+
+				send_to_node(state, slot, destnode);
+				continue;
+			}
+
+			if (flushed && state->LocalStorageIsActive)
+			{
+				slot = ExecProcNode(child_ps);
+
+				if (TupIsNull(slot))
+				{
+					state->LocalStorageIsActive = false;
+					continue;
+				}
+
+				state->LocalStorageTuple++;
+				destnode = route_tuple(state, slot, &worker);
+
+				if (worker != state->myslot)
+					forward_tuple(state, slot, worker);
+				else if (destnode == state->mynode)
+					return slot;
+				else
+					send_to_node(state, slot, destnode);
+				continue;
+			}
+
+			if (flushed && !state->LocalStorageIsActive &&
+				local_queues_are_attached(state->outq, state->nworkers))
+			{
+				detach_local_queues(state, false);
+				continue;
+			}
+		}
+
+		if (!state->closed && !state->LocalStorageIsActive &&
+			!local_queues_are_attached(state->outq, state->nworkers) &&
+			!local_queues_are_attached(state->inq, state->nworkers))
+		{
+			if (state->columnar)
+			{
+				int i;
+
+				for (i = 0; i < nodes_at_cluster; i++)
+					flush_columnar(state, i);
+			}
+
+			CONN_Exchange_close(&state->conn);
+			state->closed = true;
+			TRACE_EXCHANGE(state, "close", 0);
+			continue;
+		}
+
+		if (state->closed && !state->NetworkIsActive)
+		{
+			/* Push the rest of the queues before the end of the scan */
+			while (!CONN_Flush_all(&state->conn))
+				CONN_Wait(&state->conn, false);
+			return ExecClearTuple(state->css.ss.ss_ScanTupleSlot);
+		}
+
+		/* Wait for incoming tuples, space in the queues or local queues */
+		CONN_Wait_latch(&state->conn, state->NetworkIsActive);
+	}
+}
+
+static TupleTableSlot *
+ExchangeNext(CustomScanState *node)
+{
+	PlanState		*child_ps = outerPlanState(node);
+	TupleTableSlot	*slot = node->ss.ss_ScanTupleSlot;
+	bool			isnull;
+	Datum			value;
+	ExchangeState	*state = (ExchangeState *)node;
+	int				destnode;
+
+	if (state->shared != NULL)
+		return GetTupleFromSharedBroadcast(state, slot);
+
+	if ((state->worker_route != WORKER_ROUTE_NONE) && !IsParallelWorker() &&
+		!leader_of_workers(state, slot))
+		return ExecClearTuple(slot);
+
+	if (state->worker_route == WORKER_ROUTE_FORWARD)
+		return ExchangeNextForward(state);
+
+	for (;;)
+	{
+		if (state->NetworkIsActive)
+		{
+			slot = GetTupleFromNetwork(state, node->ss.ss_ScanTupleSlot,
+									   &state->NetworkIsActive);
+
+			if (!TupIsNull(slot))
+			{
+				if (++state->NetworkStorageTuple == 1)
+					TRACE_EXCHANGE(state, "first tuple received", 0);
+				break;
+			}
+		}
+
+		if (state->LocalStorageIsActive)
+		{
+			/*
+			 * Some peer do not read our tuples. Do not produce new tuples
+			 * until the queue will be unloaded and receive incoming tuples
+			 * meanwhile. The peer can wait for it.
+			 */
+			if (CONN_Queue_is_full(&state->conn))
+			{
+				CONN_Wait(&state->conn, state->NetworkIsActive);
+				continue;
+			}
+
+			slot = ExecProcNode(child_ps);
+
+			if (TupIsNull(slot))
+			{
+				if (state->columnar)
+				{
+					int i;
+
+					for (i = 0; i < nodes_at_cluster; i++)
+						flush_columnar(state, i);
+				}
+
+				CONN_Exchange_close(&state->conn);
+				state->LocalStorageIsActive = false;
+				TRACE_EXCHANGE(state, "close", 0);
+			} else
+				state->LocalStorageTuple++;
+		}
+
+		if (TupIsNull(slot))
+		{
+			if (!state->NetworkIsActive && !state->LocalStorageIsActive)
+			{
+				/* Push the rest of the queues before the end of the scan */
+				while (!CONN_Flush_all(&state->conn))
+					CONN_Wait(&state->conn, false);
+				return slot;
+			}
+			else if (!state->LocalStorageIsActive)
+				/* Wait for incoming tuples and unload the queues */
+				CONN_Wait(&state->conn, true);
+			continue;
+		}
+
+		if (state->broadcast_mode && state->columnar)
+		{
+			/* Batch of the local node accumulates broadcasted rows */
+			send_columnar(state, slot, state->mynode);
+			break;
+		}
+		else if (state->broadcast_mode)
+		{
+			int		destnode;
+			char	*msg = NULL;
+			int		size;
+
+			for (destnode = 0; destnode < nodes_at_cluster; destnode++)
+			{
+				if (state->conn.wsock[destnode] == PGINVALID_SOCKET)
+					continue;
+
+				/* Form the message once and copy it to another queues */
+				if (msg == NULL)
+					msg = send_slot(state, slot, destnode, &size);
+				else
+					CONN_Send_async(&state->conn, destnode, msg, size);
+				state->conn.stats[destnode].tuples_sent++;
+			}
+
+			if (!state->sent)
+			{
+				state->sent = true;
+				TRACE_EXCHANGE(state, "first tuple sent", 0);
+			}
+
+			/* Send tuple to myself */
+			break;
+		}
+		else if (state->frOpts.funcId == FR_FUNC_GATHER)
+		{
+			destnode = CoordNode;
+		}
+		else if (state->worker_route == WORKER_ROUTE_FILTER)
+		{
+			int worker;
+
+			destnode = route_tuple(state, slot, &worker);
+
+			/* Each worker produces the tuple, it is sent by the owner */
+			if (worker != state->myslot)
+				continue;
+		}
+		else
+		{
+			/* Extract value of cell in a distribution domain */
+			value = slot_getattr(slot, state->frOpts.attno, &isnull);
+			Assert(!isnull);
+
+			destnode = get_tuple_node(state->frOpts.funcId, value,
+									  state->mynode, state->nnodes,
+									  state->data);
+		}
+
+		if (destnode == state->mynode)
+			break;
+		else if (state->drop_duplicates)
+			continue;
+		else
+		{
+			send_to_node(state, slot, destnode);
+			continue;
+		}
+	}
+
+	return slot;
+}
+
+/*
+ * Return next tuple of the exchange. On rescan, the cached output of the first
+ * pass is replayed before the rest of the stream, like in the Material node.
+ */
+static TupleTableSlot *
+EXCHANGE_Execute(CustomScanState *node)
+{
+	ExchangeState	*state = (ExchangeState *) node;
+	TupleTableSlot	*slot;
+
+	if (state->cache == NULL)
+		return ExchangeNext(node);
+
+	if (!tuplestore_ateof(state->cache))
+	{
+		slot = node->ss.ps.ps_ResultTupleSlot;
+
+		if (tuplestore_gettupleslot(state->cache, true, false, slot))
+			return slot;
+	}
+
+	if (state->eof_underlying)
+		return ExecClearTuple(node->ss.ps.ps_ResultTupleSlot);
+
+	slot = ExchangeNext(node);
+
+	if (TupIsNull(slot))
+		state->eof_underlying = true;
+	else
+		tuplestore_puttupleslot(state->cache, slot);
+
+	return slot;
+}
+
+static void
+EXCHANGE_End(CustomScanState *node)
+{
+	ExchangeState	*state = (ExchangeState *)node;
+	int i;
+
+	/*
+	 * clean out the tuple table
+	 */
+	ExecClearTuple(node->ss.ps.ps_ResultTupleSlot);
+	ExecClearTuple(node->ss.ss_ScanTupleSlot);
+
+	Assert(state->conn.rsock);
+	Assert(state->conn.wsock);
+
+	STATS_Report_exchange(&state->conn, state->relid, state->broadcast_mode);
+	if (state->frOpts.funcId != FR_FUNC_GATHER)
+		report_key_traffic(state);
+	TRACE_EXCHANGE(state, "lifetime", state->started);
+	CONN_Release_wait_events(&state->conn);
+
+	for (i = 0; i < nodes_at_cluster; i++)
+	{
+		if (i == node_number)
+			continue;
+
+		Assert(state->conn.rsock[i] != PGINVALID_SOCKET);
+		Assert(state->conn.wsock[i] != PGINVALID_SOCKET);
+		if (state->conn.rsIsOpened[i] != false)
+			elog(LOG,
+			"Read socket %d to node %d is not closed. It is explain query?",
+			state->conn.rsock[i], i);
+
+		closesocket(state->conn.rsock[i]);
+		state->conn.rsock[i] = PGINVALID_SOCKET;
+
+		if (state->conn.wsIsOpened[i] != false)
+			elog(LOG,
+			"Write socket %d to node %d is not closed. It is explain query?",
+			state->conn.wsock[i], i);
+
+		closesocket(state->conn.wsock[i]);
+		state->conn.wsock[i] = PGINVALID_SOCKET;
+	}
+	if (state->cache != NULL)
+		tuplestore_end(state->cache);
+
+	if (state->outq != NULL)
+		detach_local_queues(state, true);
+
+	ExecEndNode(outerPlanState(node));
+}
+
+/*
+ * Workers of the plan are finished here, if the leader has read all their
+ * tuples. Take their key traffic before the shared memory is destroyed.
+ * Traffic of workers, which are stopped earlier, is lost.
+ */
+static void
+EXCHANGE_Shutdown(CustomScanState *node)
+{
+	ExchangeState	*state = (ExchangeState *) node;
+
+	if (IsParallelWorker() || (state->traffic == NULL))
+		return;
+
+	state->worker_tuples += pg_atomic_exchange_u64(&state->traffic->tuples, 0);
+	state->worker_bytes += pg_atomic_exchange_u64(&state->traffic->bytes, 0);
+	state->traffic = NULL;
+}
+
+/*
+ * Report the traffic, sent by the exchange, by its key column. A parallel
+ * worker, which can't report it to the coordinator, passes it to the leader.
+ */
+static void
+report_key_traffic(ExchangeState *state)
+{
+	uint64	tuples = state->worker_tuples;
+	uint64	bytes = state->worker_bytes;
+	int		node;
+
+	/* Connections were not established, if the node was not executed */
+	if ((state->conn.stats == NULL) && (tuples == 0))
+		return;
+
+	for (node = 0; (state->conn.stats != NULL) && (node < nodes_at_cluster);
+		 node++)
+	{
+		tuples += state->conn.stats[node].tuples_sent;
+		bytes += state->conn.stats[node].bytes_sent;
+	}
+
+	if (STATS_Report_key(state->relid, state->keyattno, state->broadcast_mode,
+						 tuples, bytes))
+		return;
+
+	if (IsParallelWorker() && (state->traffic != NULL))
+	{
+		pg_atomic_fetch_add_u64(&state->traffic->tuples, tuples);
+		pg_atomic_fetch_add_u64(&state->traffic->bytes, bytes);
+	}
+}
+
+static void
+EXCHANGE_Rescan(CustomScanState *node)
+{
+	PlanState		*outerPlan = outerPlanState(node);
+	ExchangeState	*state = (ExchangeState *)node;
+
+	/* The stream is not started yet. Nothing to repeat. */
+	if (state->NetworkIsActive && state->LocalStorageIsActive &&
+		(state->NetworkStorageTuple == 0) && (state->LocalStorageTuple == 0))
+	{
+		if (outerPlan->chgParam == NULL)
+			ExecReScan(outerPlan);
+		return;
+	}
+
+	/*
+	 * Peers do not rescan the exchange synchronously with us. So the result
+	 * can be only replayed from the cache, with the same parameters.
+	 */
+	if (node->ss.ps.chgParam != NULL)
+		elog(ERROR, "EXCHANGE can't be rescanned with changed parameters");
+
+	/* The shared broadcast is kept up to the end of the query */
+	if ((state->shared != NULL) && (state->cache == NULL) &&
+		!state->LocalStorageIsActive)
+	{
+		state->chunk = state->shared->head;
+		state->offset = 0;
+		return;
+	}
+
+	if (state->cache == NULL)
+		elog(ERROR, "EXCHANGE without result cache can't be rescanned");
+
+	tuplestore_rescan(state->cache);
+}
+
+/*
+ * Prepare shared state for workers, launched for the rescan. The ports are
+ * owned by the leader, so new workers use the same slots of the pool.
+ * Peers do not repeat the broadcast, so the loaded one is read again.
+ *
+ * Workers of the previous scan are finished, and so are the result caches of
+ * their exchanges (see set_exchange_rescans()). The new workers run their
+ * exchanges again. It works only if the Gather is rescanned at every node in
+ * lockstep: the workers of the same slot at the peers must be launched again
+ * too. Nothing checks it here: a Gather rescanned at one node only blocks
+ * on the connections to peer workers, which are not launched again.
+ */
+static void
+EXCHANGE_ReInitializeDSM(CustomScanState *node, ParallelContext *pcxt,
+		  	  	  	  	 void *coordinate)
+{
+	ExchangeState	*state = (ExchangeState *) node;
+	ConnInfoPool	*pool = (ConnInfoPool *) coordinate;
+
+	pg_atomic_write_u32(&pool->current, 0);
+	state->traffic = EXCHANGE_WORKER_TRAFFIC(coordinate);
+
+	/* Queues can not be attached twice */
+	if (state->worker_route != WORKER_ROUTE_NONE)
+		create_local_queues(state, pcxt, coordinate);
+}
+
+static void
+EXCHANGE_Explain(CustomScanState *node, List *ancestors, ExplainState *es)
+{
+	CustomScan			*cscan = (CustomScan *) node->ss.ps.plan;
+	int					nnodes = intVal(list_nth(cscan->custom_private, 0));
+	int					mynode = intVal(list_nth(cscan->custom_private, 1));
+	bool				bcast_mode = intVal(list_nth(cscan->custom_private, 2));
+	bool				ddrop = intVal(list_nth(cscan->custom_private, 3));
+	fr_options_t		frOpts;
+	StringInfoData		str;
+
+	frOpts.attno = intVal(list_nth(cscan->custom_private, 4));
+	frOpts.funcId = intVal(list_nth(cscan->custom_private, 5));
+	initStringInfo(&str);
+
+	appendStringInfo(&str,
+					 "attno: %d, fid: %d, nnum=%d, nn=%d, ddrop: %u, bcast: %u",
+					 frOpts.attno,
+					 frOpts.funcId,
+					 mynode,
+					 nnodes,
+					 ddrop, bcast_mode);
+	if (intVal(list_nth(cscan->custom_private, 7)))
+		appendStringInfoString(&str, ", compressed");
+	if (intVal(list_nth(cscan->custom_private, 8)))
+		appendStringInfoString(&str, ", columnar");
+	if (intVal(list_nth(cscan->custom_private, 9)))
+		appendStringInfoString(&str, ", shared");
+	if (intVal(list_nth(cscan->custom_private, 10)))
+		appendStringInfoString(&str, ", cached");
+	if (intVal(list_nth(cscan->custom_private, 12)) > 0)
+		appendStringInfo(&str, ", colocation: %d",
+						 intVal(list_nth(cscan->custom_private, 12)));
+	if (intVal(list_nth(cscan->custom_private, 14)) == WORKER_ROUTE_FILTER)
+		appendStringInfoString(&str, ", workers: filter");
+	else if (intVal(list_nth(cscan->custom_private, 14)) ==
+														WORKER_ROUTE_FORWARD)
+		appendStringInfoString(&str, ", workers: forward");
+
+	ExplainPropertyText("Exchange node", str.data, es);
+
+	if (es->analyze)
+		explain_exchange_stats((ExchangeState *) node, es);
+}
+
+/*
+ * Find the relation, which tuples are passed by the exchange. Returns
+ * InvalidOid, if the subplan is not a scan of one relation, like a join.
+ */
+Oid
+exchange_source_relation(Plan *plan, List *rtable)
+{
+	while (plan != NULL)
+	{
+		switch (nodeTag(plan))
+		{
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_IndexScan:
+		case T_IndexOnlyScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+			return getrelid(((Scan *) plan)->scanrelid, rtable);
+
+		case T_Sort:
+		case T_Material:
+		case T_Hash:
+		case T_Result:
+		case T_Unique:
+		case T_Agg:
+		case T_Gather:
+		case T_GatherMerge:
+			plan = plan->lefttree;
+			break;
+
+		default:
+			return InvalidOid;
+		}
+	}
+
+	return InvalidOid;
+}
+
+/*
+ * Find the column of the exchange_source_relation(), which is the attribute
+ * attno of the plan output. Returns InvalidAttrNumber, if the attribute is
+ * not a plain column of the relation.
+ */
+AttrNumber
+exchange_source_attribute(Plan *plan, AttrNumber attno)
+{
+	while ((plan != NULL) && (attno > 0) &&
+		   (attno <= list_length(plan->targetlist)))
+	{
+		Expr	*expr = ((TargetEntry *) list_nth(plan->targetlist,
+												  attno - 1))->expr;
+
+		while (IsA(expr, RelabelType))
+			expr = ((RelabelType *) expr)->arg;
+
+		if (!IsA(expr, Var))
+			return InvalidAttrNumber;
+
+		switch (nodeTag(plan))
+		{
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_IndexScan:
+		case T_IndexOnlyScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+			if (((Var *) expr)->varno != ((Scan *) plan)->scanrelid)
+				return InvalidAttrNumber;
+			return ((Var *) expr)->varattno;
+
+		case T_Sort:
+		case T_Material:
+		case T_Hash:
+		case T_Result:
+		case T_Unique:
+		case T_Agg:
+		case T_Gather:
+		case T_GatherMerge:
+			if (((Var *) expr)->varno != OUTER_VAR)
+				return InvalidAttrNumber;
+			attno = ((Var *) expr)->varattno;
+			plan = plan->lefttree;
+			break;
+
+		default:
+			return InvalidAttrNumber;
+		}
+	}
+
+	return InvalidAttrNumber;
+}
+
+/*
+ * Show traffic of the exchange with each peer. Plans of the remote instances
+ * are shown at the end of the execution, see HOOK_ExecEnd_injection().
+ */
+static void
+explain_exchange_stats(ExchangeState *state, ExplainState *es)
+{
+	ex_conn_t	*conn = &state->conn;
+	int			node;
+
+	ExplainPropertyInteger("Local Tuples", NULL,
+						   state->LocalStorageTuple, es);
+	ExplainPropertyInteger("Network Tuples", NULL,
+						   state->NetworkStorageTuple, es);
+
+	/* Connections were not established, if the node was not executed */
+	if (conn->stats == NULL)
+		return;
+
+	ExplainPropertyFloat("Send Wait Time", "ms",
+						 INSTR_TIME_GET_MILLISEC(conn->send_wait), 3, es);
+	ExplainPropertyFloat("Receive Wait Time", "ms",
+						 INSTR_TIME_GET_MILLISEC(conn->recv_wait), 3, es);
+
+	ExplainOpenGroup("Peers", "Peers", false, es);
+	for (node = 0; node < nodes_at_cluster; node++)
+	{
+		ExchangePeerStats *stats = &conn->stats[node];
+
+		if (node == state->mynode)
+			continue;
+
+		if (es->format == EXPLAIN_FORMAT_TEXT)
+		{
+			appendStringInfoSpaces(es->str, es->indent * 2);
+			appendStringInfo(es->str,
+							 "Peer %d: sent=" UINT64_FORMAT " tuples "
+							 UINT64_FORMAT " bytes, received=" UINT64_FORMAT
+							 " tuples " UINT64_FORMAT " bytes, flushes="
+							 UINT64_FORMAT,
+							 node, stats->tuples_sent, stats->bytes_sent,
+							 stats->tuples_received, stats->bytes_received,
+							 stats->flushes);
+			if (stats->batches > 0)
+				appendStringInfo(es->str, ", batches=" UINT64_FORMAT,
+								 stats->batches);
+			appendStringInfoChar(es->str, '\n');
+		}
+		else
+		{
+			ExplainOpenGroup("Peer", NULL, true, es);
+			ExplainPropertyInteger("Node", NULL, node, es);
+			ExplainPropertyInteger("Tuples Sent", NULL,
+								   stats->tuples_sent, es);
+			ExplainPropertyInteger("Bytes Sent", "bytes",
+								   stats->bytes_sent, es);
+			ExplainPropertyInteger("Tuples Received", NULL,
+								   stats->tuples_received, es);
+			ExplainPropertyInteger("Bytes Received", "bytes",
+								   stats->bytes_received, es);
+			ExplainPropertyInteger("Flushes", NULL, stats->flushes, es);
+			ExplainPropertyInteger("Batches", NULL, stats->batches, es);
+			ExplainCloseGroup("Peer", NULL, true, es);
+		}
+	}
+	ExplainCloseGroup("Peers", "Peers", false, es);
+}
+
+/*
+ * --------------------------------
+ *  Exchange implementation
+ * --------------------------------
+ */
+
+Plan *
+make_exchange(Plan *subplan, fr_options_t frOpts,
+							bool drop_duplicates,
+							bool broadcast_mode,
+							int mynode, int nnodes)
+{
+	CustomScan			*node = makeNode(CustomScan);
+	Plan				*plan = &node->scan.plan;
+
+	/* Init plan by GATHER analogy */
+	plan->initPlan = subplan->initPlan;
+	subplan->initPlan = NIL;
+
+	/* Copy costs etc */
+	plan->startup_cost = subplan->startup_cost;
+	plan->total_cost = subplan->total_cost;
+	plan->plan_rows = subplan->plan_rows;
+	plan->plan_width = subplan->plan_width;
+	plan->qual = NIL;
+	plan->lefttree = subplan;
+	plan->righttree = NULL;
+	plan->parallel_aware = true; /* Use Shared Memory in parallel worker */
+	plan->parallel_safe = false;
+	plan->targetlist = NULL;
+
+	/* Setup methods and child plan */
+	node->methods = &exchange_plan_methods;
+	node->custom_scan_tlist = NIL;
+	node->scan.scanrelid = 0;
+	node->custom_plans = NIL;
+	node->custom_exprs = NIL;
+	node->custom_private = NIL;
+
+	/* Pack private info */
+	node->custom_private = lappend(node->custom_private, makeInteger(nnodes));
+	node->custom_private = lappend(node->custom_private, makeInteger(mynode));
+	node->custom_private = lappend(node->custom_private, makeInteger(broadcast_mode));
+	node->custom_private = lappend(node->custom_private, makeInteger(drop_duplicates));
+	node->custom_private = lappend(node->custom_private, makeInteger(frOpts.attno));
+	node->custom_private = lappend(node->custom_private, makeInteger(frOpts.funcId));
+
+	/* Attributes used above the exchange. NIL - all attributes are used. */
+	node->custom_private = lappend(node->custom_private, NIL);
+
+	/* Compress wide tuples: it trades CPU for the network bandwidth */
+	node->custom_private = lappend(node->custom_private,
+		makeInteger((exchange_compression_min_width >= 0) &&
+					(subplan->plan_width >= exchange_compression_min_width)));
+
+	/* Send rows by columnar blocks */
+	node->custom_private = lappend(node->custom_private,
+								   makeInteger(exchange_columnar));
+
+	/*
+	 * Each parallel participant gets whole result of not partial subplan. So
+	 * the broadcast is passed once per node and shared by the participants.
+	 * The leader loads it before the shared memory of nested exchanges is
+	 * initialized, so they are not allowed.
+	 */
+	node->custom_private = lappend(node->custom_private,
+					makeInteger(broadcast_mode && !is_partial_plan(subplan) &&
+								!has_exchange(subplan)));
+
+	/* Output is cached for rescans. See exchange_set_rescannable(). */
+	node->custom_private = lappend(node->custom_private, makeInteger(0));
+
+	/*
+	 * Attribute of the subplan, which forced the exchange. It is the
+	 * distribution attribute of the redistribution. See exchange_set_key().
+	 */
+	node->custom_private = lappend(node->custom_private,
+		makeInteger((broadcast_mode || (frOpts.funcId == FR_FUNC_GATHER)) ?
+					0 : frOpts.attno));
+
+	/*
+	 * Tuples are routed by the bucket map of the colocation group. So the
+	 * result is co-located with the relations of the group.
+	 */
+	node->custom_private = lappend(node->custom_private,
+								   makeInteger(frOpts.colocation));
+	node->custom_private = lappend(node->custom_private,
+		(!broadcast_mode && (frOpts.funcId == FR_FUNC_HASH)) ?
+							PLAN_Get_bucket_map(frOpts.colocation) : NIL);
+
+	/* Routing to the workers of the node. See exchange_set_worker_routing(). */
+	node->custom_private = lappend(node->custom_private,
+								   makeInteger(WORKER_ROUTE_NONE));
+
+	return plan;
+}
+
+bool
+is_exchange_plan(Plan *plan)
+{
+	return IsA(plan, CustomScan) &&
+		   (((CustomScan *) plan)->methods == &exchange_plan_methods);
+}
+
+/*
+ * Restrict the set of attributes, sent to another nodes, by the attrs set.
+ * The distribution attribute is added by the routine. Returns set of the
+ * attributes which the exchange uses from its child.
+ */
+Bitmapset *
+exchange_set_projection(Plan *plan, Bitmapset *attrs)
+{
+	CustomScan	*node = (CustomScan *) plan;
+	int			attno = intVal(list_nth(node->custom_private, 4));
+	bool		bcast_mode = intVal(list_nth(node->custom_private, 2));
+	fr_func_id	funcId = intVal(list_nth(node->custom_private, 5));
+	List		*attnos = NIL;
+	int			natts = list_length(plan->lefttree->targetlist);
+	ListCell	*lc;
+	int			i;
+
+	Assert(is_exchange_plan(plan));
+
+	if (!bcast_mode && (funcId != FR_FUNC_GATHER) && (attno > 0))
+		attrs = bms_add_member(bms_copy(attrs), attno);
+
+	for (i = 1; i <= natts; i++)
+	{
+		if (bms_is_member(i, attrs))
+			attnos = lappend(attnos, makeInteger(i));
+	}
+
+	/*
+	 * All attributes are used: nothing to cut off. No attribute is used (as by
+	 * count(*)): all of them are sent as NULLs. NIL means all attributes, so
+	 * the empty projection is marked by zero.
+	 */
+	if (list_length(attnos) == natts)
+		attnos = NIL;
+	else if (attnos == NIL)
+		attnos = list_make1(makeInteger(0));
+
+	lc = list_head(node->custom_private);
+	for (i = 0; i < 6; i++)
+		lc = lnext(lc);
+	lfirst(lc) = attnos;
+
+	return attrs;
+}
+
+/*
+ * The exchange will be rescanned. So it needs to cache its output.
+ */
+void
+exchange_set_rescannable(Plan *plan)
+{
+	CustomScan	*node = (CustomScan *) plan;
+	ListCell	*lc;
+	int			i;
+
+	Assert(is_exchange_plan(plan));
+
+	lc = list_head(node->custom_private);
+	for (i = 0; i < 10; i++)
+		lc = lnext(lc);
+	lfirst(lc) = makeInteger(1);
+}
+
+/*
+ * The subplan is broadcasted because of the join or grouping by the
+ * attribute attno. It is used by the statistics of distribution keys.
+ */
+void
+exchange_set_key(Plan *plan, AttrNumber attno)
+{
+	CustomScan	*node = (CustomScan *) plan;
+	ListCell	*lc;
+	int			i;
+
+	Assert(is_exchange_plan(plan));
+
+	lc = list_head(node->custom_private);
+	for (i = 0; i < 11; i++)
+		lc = lnext(lc);
+	lfirst(lc) = makeInteger(attno);
+}
+
+/*
+ * The redistribution is an input of a parallel oblivious join. Each worker
+ * will own a key range, so the join of workers gets only their tuples. If the
+ * subplan is partial, tuples are forwarded between workers.
+ */
+void
+exchange_set_worker_routing(Plan *plan)
+{
+	CustomScan	*node = (CustomScan *) plan;
+	ListCell	*lc;
+	int			i;
+
+	Assert(is_exchange_plan(plan));
+	Assert(intVal(list_nth(node->custom_private, 5)) == FR_FUNC_HASH);
+	Assert(!intVal(list_nth(node->custom_private, 2)));
+
+	lc = list_head(node->custom_private);
+	for (i = 0; i < 14; i++)
+		lc = lnext(lc);
+	lfirst(lc) = makeInteger(is_partial_plan(plan->lefttree) ?
+							 WORKER_ROUTE_FORWARD : WORKER_ROUTE_FILTER);
+}
+
+/*
+ * Check that each parallel participant gets only a part of the plan result.
+ * Unknown plans with children are supposed to be partial.
+ */
+bool
+is_partial_plan(Plan *plan)
+{
+	if (plan == NULL)
+		return false;
+
+	switch (nodeTag(plan))
+	{
+	case T_Gather:
+	case T_GatherMerge:
+		return false;
+	case T_Append:
+	case T_MergeAppend:
+	case T_SubqueryScan:
+	case T_RecursiveUnion:
+	case T_BitmapAnd:
+	case T_BitmapOr:
+		return true;
+	case T_CustomScan:
+		if (!is_exchange_plan(plan))
+			return true;
+		break;
+	default:
+		if (plan->parallel_aware)
+			return true;
+		break;
+	}
+
+	return is_partial_plan(plan->lefttree) || is_partial_plan(plan->righttree);
+}
+
+/*
+ * Check that the plan contains an exchange node.
+ */
+static bool
+has_exchange(Plan *plan)
+{
+	if (plan == NULL)
+		return false;
+
+	if (is_exchange_plan(plan))
+		return true;
+
+	return has_exchange(plan->lefttree) || has_exchange(plan->righttree);
+}
+
+static int
+fragmentation_fn_default(int value, int mynum, int nnodes)
+{
+	return value%nnodes;
 }
 
 static int
@@ -504,6 +1820,142 @@ fragmentation_fn_empty(int value, int nnodes, int mynum)
 	return mynum;
 }
 
+/*
+ * Prepare routing data for the hash fragmentation function by the distribution
+ * attribute type.
+ */
+HashRouteData *
+make_hash_route(Oid atttypid)
+{
+	HashRouteData	*route = palloc0(sizeof(HashRouteData));
+	Oid				opclass;
+	Oid				funcid;
+	Oid				opcfamily,
+					opcintype;
+
+	opclass = GetDefaultOpClass(atttypid, HASH_AM_OID);
+	opcfamily = get_opclass_family(opclass);
+	opcintype = get_opclass_input_type(opclass);
+	funcid = get_opfamily_proc(opcfamily,
+							   opcintype,
+							   opcintype,
+							   HASHEXTENDED_PROC);
+
+	fmgr_info(funcid, &route->hashfunction);
+
+	/*
+	 * Kernel is selected by the function itself. So inlined hashing is used
+	 * only if it gives the same result as the opclass.
+	 */
+	switch (funcid)
+	{
+	case F_HASHINT2EXTENDED:
+		route->kernel = HASH_KERNEL_INT2;
+		break;
+	case F_HASHINT4EXTENDED:
+		route->kernel = HASH_KERNEL_INT4;
+		break;
+	case F_HASHINT8EXTENDED:
+		route->kernel = HASH_KERNEL_INT8;
+		break;
+	case F_UUID_HASH_EXTENDED:
+		route->kernel = HASH_KERNEL_UUID;
+		break;
+	case F_HASHTEXTEXTENDED:
+		route->kernel = HASH_KERNEL_TEXT;
+		break;
+	default:
+		route->kernel = HASH_KERNEL_FMGR;
+		break;
+	}
+
+	return route;
+}
+
+/*
+ * Route by the bucket map of the colocation group. buckets is a list of
+ * nodes, indexed by the bucket number.
+ */
+void
+set_hash_route_buckets(HashRouteData *route, List *buckets)
+{
+	ListCell	*lc;
+	int			i = 0;
+
+	route->nbuckets = list_length(buckets);
+	if (route->nbuckets == 0)
+	{
+		route->buckets = NULL;
+		return;
+	}
+
+	route->buckets = palloc(route->nbuckets * sizeof(int));
+	foreach(lc, buckets)
+		route->buckets[i++] = intVal(lfirst(lc));
+}
+
+/*
+ * Compute extended hash of the value with zero seed. Inlined kernels are
+ * copies of the hashint2extended(), hashint4extended(), hashint8extended(),
+ * uuid_hash_extended() and hashtextextended() functions.
+ */
+static inline uint64
+hash_route_value(HashRouteData *route, Datum value)
+{
+	switch (route->kernel)
+	{
+	case HASH_KERNEL_INT2:
+		return DatumGetUInt64(hash_uint32_extended(
+								(int32) DatumGetInt16(value), 0));
+	case HASH_KERNEL_INT4:
+		return DatumGetUInt64(hash_uint32_extended(
+								DatumGetInt32(value), 0));
+	case HASH_KERNEL_INT8:
+	{
+		int64	val = DatumGetInt64(value);
+		uint32	lohalf = (uint32) val;
+		uint32	hihalf = (uint32) (val >> 32);
+
+		lohalf ^= (val >= 0) ? hihalf : ~hihalf;
+		return DatumGetUInt64(hash_uint32_extended(lohalf, 0));
+	}
+	case HASH_KERNEL_UUID:
+		return DatumGetUInt64(hash_any_extended(
+								DatumGetUUIDP(value)->data, UUID_LEN, 0));
+	case HASH_KERNEL_TEXT:
+	{
+		text	*key = DatumGetTextPP(value);
+		uint64	result;
+
+		result = DatumGetUInt64(hash_any_extended(
+								(unsigned char *) VARDATA_ANY(key),
+								VARSIZE_ANY_EXHDR(key), 0));
+
+		if ((Pointer) key != DatumGetPointer(value))
+			pfree(key);
+		return result;
+	}
+	case HASH_KERNEL_FMGR:
+	default:
+		return DatumGetUInt64(FunctionCall2(&route->hashfunction, value, 0));
+	}
+}
+
+/*
+ * Node of the hash value: by the bucket map of the colocation group, if any.
+ */
+static inline int
+hash_route_node(HashRouteData *route, uint64 hash, int nnodes)
+{
+	if (route->buckets != NULL)
+		return route->buckets[hash % route->nbuckets];
+	return hash % nnodes;
+}
+
+/*
+ * Returns the node of the tuple, but not a participant at the node. See
+ * comments at the top of the file.
+ */
 int
 get_tuple_node(fr_func_id fid, Datum value, int mynode, int nnodes,
 			   void *data)
@@ -521,42 +1973,181 @@ get_tuple_node(fr_func_id fid, Datum value, int mynode, int nnodes,
 	case FR_FUNC_NINITIALIZED:
 		return fragmentation_fn_empty(0, mynode, nnodes);
 	case FR_FUNC_HASH:
-	{
-//		int val = DatumGetInt32(value);
-		int res;
-//		int a = 1;
 		Assert(data != NULL);
-		res = DatumGetUInt64(FunctionCall2((FmgrInfo *)data, value,
-												0)) % nnodes;
-//		elog(LOG, "node=%d val=%d res=%d", mynode, val, res);
-		return res;
-	}
+		return hash_route_node((HashRouteData *) data,
+							   hash_route_value((HashRouteData *) data, value),
+							   nnodes);
 	default:
 		elog(ERROR, "Undefined function");
 	}
 	return -1;
 }
 
+/*
+ * Returns the node and the worker of the tuple by the FR_FUNC_HASH function.
+ * The worker is computed by the high half of the hash value, so it does not
+ * depend on the node.
+ */
+static int
+route_tuple(ExchangeState *state, TupleTableSlot *slot, int *worker)
+{
+	HashRouteData	*route = (HashRouteData *) state->data;
+	Datum			value;
+	bool			isnull;
+	uint64			hash;
+
+	Assert(state->frOpts.funcId == FR_FUNC_HASH);
+
+	value = slot_getattr(slot, state->frOpts.attno, &isnull);
+	Assert(!isnull);
+
+	hash = hash_route_value(route, value);
+	*worker = (int) ((uint32) (hash >> 32) % state->nworkers);
+	return hash_route_node(route, hash, state->nnodes);
+}
+
 static Size
 EXCHANGE_EstimateDSM(CustomScanState *node, ParallelContext *pcxt)
 {
-	return sizeof(ConnInfoPool) * pcxt->nworkers;
+	ExchangeState	*state = (ExchangeState *) node;
+	Size			size;
+
+	/*
+	 * One pool is created per query by the first parallel context. Workers of
+	 * a later context with more planned workers will get an error.
+	 */
+	if (ProcessSharedConnInfoPool == NULL)
+		ProcessSharedConnInfoPool = CreateConnectionPool(
+												Max(pcxt->nworkers, 1),
+												nodes_at_cluster, node_number);
+
+	size = MAXALIGN(CONN_POOL_SIZE(ProcessSharedConnInfoPool->size)) +
+		   MAXALIGN(sizeof(WorkerTraffic));
+
+	if (state->shared_broadcast)
+		size += sizeof(SharedBroadcast);
+	if (state->worker_route == WORKER_ROUTE_FORWARD)
+		size += (Size) ProcessSharedConnInfoPool->size *
+				ProcessSharedConnInfoPool->size * EXCHANGE_LOCAL_QUEUE_SIZE;
+	return size;
+}
+
+/*
+ * Local queues between each pair of workers. The leader does not send or
+ * receive tuples of the worker routed exchange, but checks that workers are
+ * launched.
+ */
+static void
+create_local_queues(ExchangeState *state, ParallelContext *pcxt,
+					void *coordinate)
+{
+	char	*queues = EXCHANGE_SHARED_AREA(coordinate);
+	int		nworkers = ((ConnInfoPool *) coordinate)->size;
+	int		sender;
+	int		receiver;
+
+	state->pcxt = pcxt;
+
+	if (state->worker_route != WORKER_ROUTE_FORWARD)
+		return;
+
+	for (sender = 0; sender < nworkers; sender++)
+	{
+		for (receiver = 0; receiver < nworkers; receiver++)
+		{
+			if (sender == receiver)
+				continue;
+
+			shm_mq_create(EXCHANGE_LOCAL_QUEUE(queues, nworkers, sender,
+											   receiver),
+						  EXCHANGE_LOCAL_QUEUE_SIZE);
+		}
+	}
+}
+
+/*
+ * Worker attaches to the queues to and from another workers of the node.
+ */
+static void
+attach_local_queues(ExchangeState *state, void *coordinate)
+{
+	char	*queues = EXCHANGE_SHARED_AREA(coordinate);
+	int		worker;
+
+	state->outq = palloc0(state->nworkers * sizeof(shm_mq_handle *));
+	state->inq = palloc0(state->nworkers * sizeof(shm_mq_handle *));
+	state->pending = palloc0(state->nworkers * sizeof(MinimalTuple));
+
+	for (worker = 0; worker < state->nworkers; worker++)
+	{
+		shm_mq	*mq;
+
+		if (worker == state->myslot)
+			continue;
+
+		mq = EXCHANGE_LOCAL_QUEUE(queues, state->nworkers, state->myslot,
+								  worker);
+		shm_mq_set_sender(mq, MyProc);
+		state->outq[worker] = shm_mq_attach(mq, NULL, NULL);
+
+		mq = EXCHANGE_LOCAL_QUEUE(queues, state->nworkers, worker,
+								  state->myslot);
+		shm_mq_set_receiver(mq, MyProc);
+		state->inq[worker] = shm_mq_attach(mq, NULL, NULL);
+	}
+}
+
+/*
+ * Slot of the connection pool, used by the worker. It is the key range of the
+ * worker.
+ */
+static int
+worker_slot(ExchangeState *state)
+{
+	int slot;
+
+	for (slot = 0; slot < state->connPool->size; slot++)
+	{
+		if (state->connPool->info[slot].port[state->mynode] ==
+											BackendConnInfo->port[state->mynode])
+			return slot;
+	}
+
+	elog(ERROR, "Slot of the worker is not found in the connection pool");
+	return -1;
 }
 
 static void
 EXCHANGE_InitializeDSM(CustomScanState *node, ParallelContext *pcxt,
 					   void *coordinate)
 {
+	ExchangeState	*state = (ExchangeState *) node;
+
 	/*
 	 * coordinate - pointer to shared memory segment.
 	 * node->pscan_len - size of the coordinate - is defined by
 	 * EstimateDSMCustomScan() function.
 	 */
-	if (ProcessSharedConnInfoPool.size < 0)
-		CreateConnectionPool(&ProcessSharedConnInfoPool, pcxt->nworkers,
-							 nodes_at_cluster, node_number);
+	Assert(ProcessSharedConnInfoPool != NULL);
+	memcpy(coordinate, ProcessSharedConnInfoPool,
+		   CONN_POOL_SIZE(ProcessSharedConnInfoPool->size));
+
+	state->traffic = EXCHANGE_WORKER_TRAFFIC(coordinate);
+	pg_atomic_init_u64(&state->traffic->tuples, 0);
+	pg_atomic_init_u64(&state->traffic->bytes, 0);
+
+	if (state->shared_broadcast && (node->ss.ps.state->es_query_dsa != NULL))
+	{
+		SharedBroadcast *shared = EXCHANGE_SHARED_BROADCAST(coordinate);
+
+		pg_atomic_init_u32(&shared->loaded, 0);
+		shared->head = InvalidDsaPointer;
+		load_shared_broadcast(state, shared);
+		state->shared = shared;
+	}
 
-	memcpy(coordinate, &ProcessSharedConnInfoPool, sizeof(ConnInfoPool));
+	if (state->worker_route != WORKER_ROUTE_NONE)
+		create_local_queues(state, pcxt, coordinate);
 }
 
 static void
@@ -567,15 +2158,32 @@ EXCHANGE_InitializeWorker(CustomScanState *node,
 	ExchangeState	*state = (ExchangeState *) node;
 
 	state->connPool = (ConnInfoPool *) coordinate;
+	state->traffic = EXCHANGE_WORKER_TRAFFIC(coordinate);
+	if (state->shared_broadcast)
+		state->shared = EXCHANGE_SHARED_BROADCAST(coordinate);
 	CoordNode = state->connPool->CoordinatorNode;
 	PargresInitialized = true;
 
 	Assert(!state->conn.rsock);
 	Assert(!state->conn.wsock);
 
+	state->started = GetCurrentTimestamp();
+	state->sent = false;
+
 	if (!BackendConnInfo)
 		BackendConnInfo = GetConnInfo(state->connPool);
 
 	CONN_Init_exchange(BackendConnInfo , &state->conn, state->mynode,
 																state->nnodes);
+	state->conn.compress = state->compress;
+
+	if (state->worker_route != WORKER_ROUTE_NONE)
+	{
+		state->nworkers = state->connPool->size;
+		state->myslot = worker_slot(state);
+		if (state->worker_route == WORKER_ROUTE_FORWARD)
+			attach_local_queues(state, coordinate);
+	}
+
+	TRACE_EXCHANGE(state, "setup", state->started);
 }
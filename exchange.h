@@ -15,9 +15,15 @@
 #ifndef EXCHANGE_H_
 #define EXCHANGE_H_
 
+#include "access/parallel.h"
 #include "commands/explain.h"
 #include "nodes/extensible.h"
 #include "optimizer/planner.h"
+#include "storage/shm_mq.h"
+#include "utils/dsa.h"
+#include "utils/tuplestore.h"
+
+#include "columnar.h"
 
 
 typedef enum
@@ -32,8 +38,87 @@ typedef struct
 {
 	int			attno;
 	fr_func_id	funcId;
+	int			colocation; /* colocation group; 0 - not a group routing */
 } fr_options_t;
 
+/*
+ * Routing by the FR_FUNC_HASH function. Frequently used types are hashed by
+ * the inlined copy of the extended hash function to avoid fmgr overhead per
+ * tuple. Result must be the same as of the opclass function.
+ */
+typedef enum
+{
+	HASH_KERNEL_FMGR = 0,
+	HASH_KERNEL_INT2,
+	HASH_KERNEL_INT4,
+	HASH_KERNEL_INT8,
+	HASH_KERNEL_UUID,
+	HASH_KERNEL_TEXT
+} hash_kernel_id;
+
+typedef struct
+{
+	hash_kernel_id	kernel;
+	FmgrInfo		hashfunction;
+	int				nbuckets;
+	int				*buckets; /* bucket -> node; NULL - hash % nnodes */
+} HashRouteData;
+
+/*
+ * Broadcast of a not partial subplan to parallel workers. Only the leader
+ * sends and receives the broadcast and stores all tuples into the list of
+ * DSA chunks. It loads the list, when it initializes the shared memory of the
+ * parallel plan, before the workers are launched. So the loading does not
+ * depend on the leader participation in the plan execution, and workers never
+ * wait for the leader. The inner side of a join is passed by network once per
+ * node.
+ */
+typedef struct
+{
+	pg_atomic_uint32	loaded;
+	dsa_pointer			head; /* first chunk */
+} SharedBroadcast;
+
+/*
+ * Key traffic of the parallel workers of a remote node. A worker has no
+ * service connection to the coordinator: it adds the traffic of the exchange
+ * here, and the leader reports it with its own traffic.
+ */
+typedef struct
+{
+	pg_atomic_uint64	tuples;
+	pg_atomic_uint64	bytes;
+} WorkerTraffic;
+
+/*
+ * Routing of the redistribution to the parallel workers of the node. The
+ * worker is computed by the hash of the distribution attribute, like the node.
+ * Each worker gets the tuples of its key range only, so the participants of a
+ * parallel oblivious join need not get the whole inner side. Workers are
+ * identified by the slots of the connection pool, so tuples sent over the
+ * network come to the worker of the key range. The leader does not own a key
+ * range: its streams are closed without data.
+ */
+typedef enum
+{
+	WORKER_ROUTE_NONE = 0,	/* tuple is returned by any participant of the node */
+	WORKER_ROUTE_FILTER,	/* each worker gets whole subplan and keeps its tuples */
+	WORKER_ROUTE_FORWARD	/* tuples are forwarded to the worker through shm_mq */
+} worker_route_mode;
+
+/* Local queue from one worker of the node to another */
+#define EXCHANGE_LOCAL_QUEUE_SIZE	(65536)
+
+typedef struct
+{
+	dsa_pointer	next;
+	Size		size;
+	Size		used;
+	char		data[FLEXIBLE_ARRAY_MEMBER]; /* MAXALIGNed minimal tuples */
+} BroadcastChunk;
+
+#define BROADCAST_CHUNK_SIZE	(65536)
+
 typedef struct
 {
 	CustomScanState	css;
@@ -50,6 +135,37 @@ typedef struct
 	int				NetworkStorageTuple;
 	int				number;
 	void			*data;
+	bool			compress;
+	bool			project; /* only attributes of the projection are sent */
+	Bitmapset		*projection; /* attributes are sent; may be empty */
+	Datum			*values;
+	bool			*isnull;
+	bool			columnar;
+	ColumnarBatch	**batches; /* per destination; broadcast uses mynode */
+	StringInfoData	block;
+	ColumnarReader	reader;
+	bool			shared_broadcast; /* subplan is not partial */
+	SharedBroadcast	*shared; /* NULL if the plan is not parallel */
+	dsa_pointer		chunk; /* current chunk to read or write */
+	Size			offset;
+	bool			rescannable;
+	Tuplestorestate	*cache; /* output of the first pass for rescans */
+	bool			eof_underlying;
+	Oid				relid; /* relation scanned under the exchange or 0 */
+	AttrNumber		keyattno; /* column of the relid, which forced the exchange */
+	TimestampTz		started; /* for tracing */
+	bool			sent; /* any tuple was sent */
+	worker_route_mode	worker_route;
+	ParallelContext	*pcxt; /* leader of the worker routed exchange */
+	int				nworkers; /* workers, owning the key ranges */
+	int				myslot; /* key range of the worker */
+	shm_mq_handle	**outq; /* to another workers; NULL - detached */
+	shm_mq_handle	**inq; /* from another workers; NULL - detached */
+	MinimalTuple	*pending; /* tuples, not placed into outq yet */
+	bool			closed; /* network streams are closed */
+	WorkerTraffic	*traffic; /* NULL if the plan is not parallel */
+	uint64			worker_tuples; /* key traffic, taken by the leader */
+	uint64			worker_bytes;
 } ExchangeState;
 
 extern void EXCHANGE_Init_methods(void);
@@ -57,6 +173,16 @@ extern Plan *make_exchange(Plan *subplan, fr_options_t frOpts,
 							bool drop_duplicates,
 							bool broadcast_mode,
 							int mynode, int nnodes);
+extern bool is_exchange_plan(Plan *plan);
+extern Oid exchange_source_relation(Plan *plan, List *rtable);
+extern AttrNumber exchange_source_attribute(Plan *plan, AttrNumber attno);
+extern Bitmapset *exchange_set_projection(Plan *plan, Bitmapset *attrs);
+extern void exchange_set_rescannable(Plan *plan);
+extern void exchange_set_key(Plan *plan, AttrNumber attno);
+extern void exchange_set_worker_routing(Plan *plan);
+extern bool is_partial_plan(Plan *plan);
+extern HashRouteData *make_hash_route(Oid atttypid);
+extern void set_hash_route_buckets(HashRouteData *route, List *buckets);
 extern int get_tuple_node(fr_func_id fid, Datum value, int mynode, int nnodes,
 						  void *data);
 
@@ -10,18 +10,33 @@
 
 #include "postgres.h"
 
+#include "commands/explain.h"
+#include "portability/instr_time.h"
+#include "tcop/tcopprot.h"
+
 #include "common.h"
 #include "connection.h"
 #include "exchange.h"
 #include "hooks_exec.h"
+#include "trace.h"
 
 
 static ExecutorStart_hook_type	prev_ExecutorStart = NULL;
 static ExecutorEnd_hook_type	prev_ExecutorEnd = NULL;
+static ExplainOneQuery_hook_type	prev_ExplainOneQuery = NULL;
+
+/* EXPLAIN of the statement, which is executed now; NULL - not an EXPLAIN */
+static ExplainState	*explain_state = NULL;
 
 
 static void HOOK_ExecStart_injection(QueryDesc *queryDesc, int eflags);
 static void HOOK_ExecEnd_injection(QueryDesc *queryDesc);
+static void HOOK_ExplainOneQuery_injection(Query *query, int cursorOptions,
+										   IntoClause *into, ExplainState *es,
+										   const char *queryString,
+										   ParamListInfo params,
+										   QueryEnvironment *queryEnv);
+static void explain_remote_plans(ExplainState *es);
 
 
 void
@@ -32,28 +47,48 @@ EXEC_Hooks_init(void)
 
 	prev_ExecutorEnd = ExecutorEnd_hook;
 	ExecutorEnd_hook = HOOK_ExecEnd_injection;
+
+	prev_ExplainOneQuery = ExplainOneQuery_hook;
+	ExplainOneQuery_hook = HOOK_ExplainOneQuery_injection;
 }
 
 static void
 HOOK_ExecStart_injection(QueryDesc *queryDesc, int eflags)
 {
+	/*
+	 * Launch a statement, which was not launched at the parsing stage. Remote
+	 * instances must execute it before initialization of our EXCHANGE nodes.
+	 */
+	if (PargresInitialized && (CoordNode == node_number))
+		CONN_Launch_prepared(queryDesc->sourceText, queryDesc->params,
+							 queryDesc->plannedstmt->queryId);
+	else if (PargresInitialized && (queryDesc->params != NULL))
+		/* Id of the prepared statement execution is passed by a parameter */
+		TRACE_Accept_query(queryDesc->sourceText, queryDesc->params);
+
+	TRACE_Executor_start(queryDesc);
+
 	if (prev_ExecutorStart)
 		prev_ExecutorStart(queryDesc, eflags);
 	else
 		standard_ExecutorStart(queryDesc, eflags);
 
-	ProcessSharedConnInfoPool.size = -1;
+	ProcessSharedConnInfoPool = NULL;
 }
 
 static void
 HOOK_ExecEnd_injection(QueryDesc *queryDesc)
 {
+	uint64	rows = queryDesc->estate->es_processed;
+
 	/* Execute before hook because it destruct memory context of exchange list */
 	if (PargresInitialized)
 	{
 		OnExecutionEnd();
 
-		if (CoordNode == node_number)
+		if ((CoordNode == node_number) && (explain_state != NULL))
+			explain_remote_plans(explain_state);
+		else if (CoordNode == node_number)
 			CONN_Check_query_result();
 	}
 
@@ -61,4 +96,83 @@ HOOK_ExecEnd_injection(QueryDesc *queryDesc)
 		prev_ExecutorEnd(queryDesc);
 	else
 		standard_ExecutorEnd(queryDesc);
+
+	/* Exchanges are closed, report the execution */
+	TRACE_Executor_end(queryDesc, rows);
+}
+
+/*
+ * Remember the EXPLAIN state for the executor hooks. The plan is built and
+ * explained like without the hook.
+ */
+static void
+HOOK_ExplainOneQuery_injection(Query *query, int cursorOptions,
+							   IntoClause *into, ExplainState *es,
+							   const char *queryString, ParamListInfo params,
+							   QueryEnvironment *queryEnv)
+{
+	ExplainState	*prev_state = explain_state;
+
+	explain_state = es;
+
+	PG_TRY();
+	{
+		if (prev_ExplainOneQuery)
+			prev_ExplainOneQuery(query, cursorOptions, into, es, queryString,
+								 params, queryEnv);
+		else
+		{
+			PlannedStmt	*plan;
+			instr_time	planstart;
+			instr_time	planduration;
+
+			INSTR_TIME_SET_CURRENT(planstart);
+			plan = pg_plan_query(query, cursorOptions, params);
+			INSTR_TIME_SET_CURRENT(planduration);
+			INSTR_TIME_SUBTRACT(planduration, planstart);
+
+			ExplainOnePlan(plan, into, es, queryString, params, queryEnv,
+						   &planduration);
+		}
+	}
+	PG_CATCH();
+	{
+		explain_state = prev_state;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	explain_state = prev_state;
+}
+
+/*
+ * Wait for the remote instances and show their plans. ExplainOnePlan() calls
+ * the ExecutorEnd after the plan is printed, so the plans are placed next to
+ * the coordinator plan, once per statement.
+ */
+static void
+explain_remote_plans(ExplainState *es)
+{
+	StringInfoData	*texts;
+	int				node;
+
+	texts = palloc(sizeof(StringInfoData) * nodes_at_cluster);
+	for (node = 0; node < nodes_at_cluster; node++)
+		initStringInfo(&texts[node]);
+
+	if (!CONN_Get_query_result(texts))
+		return;
+
+	ExplainOpenGroup("Remote Plans", "Remote Plans", true, es);
+	for (node = 0; node < nodes_at_cluster; node++)
+	{
+		char	label[NAMEDATALEN];
+
+		if (texts[node].len == 0)
+			continue;
+
+		snprintf(label, NAMEDATALEN, "Node %d Plan", node);
+		ExplainPropertyText(label, texts[node].data, es);
+	}
+	ExplainCloseGroup("Remote Plans", "Remote Plans", true, es);
 }
@@ -3,7 +3,26 @@
 CREATE TABLE IF NOT EXISTS @extschema@.relsfrag (
 	relname		VARCHAR NOT NULL,
 	attno		INT,
-	fr_func_id	INT
+	fr_func_id	INT,
+	colocation	INT
+);
+
+-- Relations of the colocation group are distributed by the same method, type
+-- of the column and map of hash buckets to nodes.
+CREATE TABLE IF NOT EXISTS @extschema@.colocation_groups (
+	colocation		INT NOT NULL,
+	fr_func_id		INT,
+	atttype			VARCHAR,
+	bucket_count	INT,
+	buckets			INT[]
+);
+
+-- Sizes of the relation fragments at all nodes. Filled by ANALYZE.
+CREATE TABLE IF NOT EXISTS @extschema@.relstats (
+	relname		VARCHAR NOT NULL,
+	node		INT,
+	reltuples	FLOAT4,
+	relpages	INT
 );
 
 --
@@ -16,9 +35,183 @@ RETURNS VOID
 AS 'MODULE_PATHNAME', 'set_query_id'
 LANGUAGE C STRICT;
 
+--
+-- Distribution of the empty relation. It can be declared by CREATE TABLE too:
+--	WITH (pargres.distribute_by = 'hash(column)', pargres.colocate_with = 'rel')
+-- colocate_with = 'none' creates a new colocation group.
+--
+CREATE OR REPLACE FUNCTION @extschema@.create_distributed_table(
+					relname			TEXT,
+					column_name		TEXT,
+					method			TEXT DEFAULT 'hash',
+					colocate_with	TEXT DEFAULT NULL)
+RETURNS VOID
+AS 'MODULE_PATHNAME', 'create_distributed_table'
+LANGUAGE C;
+
 CREATE OR REPLACE FUNCTION @extschema@.isLocalValue(
 					relname	TEXT,
 					value	INT)
 RETURNS BOOL
 AS 'MODULE_PATHNAME', 'isLocalValue'
 LANGUAGE C STRICT;
+
+--
+-- Cluster-wide statistics of distributed relations
+--
+CREATE OR REPLACE FUNCTION @extschema@.pargres_local_relstats(
+					OUT relname		TEXT,
+					OUT node		INT,
+					OUT reltuples	FLOAT4,
+					OUT relpages	INT)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME', 'pargres_local_relstats'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION @extschema@.pargres_set_relstats(
+					relname		TEXT,
+					reltuples	FLOAT4[],
+					relpages	INT[])
+RETURNS VOID
+AS 'MODULE_PATHNAME', 'pargres_set_relstats'
+LANGUAGE C STRICT;
+
+--
+-- Cumulative statistics
+--
+CREATE OR REPLACE FUNCTION @extschema@.pargres_stat_global(
+					OUT exchanges_opened	BIGINT,
+					OUT cluster_setups		BIGINT,
+					OUT recv_waits			BIGINT,
+					OUT send_waits			BIGINT,
+					OUT queries_dispatched	BIGINT,
+					OUT ports_in_use		INT,
+					OUT ports_total			INT,
+					OUT stats_reset			TIMESTAMPTZ)
+RETURNS RECORD
+AS 'MODULE_PATHNAME', 'pargres_stat_global'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION @extschema@.pargres_stat_peers(
+					OUT node			INT,
+					OUT tuples_sent		BIGINT,
+					OUT bytes_sent		BIGINT,
+					OUT tuples_received	BIGINT,
+					OUT bytes_received	BIGINT)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME', 'pargres_stat_peers'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION @extschema@.pargres_stat_dispatch(
+					OUT le_ms	FLOAT8,
+					OUT count	BIGINT)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME', 'pargres_stat_dispatch'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION @extschema@.pargres_stat_relations(
+					OUT relid					OID,
+					OUT redistributions			BIGINT,
+					OUT redistributed_tuples	BIGINT,
+					OUT redistributed_bytes		BIGINT,
+					OUT broadcasts				BIGINT,
+					OUT broadcasted_tuples		BIGINT,
+					OUT broadcasted_bytes		BIGINT)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME', 'pargres_stat_relations'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION @extschema@.pargres_stat_reset()
+RETURNS VOID
+AS 'MODULE_PATHNAME', 'pargres_stat_reset'
+LANGUAGE C STRICT;
+
+CREATE VIEW @extschema@.pg_stat_pargres AS
+	SELECT * FROM @extschema@.pargres_stat_global();
+
+CREATE VIEW @extschema@.pg_stat_pargres_peers AS
+	SELECT * FROM @extschema@.pargres_stat_peers();
+
+CREATE VIEW @extschema@.pg_stat_pargres_dispatch AS
+	SELECT * FROM @extschema@.pargres_stat_dispatch();
+
+CREATE VIEW @extschema@.pg_stat_pargres_relations AS
+	SELECT relid::regclass AS relname, s.*
+	FROM @extschema@.pargres_stat_relations() AS s;
+
+--
+-- Exchange traffic by the join and grouping columns and the advisor of
+-- distribution keys.
+--
+CREATE OR REPLACE FUNCTION @extschema@.pargres_stat_keys(
+					OUT node					INT,
+					OUT relname					TEXT,
+					OUT attname					TEXT,
+					OUT redistributions			BIGINT,
+					OUT redistributed_tuples	BIGINT,
+					OUT redistributed_bytes		BIGINT,
+					OUT broadcasts				BIGINT,
+					OUT broadcasted_tuples		BIGINT,
+					OUT broadcasted_bytes		BIGINT)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME', 'pargres_stat_keys'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION @extschema@.pargres_advise_distribution(
+					OUT relid				OID,
+					OUT current_key			TEXT,
+					OUT recommended_key		TEXT,
+					OUT replicate			BOOL,
+					OUT traffic_bytes		BIGINT,
+					OUT avoidable_bytes		BIGINT,
+					OUT broadcasted_bytes	BIGINT,
+					OUT relation_bytes		BIGINT)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME', 'pargres_advise_distribution'
+LANGUAGE C STRICT;
+
+CREATE VIEW @extschema@.pg_stat_pargres_keys AS
+	SELECT * FROM @extschema@.pargres_stat_keys();
+
+CREATE VIEW @extschema@.pargres_distribution_advice AS
+	SELECT relid::regclass AS relname, a.*
+	FROM @extschema@.pargres_advise_distribution() AS a;
+
+--
+-- Executions of distributed statements at all nodes. Kept by the coordinator.
+--
+CREATE OR REPLACE FUNCTION @extschema@.pargres_stat_executions(
+					OUT distributed_id		TEXT,
+					OUT queryid				BIGINT,
+					OUT node				INT,
+					OUT total_time			FLOAT8,
+					OUT rows				BIGINT,
+					OUT shared_blks_hit		BIGINT,
+					OUT shared_blks_read	BIGINT,
+					OUT shared_blks_dirtied	BIGINT,
+					OUT shared_blks_written	BIGINT,
+					OUT temp_blks_read		BIGINT,
+					OUT temp_blks_written	BIGINT)
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME', 'pargres_stat_executions'
+LANGUAGE C STRICT;
+
+CREATE VIEW @extschema@.pg_stat_pargres_executions AS
+	SELECT * FROM @extschema@.pargres_stat_executions();
+
+CREATE VIEW @extschema@.pg_stat_pargres_statements AS
+	SELECT	distributed_id,
+			max(queryid) AS queryid,
+			count(*) AS nodes,
+			max(total_time) AS max_time,
+			sum(total_time) AS total_time,
+			(array_agg(node ORDER BY total_time DESC))[1] AS slowest_node,
+			sum(rows) AS rows,
+			sum(shared_blks_hit) AS shared_blks_hit,
+			sum(shared_blks_read) AS shared_blks_read,
+			sum(shared_blks_dirtied) AS shared_blks_dirtied,
+			sum(shared_blks_written) AS shared_blks_written,
+			sum(temp_blks_read) AS temp_blks_read,
+			sum(temp_blks_written) AS temp_blks_written
+	FROM @extschema@.pargres_stat_executions()
+	GROUP BY distributed_id;
@@ -13,7 +13,9 @@
 
 #include "access/hash.h"
 #include "access/htup_details.h"
+#include "access/sysattr.h"
 #include "access/xact.h"
+#include "catalog/namespace.h"
 #include "catalog/pg_am.h"
 #include "catalog/pg_opclass.h"
 #include "catalog/pg_type.h"
@@ -23,13 +25,19 @@
 #include "miscadmin.h"
 #include "nodes/makefuncs.h"
 #include "optimizer/planner.h"
+#include "optimizer/var.h"
 #include "parser/analyze.h"
 #include "parser/parsetree.h"
+#include "parser/scansup.h"
 #include "storage/ipc.h"
 #include "storage/lmgr.h"
+#include "storage/shmem.h"
 #include "tcop/utility.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/syscache.h"
 #include "utils/snapmgr.h"
 
@@ -40,11 +48,15 @@
 #include "exchange.h"
 #include "hooks_exec.h"
 #include "pargres.h"
+#include "relstats.h"
+#include "stats.h"
+#include "trace.h"
 
 PG_MODULE_MAGIC;
 
 PG_FUNCTION_INFO_V1(set_query_id);
 PG_FUNCTION_INFO_V1(isLocalValue);
+PG_FUNCTION_INFO_V1(create_distributed_table);
 
 /*
  * Declarations
@@ -65,8 +77,27 @@ typedef struct
 int			nfrRelations = 0;
 FragRels	frRelations[1000];
 
-/* Name of relation with fragmentation options */
-#define RELATIONS_FRAG_CONFIG		"relsfrag"
+/*
+ * Relations of the colocation group share the distribution method, type of
+ * the distribution column and the map of hash buckets to nodes. So joins of
+ * them by the distribution columns are local.
+ */
+typedef struct
+{
+	int			colocation;
+	fr_func_id	funcId;
+	char		atttype[2 * NAMEDATALEN];
+	int			nbuckets;
+	int			*buckets; /* bucket -> node */
+} ColocationGroup;
+
+/* Number of hash buckets of a new colocation group per node */
+#define COLOCATION_BUCKETS_PER_NODE	(8)
+
+static int				nColocationGroups = 0;
+static int				maxColocation = 0; /* including numbers without a group */
+static ColocationGroup	colocationGroups[1000];
+static MemoryContext	ColocationContext = NULL;
 
 static ProcessUtility_hook_type 	next_ProcessUtility_hook = NULL;
 static post_parse_analyze_hook_type prev_post_parse_analyze_hook = NULL;
@@ -92,8 +123,20 @@ static fr_options_t changeJoinPlan(Plan *plan, PlannedStmt *stmt,
 static void changeModifyTablePlan(Plan *plan, PlannedStmt *stmt,
 								  fr_options_t innerFrOpts,
 								  fr_options_t outerFrOpts);
-static void create_table_frag(const char *relname, int attno, fr_func_id fid);
+static List *extract_distribution_options(PlannedStmt **pstmt);
+static void distribute_table(RangeVar *relation, List *options);
+static void set_distribution(Oid relid, const char *column, const char *method,
+							 const char *colocate_with);
+static fr_func_id get_distribution_method(const char *method);
+static void create_table_frag(const char *relname, int attno, fr_func_id fid,
+							  const char *atttype, const char *colocate_with);
+static void create_colocation_group(int colocation, fr_func_id fid,
+									const char *atttype);
+static ColocationGroup *get_colocation_group(int colocation);
+static int default_colocation(const FragRels *frRel);
+static char *frag_atttype(const FragRels *frRel);
 static void load_description_frag(void);
+static void load_colocation_groups(void);
 static fr_options_t getRelFrag(const char *relname);
 
 #define NODES_MAX_NUM		(1024)
@@ -101,7 +144,7 @@ static fr_options_t getRelFrag(const char *relname);
 static Size
 PortStackShmemSize(void)
 {
-	return sizeof(offsetof(PortStack, values) + sizeof(int) * eports_pool_size);
+	return offsetof(PortStack, values) + sizeof(int) * eports_pool_size;
 }
 
 /*
@@ -129,6 +172,8 @@ HOOK_Shmem_injection(void)
 	}
 	else
 		Assert(found);
+
+	STATS_Shmem_init();
 }
 
 static void
@@ -152,6 +197,10 @@ SHMEM_Hooks_init(void)
 {
 	prev_shmem_startup_hook = shmem_startup_hook;
 	shmem_startup_hook = HOOK_Shmem_injection;
+
+	if (process_shared_preload_libraries_in_progress)
+		RequestAddinShmemSpace(add_size(PortStackShmemSize(),
+										STATS_Shmem_size()));
 }
 
 static fr_options_t
@@ -202,6 +251,55 @@ getRelFrag(const char *relname)
 	return result;
 }
 
+/*
+ * Distribution rule of the relation by its name.
+ */
+fr_options_t
+PLAN_Get_fragmentation(const char *relname)
+{
+	load_description_frag();
+	return getRelFrag(relname);
+}
+
+/*
+ * Map of hash buckets to nodes of the colocation group, as a list of nodes.
+ * NIL - the tuples are routed by the hash modulo the number of nodes.
+ */
+List *
+PLAN_Get_bucket_map(int colocation)
+{
+	ColocationGroup	*group = get_colocation_group(colocation);
+	List			*buckets = NIL;
+	int				i;
+
+	if ((group == NULL) || (group->funcId != FR_FUNC_HASH))
+		return NIL;
+
+	for (i = 0; i < group->nbuckets; i++)
+	{
+		/* The map was made for another cluster */
+		if ((group->buckets[i] < 0) || (group->buckets[i] >= nodes_at_cluster))
+			elog(ERROR, "Bucket %d of colocation group %d is mapped to unknown node %d",
+				 i, colocation, group->buckets[i]);
+
+		buckets = lappend(buckets, makeInteger(group->buckets[i]));
+	}
+
+	return buckets;
+}
+
+static ColocationGroup *
+get_colocation_group(int colocation)
+{
+	int i;
+
+	for (i = 0; i < nColocationGroups; i++)
+		if (colocationGroups[i].colocation == colocation)
+			return &colocationGroups[i];
+
+	return NULL;
+}
+
 static bool
 isNullFragmentation(fr_options_t *frOpts)
 {
@@ -218,9 +316,44 @@ isEqualFragmentation(const fr_options_t *frOpts1, const fr_options_t *frOpts2)
 		return false;
 	if (frOpts1->funcId != frOpts2->funcId)
 		return false;
+	if (frOpts1->colocation != frOpts2->colocation)
+		return false;
 	return true;
 }
 
+/*
+ * Tuples with equal values of the distribution attributes are placed at the
+ * same node.
+ */
+static bool
+isColocated(const fr_options_t *frOpts1, const fr_options_t *frOpts2)
+{
+	return (frOpts1->funcId == frOpts2->funcId) &&
+		   (frOpts1->colocation == frOpts2->colocation);
+}
+
+/*
+ * Position of the relation column in the output of the scan. The column
+ * order of the output can differ from the relation. Returns -1, if the column
+ * is not in the output: tuples of the scan are not placed by any of its
+ * columns.
+ */
+static int
+scan_output_attno(Plan *scan, int attno)
+{
+	ListCell *lc;
+
+	foreach(lc, scan->targetlist)
+	{
+		TargetEntry *tle = (TargetEntry *) lfirst(lc);
+
+		if (IsA(tle->expr, Var) && (((Var *) tle->expr)->varattno == attno))
+			return tle->resno;
+	}
+
+	return -1;
+}
+
 static int inner_join_attr;
 static int outer_join_attr;
 
@@ -367,6 +500,8 @@ traverse_tree(Plan *root, PlannedStmt *stmt)
 	case T_SeqScan:
 		relid = (rt_fetch(((SeqScan *)root)->scanrelid, stmt->rtable)->relid);
 		FrOpts = get_fragmentation(relid);
+		if (FrOpts.attno > 0)
+			FrOpts.attno = scan_output_attno(root, FrOpts.attno);
 		return FrOpts;
 
 	case T_Agg:
@@ -447,14 +582,18 @@ get_new_frfn(List *targetlist, fr_options_t *innerFrOpts,
 	Assert(targetlist != NULL);
 	Assert((outerFrOpts != NULL) || (innerFrOpts != NULL));
 
-	/* Get new position of fragmentation attribute */
-	if (innerFrOpts != NULL)
+	/*
+	 * Get new position of fragmentation attribute. A side whose tuples are
+	 * not placed by any of its output columns (attno <= 0) has nothing to
+	 * locate.
+	 */
+	if ((innerFrOpts != NULL) && (innerFrOpts->attno > 0))
 		new_attnum = attnum_after_join(targetlist, innerFrOpts->attno, true);
 
-	if ((new_attnum <= 0) && (outerFrOpts != NULL))
+	if ((new_attnum <= 0) && (outerFrOpts != NULL) && (outerFrOpts->attno > 0))
 		new_attnum = attnum_after_join(targetlist, outerFrOpts->attno, false);
 
-	if (new_attnum < 0)
+	if (new_attnum <= 0)
 		return NO_FRAGMENTATION;
 
 	Assert(new_attnum > 0);
@@ -465,6 +604,163 @@ get_new_frfn(List *targetlist, fr_options_t *innerFrOpts,
 	return *outerFrOpts;
 }
 
+static void
+add_col_idx(Bitmapset **attrs, AttrNumber *colIdx, int numCols)
+{
+	int i;
+
+	for (i = 0; i < numCols; i++)
+		*attrs = bms_add_member(*attrs, colIdx[i]);
+}
+
+/*
+ * Collect attributes of the child output (varno is OUTER_VAR or INNER_VAR),
+ * used by the plan node, if its output attributes 'used' are used by the
+ * ancestors.
+ * Returns false if it can't be determined. It means that all attributes of
+ * the child are used.
+ */
+static bool
+used_child_attrs(Plan *plan, Bitmapset *used, bool all_used, Index varno,
+				 Bitmapset **attrs)
+{
+	Bitmapset	*varattnos = NULL;
+	ListCell	*lc;
+	int			attno;
+
+	switch (nodeTag(plan))
+	{
+	case T_HashJoin:
+		pull_varattnos((Node *) ((HashJoin *) plan)->hashclauses, varno,
+					   &varattnos);
+		pull_varattnos((Node *) ((Join *) plan)->joinqual, varno, &varattnos);
+		break;
+	case T_MergeJoin:
+		pull_varattnos((Node *) ((MergeJoin *) plan)->mergeclauses, varno,
+					   &varattnos);
+		pull_varattnos((Node *) ((Join *) plan)->joinqual, varno, &varattnos);
+		break;
+	case T_NestLoop:
+		pull_varattnos((Node *) ((Join *) plan)->joinqual, varno, &varattnos);
+		foreach(lc, ((NestLoop *) plan)->nestParams)
+		{
+			NestLoopParam *nlp = (NestLoopParam *) lfirst(lc);
+
+			pull_varattnos((Node *) nlp->paramval, varno, &varattnos);
+		}
+		break;
+	case T_Agg:
+		if (((Agg *) plan)->groupingSets != NIL)
+			return false;
+		add_col_idx(attrs, ((Agg *) plan)->grpColIdx, ((Agg *) plan)->numCols);
+		break;
+	case T_Group:
+		add_col_idx(attrs, ((Group *) plan)->grpColIdx,
+					((Group *) plan)->numCols);
+		break;
+	case T_Sort:
+		add_col_idx(attrs, ((Sort *) plan)->sortColIdx,
+					((Sort *) plan)->numCols);
+		break;
+	case T_Unique:
+		add_col_idx(attrs, ((Unique *) plan)->uniqColIdx,
+					((Unique *) plan)->numCols);
+		break;
+	case T_Hash:
+	case T_Material:
+	case T_Gather:
+	case T_Limit:
+	case T_Result:
+		break;
+	default:
+		/* Unknown node. Suppose it uses all attributes. */
+		return false;
+	}
+
+	pull_varattnos((Node *) plan->qual, varno, &varattnos);
+
+	foreach(lc, plan->targetlist)
+	{
+		TargetEntry *tle = (TargetEntry *) lfirst(lc);
+
+		if (all_used || bms_is_member(tle->resno, used))
+			pull_varattnos((Node *) tle->expr, varno, &varattnos);
+	}
+
+	/* Whole-row reference needs all attributes */
+	if (bms_is_member(0 - FirstLowInvalidHeapAttributeNumber, varattnos))
+		return false;
+
+	attno = -1;
+	while ((attno = bms_next_member(varattnos, attno)) >= 0)
+	{
+		if (attno + FirstLowInvalidHeapAttributeNumber > 0)
+			*attrs = bms_add_member(*attrs,
+									attno + FirstLowInvalidHeapAttributeNumber);
+	}
+
+	return true;
+}
+
+/*
+ * Traverse the tree with EXCHANGE nodes top-down and restrict the attributes
+ * sent by each EXCHANGE to the attributes, used by its ancestors.
+ */
+static void
+set_exchange_projections(Plan *plan, Bitmapset *used, bool all_used)
+{
+	Bitmapset	*attrs;
+
+	check_stack_depth();
+
+	if (is_exchange_plan(plan))
+	{
+		if (!all_used)
+			used = exchange_set_projection(plan, used);
+
+		/* Exchange passes attributes of its child through */
+		set_exchange_projections(outerPlan(plan), used, all_used);
+		return;
+	}
+
+	if (outerPlan(plan))
+	{
+		attrs = NULL;
+		if (used_child_attrs(plan, used, all_used, OUTER_VAR, &attrs))
+			set_exchange_projections(outerPlan(plan), attrs, false);
+		else
+			set_exchange_projections(outerPlan(plan), NULL, true);
+	}
+
+	if (innerPlan(plan))
+	{
+		attrs = NULL;
+		if (used_child_attrs(plan, used, all_used, INNER_VAR, &attrs))
+			set_exchange_projections(innerPlan(plan), attrs, false);
+		else
+			set_exchange_projections(innerPlan(plan), NULL, true);
+	}
+}
+
+/*
+ * Inner side of a nested loop is rescanned for each outer tuple. EXCHANGE
+ * nodes there cache their output to replay it without network.
+ */
+static void
+set_exchange_rescans(Plan *plan, bool rescan)
+{
+	if (plan == NULL)
+		return;
+
+	check_stack_depth();
+
+	if (rescan && is_exchange_plan(plan))
+		exchange_set_rescannable(plan);
+
+	set_exchange_rescans(outerPlan(plan), rescan);
+	set_exchange_rescans(innerPlan(plan), rescan || IsA(plan, NestLoop));
+}
+
 static void
 changeAggPlan(Plan *plan, PlannedStmt *stmt, fr_options_t outerFrOpts)
 {
@@ -480,9 +776,40 @@ changeAggPlan(Plan *plan, PlannedStmt *stmt, fr_options_t outerFrOpts)
 		Assert(plan->righttree == NULL);
 		plan->lefttree = make_exchange(plan->lefttree, outerFrOpts, false, true,
 									   node_number, nodes_at_cluster);
+
+		/* Grouping by the distribution key would not need the broadcast */
+		if (agg->numCols == 1)
+			exchange_set_key(plan->lefttree, agg->grpColIdx[0]);
 	}
 }
 
+/*
+ * Traffic of the exchange is estimated by sizes of the relations over the
+ * cluster (see relstats.c). Broadcasting sends each tuple to (n-1) nodes.
+ * Redistribution sends (n-1)/n of tuples of each redistributed subplan.
+ */
+static double
+exchange_traffic(Plan *plan, List *rtable)
+{
+	if (plan == NULL)
+		return 0.;
+
+	return RELSTATS_Global_rows(plan, rtable) * plan->plan_width;
+}
+
+static bool
+broadcast_is_cheaper(Plan *broadcast, Plan *redistribute1,
+					 Plan *redistribute2, List *rtable)
+{
+	double	broadcast_cost = exchange_traffic(broadcast, rtable) *
+														(nodes_at_cluster - 1);
+	double	redistribute_cost = (exchange_traffic(redistribute1, rtable) +
+								 exchange_traffic(redistribute2, rtable)) *
+								(nodes_at_cluster - 1) / nodes_at_cluster;
+
+	return (broadcast_cost < redistribute_cost);
+}
+
 static fr_options_t
 changeJoinPlan(Plan *plan, PlannedStmt *stmt, fr_options_t innerFrOpts,
 			   fr_options_t outerFrOpts)
@@ -514,14 +841,52 @@ changeJoinPlan(Plan *plan, PlannedStmt *stmt, fr_options_t innerFrOpts,
 
 	if (outerFrOpts.attno != outer_join_attr)
 	{
-		if (innerFrOpts.attno == inner_join_attr)
+		if ((innerFrOpts.attno == inner_join_attr) &&
+			!broadcast_is_cheaper(*InnerPlan, outerPlan(plan), NULL,
+								  stmt->rtable))
 		{
 			/* Need to redistribute outer relation */
 			outerFrOpts.attno = outer_join_attr;
 			outerFrOpts.funcId = innerFrOpts.funcId;
+			outerFrOpts.colocation = innerFrOpts.colocation;
+			outerPlan(plan) = make_exchange(outerPlan(plan), outerFrOpts, false,
+											false, node_number,
+											nodes_at_cluster);
+
+			return get_new_frfn(plan->targetlist, &innerFrOpts, &outerFrOpts);
+		}
+		else if ((innerFrOpts.attno != inner_join_attr) &&
+				 (inner_join_attr > 0) && (outer_join_attr > 0) &&
+				 !broadcast_is_cheaper(*InnerPlan, outerPlan(plan), *InnerPlan,
+									   stmt->rtable))
+		{
+			/*
+			 * Participants of a parallel oblivious join get whole inner side.
+			 * If both sides are redistributed, each worker can own a key
+			 * range instead, and get only its part of the inner side.
+			 */
+			bool	route_workers = !plan->parallel_aware &&
+									is_partial_plan(outerPlan(plan)) &&
+									!is_partial_plan(*InnerPlan);
+
+			/* Redistribute both relations by the join attributes */
+			outerFrOpts.attno = outer_join_attr;
+			outerFrOpts.funcId = FR_FUNC_HASH;
+			outerFrOpts.colocation = 0;
+			innerFrOpts.attno = inner_join_attr;
+			innerFrOpts.funcId = FR_FUNC_HASH;
+			innerFrOpts.colocation = 0;
 			outerPlan(plan) = make_exchange(outerPlan(plan), outerFrOpts, false,
 											false, node_number,
 											nodes_at_cluster);
+			*InnerPlan = make_exchange(*InnerPlan, innerFrOpts, false,
+									   false, node_number, nodes_at_cluster);
+
+			if (route_workers)
+			{
+				exchange_set_worker_routing(outerPlan(plan));
+				exchange_set_worker_routing(*InnerPlan);
+			}
 
 			return get_new_frfn(plan->targetlist, &innerFrOpts, &outerFrOpts);
 		}
@@ -529,6 +894,7 @@ changeJoinPlan(Plan *plan, PlannedStmt *stmt, fr_options_t innerFrOpts,
 		{
 			*InnerPlan = make_exchange(*InnerPlan, outerFrOpts, false,
 									   true, node_number, nodes_at_cluster);
+			exchange_set_key(*InnerPlan, inner_join_attr);
 
 			/* Inner relation broadcasting drops its distribution rule */
 			return get_new_frfn(plan->targetlist, NULL, &outerFrOpts);
@@ -539,7 +905,7 @@ changeJoinPlan(Plan *plan, PlannedStmt *stmt, fr_options_t innerFrOpts,
 		/* Outer relation distributed by join attribute */
 		if (innerFrOpts.attno == inner_join_attr)
 		{
-			if (outerFrOpts.funcId == innerFrOpts.funcId)
+			if (isColocated(&outerFrOpts, &innerFrOpts))
 				/*
 				 * Inner and outer relations distributed by its fragmentation
 				 * attributes.
@@ -548,6 +914,7 @@ changeJoinPlan(Plan *plan, PlannedStmt *stmt, fr_options_t innerFrOpts,
 									&outerFrOpts);
 
 			innerFrOpts.funcId = outerFrOpts.funcId;
+			innerFrOpts.colocation = outerFrOpts.colocation;
 			*InnerPlan = make_exchange(*InnerPlan, innerFrOpts, false,
 									   false, node_number, nodes_at_cluster);
 
@@ -557,6 +924,7 @@ changeJoinPlan(Plan *plan, PlannedStmt *stmt, fr_options_t innerFrOpts,
 		{
 			innerFrOpts.attno = inner_join_attr;
 			innerFrOpts.funcId = outerFrOpts.funcId;
+			innerFrOpts.colocation = outerFrOpts.colocation;
 			*InnerPlan = make_exchange(*InnerPlan, innerFrOpts, false,
 											false, node_number, nodes_at_cluster);
 
@@ -616,17 +984,20 @@ HOOK_Utility_injection(PlannedStmt *pstmt,
 						char *completionTag)
 {
 	Node	*parsetree = pstmt->utilityStmt;
+	List	*distribution = NIL;
+	bool	created = false;
 
 	Assert(nfrRelations < 100);
 
-	switch (nodeTag(parsetree))
+	/* Options of the distribution are not known to the core */
+	if (IsA(parsetree, CreateStmt))
 	{
-	case T_CreateStmt: /* CREATE TABLE */
-		create_table_frag(((CreateStmt *)parsetree)->relation->relname, 1,
-						  FR_FUNC_HASH);
-		break;
-	default:
-		break;
+		/* CREATE TABLE IF NOT EXISTS does not change existing relation */
+		created = !OidIsValid(RangeVarGetRelid(
+									((CreateStmt *) parsetree)->relation,
+									NoLock, true));
+		distribution = extract_distribution_options(&pstmt);
+		parsetree = pstmt->utilityStmt;
 	}
 
 	if (next_ProcessUtility_hook)
@@ -636,7 +1007,17 @@ HOOK_Utility_injection(PlannedStmt *pstmt,
 		standard_ProcessUtility(pstmt, queryString,
 											context, params, queryEnv,
 											dest, completionTag);
+
+	if (created) /* CREATE TABLE */
+		distribute_table(((CreateStmt *) parsetree)->relation, distribution);
+
 	CONN_Check_query_result();
+
+	/* Sizes of the fragments are changed at all nodes */
+	if (PargresInitialized && (CoordNode == node_number) &&
+		IsA(parsetree, VacuumStmt) &&
+		(((VacuumStmt *) parsetree)->options & VACOPT_ANALYZE))
+		RELSTATS_Analyze_cluster();
 }
 
 /*
@@ -672,13 +1053,21 @@ HOOK_Parser_injection(ParseState *pstate, Query *query)
 		/* Establish connections to all another instances. */
 		InstanceConnectionsSetup();
 	}
+	else if (CoordNode != node_number)
+		/* The statement is launched by the coordinator */
+		TRACE_Accept_query(pstate->p_sourcetext, NULL);
 
 	/*
 	 * Send Query to another instances. Ideally, we must send a plan of the
 	 * query.
+	 * A statement of the extended protocol can have parameters and can be
+	 * executed many times without parsing. It is launched by the executor
+	 * start with values of the parameters.
 	 */
-	if (CoordNode == node_number)
-		CONN_Launch_query(pstate->p_sourcetext);
+	if ((CoordNode == node_number) &&
+		((query->commandType == CMD_UTILITY) ||
+		 (pstate->p_paramref_hook == NULL)))
+		CONN_Launch_query(pstate->p_sourcetext, query->queryId);
 }
 
 PlannedStmt *
@@ -688,6 +1077,7 @@ HOOK_Planner_injection(Query *parse, int cursorOptions,
 	PlannedStmt 	*stmt;
 	Plan			*root;
 	fr_options_t	frOpts = {.attno = 1, .funcId = FR_FUNC_GATHER};
+	TimestampTz		start = GetCurrentTimestamp();
 
 	if (prev_planner_hook)
 		stmt = prev_planner_hook(parse, cursorOptions, boundParams);
@@ -698,6 +1088,7 @@ HOOK_Planner_injection(Query *parse, int cursorOptions,
 		return stmt;
 
 	load_description_frag();
+	RELSTATS_Load();
 
 	root = stmt->planTree;
 	/*
@@ -716,6 +1107,14 @@ HOOK_Planner_injection(Query *parse, int cursorOptions,
 		stmt->planTree = make_exchange(stmt->planTree,
 				frOpts, false, false, node_number, nodes_at_cluster);
 	}
+
+	/* Do not send attributes which are not used above an exchange */
+	set_exchange_projections(stmt->planTree, NULL, true);
+
+	/* Cache output of exchanges, which will be rescanned */
+	set_exchange_rescans(stmt->planTree, false);
+
+	TRACE_Span("planning", start);
 	return stmt;
 }
 
@@ -786,6 +1185,76 @@ _PG_init(void)
 								NULL,
 								NULL);
 
+	DefineCustomIntVariable("pargres.exchange_queue_size",
+								"Max size of not yet sent data per exchange stream",
+								NULL,
+								&exchange_queue_size,
+								1024,
+								8,
+								MAX_KILOBYTES,
+								PGC_USERSET,
+								GUC_UNIT_KB,
+								NULL,
+								NULL,
+								NULL);
+
+	DefineCustomBoolVariable("pargres.unix_sockets",
+							 "Use Unix domain sockets for exchange between co-located instances",
+							 NULL,
+							 &exchange_unix_sockets,
+							 true,
+							 PGC_SIGHUP,
+							 GUC_NOT_IN_SAMPLE,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pargres.compression_min_width",
+							"Compress exchange traffic of tuples not narrower than this width",
+							"-1 disables compression, 0 compresses all exchanges.",
+							&exchange_compression_min_width,
+							-1,
+							-1,
+							INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pargres.columnar_exchange",
+							 "Send exchange traffic by blocks in the columnar format",
+							 NULL,
+							 &exchange_columnar,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pargres.trace",
+							 "Record timeline of distributed statements at all nodes",
+							 NULL,
+							 &pargres_trace,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("pargres.trace_directory",
+							   "Directory of the trace files",
+							   "Relative path is counted from the data directory. Empty value disables tracing.",
+							   &trace_directory,
+							   "pargres_trace",
+							   PGC_SIGHUP,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
 	EXCHANGE_Init_methods();
 
 	PLAN_Hooks_init();
@@ -796,31 +1265,248 @@ _PG_init(void)
 }
 
 /*
- * Add a description row into the fragmentation table.
+ * Remove options of the "pargres" namespace from the CREATE TABLE statement:
+ *	WITH (pargres.distribute_by = 'hash(column)', pargres.colocate_with = 'rel')
+ * The statement is copied, if it is changed: it can be cached.
+ */
+static List *
+extract_distribution_options(PlannedStmt **pstmt)
+{
+	CreateStmt	*stmt = (CreateStmt *) (*pstmt)->utilityStmt;
+	List		*distribution = NIL;
+	List		*options = NIL;
+	ListCell	*lc;
+
+	foreach(lc, stmt->options)
+	{
+		DefElem *def = (DefElem *) lfirst(lc);
+
+		if ((def->defnamespace != NULL) &&
+			(strcmp(def->defnamespace, "pargres") == 0))
+			distribution = lappend(distribution, def);
+		else
+			options = lappend(options, def);
+	}
+
+	if (distribution == NIL)
+		return NIL;
+
+	*pstmt = copyObject(*pstmt);
+	((CreateStmt *) (*pstmt)->utilityStmt)->options = options;
+	return distribution;
+}
+
+/*
+ * Register the distribution of the created relation. By default the relation
+ * is distributed by hash of the first column.
  */
 static void
-create_table_frag(const char *relname, int attno, fr_func_id fid)
+distribute_table(RangeVar *relation, List *options)
 {
-	Relation	rel;
-	RangeVar	*relfrag_table_rv;
-	HeapTuple	tuple;
-	Datum		values[3];
-	bool		nulls[3] = {false, false, false};
-	char		reln[64];
+	char		*column = NULL;
+	char		*method = "hash";
+	char		*colocate_with = NULL;
+	ListCell	*lc;
+
+	foreach(lc, options)
+	{
+		DefElem *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "distribute_by") == 0)
+		{
+			char *value = pstrdup(defGetString(def));
+			char *open = strchr(value, '(');
+
+			/* method(column) or column */
+			if (open != NULL)
+			{
+				char *close = strrchr(value, ')');
+
+				if ((close == NULL) || (close < open) || (close[1] != '\0'))
+					ereport(ERROR,
+							(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+							 errmsg("invalid value for pargres.distribute_by: \"%s\"",
+									defGetString(def)),
+							 errhint("Valid format is \"method(column)\".")));
+				*open = '\0';
+				*close = '\0';
+				method = value;
+				column = open + 1;
+			}
+			else
+				column = value;
+		}
+		else if (strcmp(def->defname, "colocate_with") == 0)
+			colocate_with = defGetString(def);
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("unrecognized parameter \"pargres.%s\"",
+							def->defname)));
+	}
+
+	if (column != NULL)
+		column = downcase_identifier(column, strlen(column), false, false);
+
+	set_distribution(RangeVarGetRelid(relation, NoLock, false), column, method,
+					 colocate_with);
+}
+
+/*
+ * Distribute the relation by the column (the first one, if NULL).
+ */
+static void
+set_distribution(Oid relid, const char *column, const char *method,
+				 const char *colocate_with)
+{
+	fr_func_id	fid = get_distribution_method(method);
+	AttrNumber	attno = 1;
+
+	if (column != NULL)
+	{
+		attno = get_attnum(relid, column);
+		if (attno == InvalidAttrNumber)
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_COLUMN),
+					 errmsg("column \"%s\" of relation \"%s\" does not exist",
+							column, get_rel_name(relid))));
+	}
+
+	/* See get_tuple_node() */
+	if ((fid == FR_FUNC_DEFAULT) && (get_atttype(relid, attno) != INT4OID))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("modulo distribution requires an integer column")));
 
-	if (strcmp(relname, RELATIONS_FRAG_CONFIG) == 0)
+	create_table_frag(get_rel_name(relid), attno, fid,
+					  format_type_be(get_atttype(relid, attno)), colocate_with);
+}
+
+static fr_func_id
+get_distribution_method(const char *method)
+{
+	if (pg_strcasecmp(method, "hash") == 0)
+		return FR_FUNC_HASH;
+	if (pg_strcasecmp(method, "modulo") == 0)
+		return FR_FUNC_DEFAULT;
+
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("unknown distribution method \"%s\"", method),
+			 errhint("Valid methods are \"hash\" and \"modulo\".")));
+	return FR_FUNC_NINITIALIZED;
+}
+
+/*
+ * Set the description row of the relation in the fragmentation table. The
+ * relation joins the colocation group of colocate_with. By default, it joins
+ * the first group with the same method and type of the distribution column.
+ * A new group is created, if there is no such group or colocate_with is
+ * "none".
+ */
+static void
+create_table_frag(const char *relname, int attno, fr_func_id fid,
+				  const char *atttype, const char *colocate_with)
+{
+	Relation		rel;
+	RangeVar		*relfrag_table_rv;
+	HeapScanDesc	scandesc;
+	HeapTuple		tuple;
+	Datum			values[4];
+	bool			nulls[4] = {false, false, false, false};
+	char			reln[64];
+	int				colocation = 0;
+	int				i;
+
+	if ((strcmp(relname, RELATIONS_FRAG_CONFIG) == 0) ||
+		(strcmp(relname, RELATIONS_STATS_CONFIG) == 0) ||
+		(strcmp(relname, RELATIONS_COLOCATION_CONFIG) == 0))
 		return;
 
 	StrNCpy(reln, relname, NAMEDATALEN);
 	Assert(relname != 0);
 
+	load_description_frag();
+
+	if (colocate_with == NULL)
+	{
+		for (i = 0; i < nColocationGroups; i++)
+			if ((colocationGroups[i].funcId == fid) &&
+				(strcmp(colocationGroups[i].atttype, atttype) == 0))
+			{
+				colocation = colocationGroups[i].colocation;
+				break;
+			}
+	}
+	else if (strcmp(colocate_with, "none") != 0)
+	{
+		ColocationGroup *group = NULL;
+
+		for (i = 0; i < nfrRelations; i++)
+			if (strcmp(frRelations[i].relname, colocate_with) == 0)
+			{
+				group = get_colocation_group(frRelations[i].frOpts.colocation);
+				break;
+			}
+
+		/*
+		 * A relation, distributed before the colocation groups, has no group,
+		 * if there is no group of its method and type yet. The new group
+		 * becomes its default group.
+		 */
+		if ((group == NULL) && (i < nfrRelations) &&
+			(frRelations[i].frOpts.funcId == fid) &&
+			(frag_atttype(&frRelations[i]) != NULL) &&
+			(strcmp(frag_atttype(&frRelations[i]), atttype) == 0))
+			colocation = 0;
+		else
+		{
+			if (group == NULL)
+				ereport(ERROR,
+						(errcode(ERRCODE_UNDEFINED_TABLE),
+						 errmsg("relation \"%s\" is not distributed",
+								colocate_with)));
+			if (group->funcId != fid)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("relation \"%s\" is distributed by another method",
+								colocate_with)));
+			if (strcmp(group->atttype, atttype) != 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATATYPE_MISMATCH),
+						 errmsg("distribution column of relation \"%s\" has type %s, but %s is used",
+								colocate_with, group->atttype, atttype)));
+			colocation = group->colocation;
+		}
+	}
+
+	if (colocation == 0)
+	{
+		colocation = maxColocation + 1;
+		create_colocation_group(colocation, fid, atttype);
+	}
+
 	values[0] = CStringGetTextDatum(reln);
 	values[1] = Int32GetDatum(attno);
 	values[2] = Int32GetDatum(fid);
+	values[3] = Int32GetDatum(colocation);
 
 	relfrag_table_rv = makeRangeVar("public", RELATIONS_FRAG_CONFIG, -1);
 	rel = heap_openrv(relfrag_table_rv, RowExclusiveLock);
 
+	/* Replace the previous distribution of the relation */
+	scandesc = heap_beginscan(rel, GetTransactionSnapshot(), 0, NULL);
+	while ((tuple = heap_getnext(scandesc, ForwardScanDirection)) != NULL)
+	{
+		Datum	fvalues[4];
+		bool	fnulls[4];
+
+		heap_deform_tuple(tuple, rel->rd_att, fvalues, fnulls);
+		if (strcmp(TextDatumGetCString(fvalues[0]), reln) == 0)
+			simple_heap_delete(rel, &tuple->t_self);
+	}
+	heap_endscan(scandesc);
+
 	tuple = heap_form_tuple(RelationGetDescr(rel), values, nulls);
 
 	PG_TRY();
@@ -838,6 +1524,49 @@ create_table_frag(const char *relname, int attno, fr_func_id fid)
 	CommandCounterIncrement();
 }
 
+/*
+ * Add the colocation group. Buckets of the hash distribution are mapped to
+ * nodes round-robin. The number of buckets is a multiple of the number of
+ * nodes: the placement is the same as of the hash modulo the number of nodes.
+ */
+static void
+create_colocation_group(int colocation, fr_func_id fid, const char *atttype)
+{
+	Relation	rel;
+	HeapTuple	tuple;
+	Datum		values[5];
+	bool		nulls[5] = {false, false, false, false, false};
+	int			nbuckets = 0;
+
+	values[0] = Int32GetDatum(colocation);
+	values[1] = Int32GetDatum(fid);
+	values[2] = CStringGetTextDatum(atttype);
+
+	if (fid == FR_FUNC_HASH)
+	{
+		Datum	*buckets;
+		int		i;
+
+		nbuckets = nodes_at_cluster * COLOCATION_BUCKETS_PER_NODE;
+		buckets = palloc(nbuckets * sizeof(Datum));
+		for (i = 0; i < nbuckets; i++)
+			buckets[i] = Int32GetDatum(i % nodes_at_cluster);
+
+		values[4] = PointerGetDatum(construct_array(buckets, nbuckets, INT4OID,
+													sizeof(int32), true, 'i'));
+	}
+	else
+		nulls[4] = true;
+	values[3] = Int32GetDatum(nbuckets);
+
+	rel = heap_openrv(makeRangeVar("public", RELATIONS_COLOCATION_CONFIG, -1),
+					  RowExclusiveLock);
+	tuple = heap_form_tuple(RelationGetDescr(rel), values, nulls);
+	simple_heap_insert(rel, tuple);
+	heap_close(rel, RowExclusiveLock);
+	CommandCounterIncrement();
+}
+
 /*
  * Load distribution rules of relations from special table
  * like nodeSeqscan.c -> SeqNext() function
@@ -849,8 +1578,9 @@ load_description_frag(void)
 	Relation		rel;
 	HeapScanDesc	scandesc;
 	HeapTuple		tuple;
-	Datum			values[3];
-	bool			nulls[3];
+	Datum			values[4];
+	bool			nulls[4];
+	int				i;
 
 	relfrag_table_rv = makeRangeVar("public", RELATIONS_FRAG_CONFIG, -1);
 	rel = heap_openrv_extended(relfrag_table_rv, AccessShareLock, true);
@@ -863,15 +1593,139 @@ load_description_frag(void)
 	nfrRelations = 0;
 	for ( ; (tuple = heap_getnext(scandesc, ForwardScanDirection)) != NULL; )
 	{
+		/* Tables of old installations have no colocation column */
+		nulls[3] = true;
 		heap_deform_tuple(tuple, rel->rd_att, values, nulls);
 		strcpy(frRelations[nfrRelations].relname, TextDatumGetCString(values[0]));
 		frRelations[nfrRelations].frOpts.attno = DatumGetInt32(values[1]);
 		frRelations[nfrRelations].frOpts.funcId = DatumGetInt32(values[2]);
+		frRelations[nfrRelations].frOpts.colocation = nulls[3] ? 0 :
+												DatumGetInt32(values[3]);
+		frRelations[nfrRelations].relid = InvalidOid;
 		nfrRelations++;
 	}
 
 	heap_endscan(scandesc);
 	heap_close(rel, AccessShareLock);
+
+	load_colocation_groups();
+
+	/*
+	 * Relations, distributed before the colocation groups were introduced,
+	 * have no row in the groups table. They belong to the default group of
+	 * their method and column type. Their numbers are not given to new groups.
+	 */
+	maxColocation = 0;
+	for (i = 0; i < nColocationGroups; i++)
+		maxColocation = Max(maxColocation, colocationGroups[i].colocation);
+
+	for (i = 0; i < nfrRelations; i++)
+	{
+		maxColocation = Max(maxColocation, frRelations[i].frOpts.colocation);
+		if (get_colocation_group(frRelations[i].frOpts.colocation) == NULL)
+			frRelations[i].frOpts.colocation =
+										default_colocation(&frRelations[i]);
+	}
+}
+
+/*
+ * Type name of the distribution column of the relation. NULL, if the relation
+ * or the column is not found.
+ */
+static char *
+frag_atttype(const FragRels *frRel)
+{
+	Oid relid = RelnameGetRelid(frRel->relname);
+
+	if (!OidIsValid(relid) || (frRel->frOpts.attno <= 0))
+		return NULL;
+
+	return format_type_be(get_atttype(relid, frRel->frOpts.attno));
+}
+
+/*
+ * The group, which a new relation of the same method and column type joins
+ * by default. Returns 0, if there is no such group yet: relations without a
+ * group are placed by the hash modulo the number of nodes, like the default
+ * group.
+ */
+static int
+default_colocation(const FragRels *frRel)
+{
+	char	*atttype = frag_atttype(frRel);
+	int		i;
+
+	if (atttype == NULL)
+		return 0;
+
+	for (i = 0; i < nColocationGroups; i++)
+		if ((colocationGroups[i].funcId == frRel->frOpts.funcId) &&
+			(strcmp(colocationGroups[i].atttype, atttype) == 0))
+			return colocationGroups[i].colocation;
+
+	return 0;
+}
+
+static void
+load_colocation_groups(void)
+{
+	Relation		rel;
+	HeapScanDesc	scandesc;
+	HeapTuple		tuple;
+	Datum			values[5];
+	bool			nulls[5];
+
+	if (ColocationContext == NULL)
+		ColocationContext = AllocSetContextCreate(TopMemoryContext,
+												  "Pargres colocation groups",
+												  ALLOCSET_SMALL_SIZES);
+	else
+		MemoryContextReset(ColocationContext);
+
+	nColocationGroups = 0;
+
+	rel = heap_openrv_extended(makeRangeVar("public",
+											RELATIONS_COLOCATION_CONFIG, -1),
+							   AccessShareLock, true);
+	if (rel == NULL)
+		return;
+
+	scandesc = heap_beginscan(rel, GetTransactionSnapshot(), 0, NULL);
+
+	while ((tuple = heap_getnext(scandesc, ForwardScanDirection)) != NULL)
+	{
+		ColocationGroup	*group;
+
+		if (nColocationGroups == lengthof(colocationGroups))
+			break;
+
+		group = &colocationGroups[nColocationGroups++];
+		heap_deform_tuple(tuple, rel->rd_att, values, nulls);
+		group->colocation = DatumGetInt32(values[0]);
+		group->funcId = DatumGetInt32(values[1]);
+		text_to_cstring_buffer(DatumGetTextPP(values[2]), group->atttype,
+							   sizeof(group->atttype));
+		group->nbuckets = 0;
+		group->buckets = NULL;
+
+		if (!nulls[4])
+		{
+			MemoryContext	oldcxt = MemoryContextSwitchTo(ColocationContext);
+			Datum			*buckets;
+			int				i;
+
+			deconstruct_array(DatumGetArrayTypeP(values[4]), INT4OID,
+							  sizeof(int32), true, 'i', &buckets, NULL,
+							  &group->nbuckets);
+			group->buckets = palloc(group->nbuckets * sizeof(int));
+			for (i = 0; i < group->nbuckets; i++)
+				group->buckets[i] = DatumGetInt32(buckets[i]);
+			MemoryContextSwitchTo(oldcxt);
+		}
+	}
+
+	heap_endscan(scandesc);
+	heap_close(rel, AccessShareLock);
 }
 
 Datum
@@ -909,27 +1763,17 @@ isLocalValue(PG_FUNCTION_ARGS)
 	if (frOpts.funcId == FR_FUNC_HASH)
 	{
 		Oid				atttypid;
-		Oid				opclass;
-		Oid				funcid;
-		FmgrInfo		*hashfunction = palloc0(sizeof(FmgrInfo));
 		Oid				relid;
 		Relation		rel;
-		Oid				opcfamily,
-						opcintype;
 
 		relid = get_relname_relid(relname, get_pargres_schema());
 		rel = heap_open(relid, AccessShareLock);
 		atttypid = TupleDescAttr(rel->rd_att, frOpts.attno-1)->atttypid;
 		heap_close(rel, AccessShareLock);
 
-		opclass = GetDefaultOpClass(atttypid, HASH_AM_OID);
-		opcfamily = get_opclass_family(opclass);
-		opcintype = get_opclass_input_type(opclass);
-		funcid = get_opfamily_proc(opcfamily, opcintype, opcintype,
-								   	   	   	   	   	   	   HASHEXTENDED_PROC);
-
-		fmgr_info(funcid, hashfunction);
-		data = hashfunction;
+		data = make_hash_route(atttypid);
+		set_hash_route_buckets((HashRouteData *) data,
+							   PLAN_Get_bucket_map(frOpts.colocation));
 	}
 	else
 		data = NULL;
@@ -939,3 +1783,65 @@ isLocalValue(PG_FUNCTION_ARGS)
 
 	PG_RETURN_BOOL(destnode == node_number);
 }
+
+/*
+ * Change the distribution of the empty relation. Executed by all nodes, like
+ * any statement of the coordinator.
+ */
+Datum
+create_distributed_table(PG_FUNCTION_ARGS)
+{
+	char			*relname;
+	Oid				relid;
+	Relation		rel;
+	HeapScanDesc	scandesc;
+	bool			exists;
+	bool			empty;
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("relation, column and method must not be NULL")));
+
+	/*
+	 * The statement is executed by each instance, and each of them registers
+	 * the distribution. So it is done at all instances or at none of them:
+	 * the checks of the local fragment are agreed upon before raising an
+	 * error.
+	 */
+	relname = TextDatumGetCString(PG_GETARG_DATUM(0));
+	relid = RelnameGetRelid(relname);
+
+	if (OidIsValid(relid))
+	{
+		/* Rows of the local fragment are not moved */
+		rel = heap_open(relid, ShareLock);
+		scandesc = heap_beginscan(rel, GetTransactionSnapshot(), 0, NULL);
+		empty = (heap_getnext(scandesc, ForwardScanDirection) == NULL);
+		heap_endscan(scandesc);
+		heap_close(rel, NoLock);
+	}
+	else
+		empty = false;
+
+	exists = CONN_Vote(OidIsValid(relid));
+	empty = CONN_Vote(empty);
+
+	if (!exists)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_TABLE),
+				 errmsg("relation \"%s\" does not exist at all nodes",
+						relname)));
+
+	if (!empty)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("relation \"%s\" is not empty", relname),
+				 errhint("Distribution must be set before loading of data.")));
+
+	set_distribution(relid, TextDatumGetCString(PG_GETARG_DATUM(1)),
+					 TextDatumGetCString(PG_GETARG_DATUM(2)),
+					 PG_ARGISNULL(3) ? NULL :
+									   TextDatumGetCString(PG_GETARG_DATUM(3)));
+	PG_RETURN_VOID();
+}
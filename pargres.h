@@ -3,4 +3,10 @@
 
 #include "fmgr.h"
 
+#include "exchange.h"
+
+
+extern fr_options_t PLAN_Get_fragmentation(const char *relname);
+extern List *PLAN_Get_bucket_map(int colocation);
+
 #endif							/* PARGRES_H */
@@ -0,0 +1,413 @@
+/* ------------------------------------------------------------------------
+ *
+ * relstats.c
+ *		Cluster-wide statistics of distributed relations.
+ *
+ *		The planner of each node sees statistics of the local fragment only.
+ *		ANALYZE at the coordinator is executed by all nodes. Then the
+ *		coordinator collects sizes of the fragments by the distributed query
+ *		over pargres_local_relstats(): rows of all nodes are passed to the
+ *		coordinator by the exchange. Sizes of all fragments are stored into
+ *		the "relstats" table of each node by pargres_set_relstats().
+ *		The planner uses them to estimate traffic of the exchanges.
+ *		Only the sizes are merged. Histograms and MCV lists of the fragments
+ *		are not collected, and the local planner still uses local
+ *		pg_statistic and local reltuples. Merged column statistics could be
+ *		supplied by get_relation_stats_hook and global sizes by
+ *		get_relation_info_hook, but it is not implemented: the subplans of
+ *		a node scan its local fragment only.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ * ------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "nodes/makefuncs.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+#include "utils/tuplestore.h"
+
+#include "common.h"
+#include "exchange.h"
+#include "relstats.h"
+
+
+PG_FUNCTION_INFO_V1(pargres_local_relstats);
+PG_FUNCTION_INFO_V1(pargres_set_relstats);
+
+/* Sum of the fragment sizes over the cluster */
+typedef struct
+{
+	char	relname[NAMEDATALEN];
+	double	reltuples;
+	double	relpages;
+} GlobalRelStats;
+
+#define RELSTATS_MAX	(1000)
+
+static int				nrelStats = 0;
+static GlobalRelStats	relStats[RELSTATS_MAX];
+
+/* Fragment sizes of one relation at all nodes */
+typedef struct
+{
+	char	*relname;
+	float4	*reltuples;
+	int32	*relpages;
+} FragmentSizes;
+
+
+/*
+ * Collect sizes of all fragments of distributed relations and store them at
+ * each node. Called by the coordinator after ANALYZE.
+ */
+void
+RELSTATS_Analyze_cluster(void)
+{
+	List		*relations = NIL;
+	ListCell	*lc;
+	uint64		i;
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	/* Rows of all nodes are gathered by the exchange */
+	if (SPI_execute("SELECT relname, node, reltuples, relpages "
+					"FROM pargres_local_relstats()", false, 0) != SPI_OK_SELECT)
+		elog(ERROR, "Fragment sizes collecting error");
+
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple		tuple = SPI_tuptable->vals[i];
+		TupleDesc		tupdesc = SPI_tuptable->tupdesc;
+		char			*relname = SPI_getvalue(tuple, tupdesc, 1);
+		int				node = atoi(SPI_getvalue(tuple, tupdesc, 2));
+		FragmentSizes	*sizes = NULL;
+
+		if ((node < 0) || (node >= nodes_at_cluster))
+			continue;
+
+		foreach(lc, relations)
+		{
+			if (strcmp(((FragmentSizes *) lfirst(lc))->relname, relname) == 0)
+			{
+				sizes = (FragmentSizes *) lfirst(lc);
+				break;
+			}
+		}
+
+		if (sizes == NULL)
+		{
+			sizes = palloc(sizeof(FragmentSizes));
+			sizes->relname = relname;
+			sizes->reltuples = palloc0(nodes_at_cluster * sizeof(float4));
+			sizes->relpages = palloc0(nodes_at_cluster * sizeof(int32));
+			relations = lappend(relations, sizes);
+		}
+
+		sizes->reltuples[node] = strtof(SPI_getvalue(tuple, tupdesc, 3), NULL);
+		sizes->relpages[node] = atoi(SPI_getvalue(tuple, tupdesc, 4));
+	}
+
+	/* The statement is executed by all nodes */
+	foreach(lc, relations)
+	{
+		FragmentSizes	*sizes = (FragmentSizes *) lfirst(lc);
+		StringInfoData	query;
+		int				node;
+
+		initStringInfo(&query);
+		appendStringInfo(&query, "SELECT pargres_set_relstats(%s, '{",
+						 quote_literal_cstr(sizes->relname));
+		for (node = 0; node < nodes_at_cluster; node++)
+			appendStringInfo(&query, "%s%g", (node > 0) ? "," : "",
+							 sizes->reltuples[node]);
+		appendStringInfoString(&query, "}', '{");
+		for (node = 0; node < nodes_at_cluster; node++)
+			appendStringInfo(&query, "%s%d", (node > 0) ? "," : "",
+							 sizes->relpages[node]);
+		appendStringInfoString(&query, "}')");
+
+		if (SPI_execute(query.data, false, 0) != SPI_OK_SELECT)
+			elog(ERROR, "Fragment sizes storing error");
+	}
+
+	SPI_finish();
+}
+
+/*
+ * Load cluster-wide statistics like load_description_frag().
+ */
+void
+RELSTATS_Load(void)
+{
+	RangeVar		*relstats_table_rv;
+	Relation		rel;
+	HeapScanDesc	scandesc;
+	HeapTuple		tuple;
+	Datum			values[4];
+	bool			nulls[4];
+
+	nrelStats = 0;
+
+	relstats_table_rv = makeRangeVar("public", RELATIONS_STATS_CONFIG, -1);
+	rel = heap_openrv_extended(relstats_table_rv, AccessShareLock, true);
+
+	if (rel == NULL)
+		return;
+
+	scandesc = heap_beginscan(rel, GetTransactionSnapshot(), 0, NULL);
+
+	while ((tuple = heap_getnext(scandesc, ForwardScanDirection)) != NULL)
+	{
+		char	*relname;
+		int		i;
+
+		heap_deform_tuple(tuple, rel->rd_att, values, nulls);
+		relname = TextDatumGetCString(values[0]);
+
+		for (i = 0; i < nrelStats; i++)
+			if (strcmp(relStats[i].relname, relname) == 0)
+				break;
+
+		if (i == nrelStats)
+		{
+			if (nrelStats == RELSTATS_MAX)
+				continue;
+
+			StrNCpy(relStats[i].relname, relname, NAMEDATALEN);
+			relStats[i].reltuples = 0;
+			relStats[i].relpages = 0;
+			nrelStats++;
+		}
+
+		relStats[i].reltuples += DatumGetFloat4(values[2]);
+		relStats[i].relpages += DatumGetInt32(values[3]);
+	}
+
+	heap_endscan(scandesc);
+	heap_close(rel, AccessShareLock);
+}
+
+/*
+ * Estimation of the rows number, produced by the plan at all nodes. Estimation
+ * of the local plan is scaled by the ratio of the relation size over the
+ * cluster to the size of the local fragment. Without statistics, fragments
+ * are assumed to be equal.
+ */
+double
+RELSTATS_Global_rows(Plan *plan, List *rtable)
+{
+	Oid		relid = exchange_source_relation(plan, rtable);
+	char	*relname;
+	int		i;
+
+	if (!OidIsValid(relid) || ((relname = get_rel_name(relid)) == NULL))
+		return plan->plan_rows * nodes_at_cluster;
+
+	for (i = 0; i < nrelStats; i++)
+	{
+		HeapTuple	tp;
+		double		local;
+
+		if (strcmp(relStats[i].relname, relname) != 0)
+			continue;
+
+		tp = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+		if (!HeapTupleIsValid(tp))
+			break;
+		local = ((Form_pg_class) GETSTRUCT(tp))->reltuples;
+		ReleaseSysCache(tp);
+
+		if (local <= 0)
+			break;
+
+		return plan->plan_rows * relStats[i].reltuples / local;
+	}
+
+	return plan->plan_rows * nodes_at_cluster;
+}
+
+/*
+ * Size of the relation over the cluster in bytes. Without statistics,
+ * fragments are assumed to be equal to the local one.
+ */
+double
+RELSTATS_Global_size(Oid relid)
+{
+	char		*relname = get_rel_name(relid);
+	HeapTuple	tp;
+	double		relpages;
+	int			i;
+
+	if (relname == NULL)
+		return 0.;
+
+	for (i = 0; i < nrelStats; i++)
+		if (strcmp(relStats[i].relname, relname) == 0)
+			return relStats[i].relpages * BLCKSZ;
+
+	tp = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (!HeapTupleIsValid(tp))
+		return 0.;
+	relpages = ((Form_pg_class) GETSTRUCT(tp))->relpages;
+	ReleaseSysCache(tp);
+
+	return relpages * BLCKSZ * nodes_at_cluster;
+}
+
+/*
+ * Sizes of the local fragments of distributed relations.
+ */
+Datum
+pargres_local_relstats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc		tupdesc;
+	Tuplestorestate	*tupstore;
+	MemoryContext	oldcxt;
+	RangeVar		*relfrag_table_rv;
+	Relation		rel;
+	HeapScanDesc	scandesc;
+	HeapTuple		tuple;
+
+	if ((rsinfo == NULL) || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcxt = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	MemoryContextSwitchTo(oldcxt);
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	relfrag_table_rv = makeRangeVar("public", RELATIONS_FRAG_CONFIG, -1);
+	rel = heap_openrv_extended(relfrag_table_rv, AccessShareLock, true);
+
+	if (rel == NULL)
+		return (Datum) 0;
+
+	scandesc = heap_beginscan(rel, GetTransactionSnapshot(), 0, NULL);
+
+	while ((tuple = heap_getnext(scandesc, ForwardScanDirection)) != NULL)
+	{
+		Datum		fvalues[4];
+		bool		fnulls[4];
+		Datum		values[4];
+		bool		nulls[4] = {false, false, false, false};
+		char		*relname;
+		Oid			relid;
+		HeapTuple	tp;
+
+		heap_deform_tuple(tuple, rel->rd_att, fvalues, fnulls);
+		relname = TextDatumGetCString(fvalues[0]);
+
+		if (!OidIsValid(relid = RelnameGetRelid(relname)))
+			continue;
+
+		tp = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+		if (!HeapTupleIsValid(tp))
+			continue;
+
+		values[0] = CStringGetTextDatum(relname);
+		values[1] = Int32GetDatum(node_number);
+		values[2] = Float4GetDatum(((Form_pg_class) GETSTRUCT(tp))->reltuples);
+		values[3] = Int32GetDatum(((Form_pg_class) GETSTRUCT(tp))->relpages);
+		ReleaseSysCache(tp);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	heap_endscan(scandesc);
+	heap_close(rel, AccessShareLock);
+
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
+
+/*
+ * Replace sizes of the relation fragments. Element i of arrays is the size of
+ * the fragment at the node i.
+ */
+Datum
+pargres_set_relstats(PG_FUNCTION_ARGS)
+{
+	text			*relname = PG_GETARG_TEXT_PP(0);
+	ArrayType		*tuples_array = PG_GETARG_ARRAYTYPE_P(1);
+	ArrayType		*pages_array = PG_GETARG_ARRAYTYPE_P(2);
+	Datum			*reltuples;
+	Datum			*relpages;
+	int				ntuples;
+	int				npages;
+	RangeVar		*relstats_table_rv;
+	Relation		rel;
+	HeapScanDesc	scandesc;
+	HeapTuple		tuple;
+	int				node;
+
+	deconstruct_array(tuples_array, FLOAT4OID, sizeof(float4), FLOAT4PASSBYVAL,
+					  'i', &reltuples, NULL, &ntuples);
+	deconstruct_array(pages_array, INT4OID, sizeof(int32), true,
+					  'i', &relpages, NULL, &npages);
+
+	if (ntuples != npages)
+		elog(ERROR, "Arrays of fragment sizes must have the same length");
+
+	relstats_table_rv = makeRangeVar("public", RELATIONS_STATS_CONFIG, -1);
+	rel = heap_openrv(relstats_table_rv, RowExclusiveLock);
+
+	/* Remove old statistics of the relation */
+	scandesc = heap_beginscan(rel, GetTransactionSnapshot(), 0, NULL);
+	while ((tuple = heap_getnext(scandesc, ForwardScanDirection)) != NULL)
+	{
+		Datum	values[4];
+		bool	nulls[4];
+
+		heap_deform_tuple(tuple, rel->rd_att, values, nulls);
+		if (DatumGetInt32(DirectFunctionCall2(bttextcmp, values[0],
+											  PointerGetDatum(relname))) == 0)
+			simple_heap_delete(rel, &tuple->t_self);
+	}
+	heap_endscan(scandesc);
+
+	for (node = 0; node < ntuples; node++)
+	{
+		Datum	values[4];
+		bool	nulls[4] = {false, false, false, false};
+
+		values[0] = PointerGetDatum(relname);
+		values[1] = Int32GetDatum(node);
+		values[2] = reltuples[node];
+		values[3] = relpages[node];
+
+		tuple = heap_form_tuple(RelationGetDescr(rel), values, nulls);
+		simple_heap_insert(rel, tuple);
+	}
+
+	heap_close(rel, RowExclusiveLock);
+	CommandCounterIncrement();
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,29 @@
+/*-------------------------------------------------------------------------
+ *
+ * relstats.h
+ *	Cluster-wide statistics of distributed relations
+ *
+ * Copyright (c) 2018, PostgreSQL Global Development Group
+ * Author: Andrey Lepikhov <a.lepikhov@postgrespro.ru>
+ *
+ * IDENTIFICATION
+ *	contrib/pargres/relstats.h
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef RELSTATS_H_
+#define RELSTATS_H_
+
+#include "nodes/plannodes.h"
+
+
+/* Name of relation with cluster-wide statistics */
+#define RELATIONS_STATS_CONFIG	"relstats"
+
+extern void RELSTATS_Analyze_cluster(void);
+extern void RELSTATS_Load(void);
+extern double RELSTATS_Global_rows(Plan *plan, List *rtable);
+extern double RELSTATS_Global_size(Oid relid);
+
+#endif /* RELSTATS_H_ */
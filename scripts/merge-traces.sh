@@ -0,0 +1,21 @@
+#!/bin/bash
+
+# Merge trace files of one distributed statement from all nodes into one
+# Chrome trace. Open the result by chrome://tracing or ui.perfetto.dev.
+# Usage: merge-traces.sh <output file> <trace files...>
+
+if [ $# -lt 2 ]; then
+	echo "Usage: $0 <output file> <trace files...>"
+	exit 1
+fi
+
+output=$1
+shift
+
+echo "Merge $# trace files into $output..."
+
+{
+	echo '{"traceEvents":['
+	cat "$@" | sed '$!s/$/,/'
+	echo ']}'
+} > $output
@@ -0,0 +1,23 @@
+ulimit -c unlimited
+. ./paths.sh
+cp contrib/pargres/scripts/* ./
+
+# Declared distributions return the same rows and are equal at all nodes
+
+./all-start.sh $1
+./file.sh 0 "ptest10.sql"
+
+for (( node=0; node<$1; node++ ))
+do
+	psql -p $((5433+$node)) -At -c "SELECT * FROM relsfrag ORDER BY relname;" \
+		> relsfrag$node.out
+	diff relsfrag0.out relsfrag$node.out || \
+		echo "ptest10: distribution at node $node differs from node 0"
+done
+
+for rel in by_default by_function by_option by_modulo
+do
+	psql -p 5433 -v rel=$rel -f ptest10_1.sql > $rel.out
+	diff by_default.out $rel.out && echo "ptest10: $rel returns equal results"
+done
+./all-stop.sh $1
@@ -0,0 +1,20 @@
+CREATE TABLE by_default (a INT, b INT, c TEXT);
+CREATE TABLE by_function (a INT, b INT, c TEXT);
+SELECT create_distributed_table('by_function', 'b');
+CREATE TABLE by_option (a INT, b INT, c TEXT)
+	WITH (pargres.distribute_by = 'hash(c)');
+CREATE TABLE by_modulo (a INT, b INT, c TEXT)
+	WITH (pargres.distribute_by = 'modulo(b)', pargres.colocate_with = 'none');
+
+-- A relation with rows at any node keeps its distribution at all nodes
+CREATE TABLE loaded (a INT, b INT);
+INSERT INTO loaded VALUES (1, 1);
+SELECT create_distributed_table('loaded', 'b');
+SELECT create_distributed_table('missing', 'b');
+
+-- Each node inserts the generated rows, so the tables hold a copy per node.
+INSERT INTO by_default (SELECT g, g % 7, 'c' || (g % 11)
+						FROM generate_series(1, 1000) AS g);
+INSERT INTO by_function (SELECT * FROM by_default);
+INSERT INTO by_option (SELECT * FROM by_default);
+INSERT INTO by_modulo (SELECT * FROM by_default);
@@ -0,0 +1,8 @@
+SELECT count(*), sum(a), sum(b) FROM :rel;
+SELECT b, count(*), sum(a) FROM :rel GROUP BY b ORDER BY b;
+SELECT c, count(*), max(a) FROM :rel GROUP BY c ORDER BY c;
+SELECT t.a, t.b, t.c FROM :rel t WHERE t.b = 3 ORDER BY t.a, t.c LIMIT 50;
+SELECT t.b, count(*) FROM :rel t JOIN by_default d ON (t.b = d.a)
+GROUP BY t.b ORDER BY t.b;
+SELECT t.c, count(*) FROM :rel t JOIN by_default d ON (t.c = d.c AND t.a = d.b)
+GROUP BY t.c ORDER BY t.c;
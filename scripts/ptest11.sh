@@ -0,0 +1,15 @@
+ulimit -c unlimited
+. ./paths.sh
+cp contrib/pargres/scripts/* ./
+
+# Joins of colocated relations return the same rows as of the relations
+# in separate colocation groups
+
+./all-start.sh $1
+./file.sh 0 "ptest11.sql"
+psql -p 5433 -v orders=orders -v items=items -f ptest11_1.sql > colocated.out
+psql -p 5433 -v orders=orders_alone -v items=items_alone -f ptest11_1.sql \
+	> separate.out
+diff colocated.out separate.out && echo "ptest11: results are equal"
+psql -p 5433 -c "EXPLAIN SELECT * FROM orders o JOIN items i ON (o.cid = i.cid);"
+./all-stop.sh $1
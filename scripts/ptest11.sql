@@ -0,0 +1,18 @@
+CREATE TABLE orders (oid INT, cid INT, note TEXT)
+	WITH (pargres.distribute_by = 'cid');
+CREATE TABLE items (iid INT, cid INT, oid INT, price INT, note TEXT)
+	WITH (pargres.distribute_by = 'cid', pargres.colocate_with = 'orders');
+CREATE TABLE orders_alone (oid INT, cid INT, note TEXT)
+	WITH (pargres.distribute_by = 'cid', pargres.colocate_with = 'none');
+CREATE TABLE items_alone (iid INT, cid INT, oid INT, price INT, note TEXT)
+	WITH (pargres.distribute_by = 'cid', pargres.colocate_with = 'none');
+SELECT * FROM relsfrag ORDER BY relname;
+
+-- Each node inserts the generated rows, so the tables hold a copy per node.
+INSERT INTO orders (SELECT g, g % 97, 'order ' || g
+					FROM generate_series(1, 2000) AS g);
+INSERT INTO items (SELECT g, (g % 2000 + 1) % 97, g % 2000 + 1, g % 13,
+						  'order ' || (g % 2000 + 1)
+				   FROM generate_series(1, 6000) AS g);
+INSERT INTO orders_alone (SELECT * FROM orders);
+INSERT INTO items_alone (SELECT * FROM items);
@@ -0,0 +1,21 @@
+-- Join by the distribution columns is local
+SELECT o.cid, count(*), sum(i.price)
+FROM :orders o JOIN :items i ON (o.cid = i.cid)
+GROUP BY o.cid ORDER BY o.cid;
+
+-- Join by two columns, scan of orders does not output the distribution column
+SELECT i.price, count(*)
+FROM :orders o JOIN :items i ON (o.oid = i.oid AND o.note = i.note)
+GROUP BY i.price ORDER BY i.price;
+
+-- Join by another column
+SELECT i.price, count(*)
+FROM :orders o JOIN :items i ON (o.oid = i.oid)
+GROUP BY i.price ORDER BY i.price;
+
+-- Colocated join under the join with the third relation
+SELECT i2.price, count(*)
+FROM :orders o JOIN :items i ON (o.cid = i.cid)
+			   JOIN :items i2 ON (i.iid = i2.iid)
+WHERE o.oid < 50
+GROUP BY i2.price ORDER BY i2.price;
@@ -0,0 +1,17 @@
+ulimit -c unlimited
+. ./paths.sh
+cp contrib/pargres/scripts/* ./
+
+# Columnar and compressed exchanges return the same rows as the row exchange
+
+./all-start.sh $1
+./file.sh 0 "ptest9.sql"
+psql -p 5433 -c "SET pargres.columnar_exchange = off" -f ptest9_1.sql > rows.out
+psql -p 5433 -c "SET pargres.columnar_exchange = on" -f ptest9_1.sql > columnar.out
+psql -p 5433 -c "SET pargres.compression_min_width = 0" \
+	-c "SET pargres.columnar_exchange = off" -f ptest9_1.sql > pglz.out
+psql -p 5433 -c "SET pargres.compression_min_width = 0" \
+	-c "SET pargres.columnar_exchange = on" -f ptest9_1.sql > columnar_pglz.out
+diff rows.out columnar.out && diff rows.out pglz.out && \
+	diff rows.out columnar_pglz.out && echo "ptest9: results are equal"
+./all-stop.sh $1
@@ -0,0 +1,27 @@
+-- Column kinds of the columnar format:
+--	d - low-cardinality varlena (dictionary),
+--	v - varlena, u - fixed-length by reference, i - by value,
+--	n - NULL only, m and t - mixed NULLs.
+CREATE TABLE cols (
+  id	INT,
+  d		TEXT,
+  v		TEXT,
+  u		UUID,
+  i		BIGINT,
+  n		INT,
+  m		NUMERIC,
+  t		TEXT
+);
+
+CREATE TABLE keys (
+  k		INT,
+  name	TEXT
+);
+
+-- Each node inserts the generated rows, so the tables hold a copy per node.
+INSERT INTO cols (SELECT g, 'group ' || (g % 5), repeat(md5(g::text), g % 4 + 1),
+						 md5(g::text)::uuid, g * 1000000007::bigint, NULL,
+						 CASE WHEN g % 3 = 0 THEN NULL ELSE g / 7.0 END,
+						 CASE WHEN g % 2 = 0 THEN NULL ELSE 'odd ' || g END
+				  FROM generate_series(1, 5000) AS g);
+INSERT INTO keys (SELECT g, 'key ' || g FROM generate_series(1, 50) AS g);
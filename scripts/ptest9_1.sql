@@ -0,0 +1,22 @@
+-- Gathering
+SELECT * FROM cols ORDER BY id, v, t LIMIT 100;
+SELECT count(*), count(n), count(m), count(t), sum(i), sum(m) FROM cols;
+
+-- Redistribution by the join key, which is not the distribution column
+SELECT d, count(*), count(m), max(v), min(u::text)
+FROM cols JOIN keys ON (cols.id % 50 + 1 = keys.k)
+GROUP BY d ORDER BY d;
+
+-- Join by two columns broadcasts the inner relation
+SELECT keys.name, count(*), sum(cols.i)
+FROM cols JOIN keys ON (cols.id = keys.k AND cols.d = 'group ' || (keys.k % 5))
+GROUP BY keys.name ORDER BY keys.name;
+
+-- Rescanned exchanges replay their cached results
+SET enable_hashjoin = off;
+SET enable_mergejoin = off;
+SELECT c.id, c.d, c.t, k.name
+FROM cols c, keys k WHERE c.id < k.k AND c.id % 100 = 1
+ORDER BY c.id, k.name;
+RESET enable_hashjoin;
+RESET enable_mergejoin;
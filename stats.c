@@ -0,0 +1,794 @@
+/* ------------------------------------------------------------------------
+ *
+ * stats.c
+ *		Cumulative statistics of the ParGRES activity.
+ *
+ *		Counters are kept in the shared memory and are shown by the
+ *		pg_stat_pargres* views. Hot paths of the exchange do not touch the
+ *		shared memory: traffic of the exchange is accumulated in the
+ *		connection (see ExchangePeerStats) and is added to the shared
+ *		counters once, at the end of the exchange.
+ *		Traffic of the exchanges, forced by joins and groupings, is kept per
+ *		(relation, column) by the coordinator of the statement. Remote nodes
+ *		send their part to it. pargres_advise_distribution() recommends
+ *		distribution keys and replicated relations by this traffic.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ * ------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "catalog/namespace.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+#include "common.h"
+#include "pargres.h"
+#include "relstats.h"
+#include "stats.h"
+
+
+PG_FUNCTION_INFO_V1(pargres_stat_global);
+PG_FUNCTION_INFO_V1(pargres_stat_peers);
+PG_FUNCTION_INFO_V1(pargres_stat_dispatch);
+PG_FUNCTION_INFO_V1(pargres_stat_relations);
+PG_FUNCTION_INFO_V1(pargres_stat_executions);
+PG_FUNCTION_INFO_V1(pargres_stat_keys);
+PG_FUNCTION_INFO_V1(pargres_advise_distribution);
+PG_FUNCTION_INFO_V1(pargres_stat_reset);
+
+typedef struct
+{
+	pg_atomic_uint64	tuples_sent;
+	pg_atomic_uint64	bytes_sent;
+	pg_atomic_uint64	tuples_received;
+	pg_atomic_uint64	bytes_received;
+} PeerCounters;
+
+typedef struct
+{
+	LWLock				lock; /* protects the relations hash and stats_reset */
+	TimestampTz			stats_reset;
+	pg_atomic_uint64	counters[STAT_NCOUNTERS];
+	pg_atomic_uint64	dispatch[STATS_DISPATCH_BUCKETS];
+	int					npeers;
+	PeerCounters		peers[FLEXIBLE_ARRAY_MEMBER];
+} PargresStats;
+
+/* Traffic of exchanges, which redistribute or broadcast the relation */
+typedef struct
+{
+	Oid		relid; /* hash key */
+	uint64	redistributions;
+	uint64	redistributed_tuples;
+	uint64	redistributed_bytes;
+	uint64	broadcasts;
+	uint64	broadcasted_tuples;
+	uint64	broadcasted_bytes;
+} RelationStats;
+
+typedef struct
+{
+	Oid			relid;
+	AttrNumber	attnum; /* InvalidAttrNumber, if the column is unknown */
+} KeyStatsKey;
+
+/* Traffic of exchanges, forced by the column of the relation */
+typedef struct
+{
+	KeyStatsKey	key; /* hash key */
+	uint64		redistributions;
+	uint64		redistributed_tuples;
+	uint64		redistributed_bytes;
+	uint64		broadcasts;
+	uint64		broadcasted_tuples;
+	uint64		broadcasted_bytes;
+} KeyStats;
+
+/* Ring of the recent executions, protected by the STATS->lock */
+typedef struct
+{
+	int				next;
+	int				count;
+	ExecutionStats	entries[STATS_MAX_EXECUTIONS];
+} ExecutionsRing;
+
+static PargresStats	*STATS = NULL;
+static HTAB			*RelStats = NULL;
+static HTAB			*KeyStatsHash = NULL;
+static ExecutionsRing	*Executions = NULL;
+
+#define STATS_SIZE(npeers) \
+	(offsetof(PargresStats, peers) + sizeof(PeerCounters) * (npeers))
+
+static void check_stats(void);
+static Tuplestorestate *init_srf(FunctionCallInfo fcinfo, TupleDesc *tupdesc);
+
+
+Size
+STATS_Shmem_size(void)
+{
+	Size size = MAXALIGN(STATS_SIZE(NODES_MAX_NUM));
+
+	size = add_size(size, MAXALIGN(sizeof(ExecutionsRing)));
+	size = add_size(size, hash_estimate_size(STATS_MAX_KEYS, sizeof(KeyStats)));
+	return add_size(size, hash_estimate_size(STATS_MAX_RELATIONS,
+											 sizeof(RelationStats)));
+}
+
+/*
+ * Called by the shmem startup hook.
+ */
+void
+STATS_Shmem_init(void)
+{
+	bool	found;
+	HASHCTL	info;
+	int		i;
+
+	STATS = (PargresStats *) ShmemInitStruct("ParGRES Statistics",
+											 STATS_SIZE(NODES_MAX_NUM),
+											 &found);
+
+	Executions = (ExecutionsRing *) ShmemInitStruct("ParGRES Executions",
+													sizeof(ExecutionsRing),
+													&found);
+	if (!found)
+	{
+		Executions->next = 0;
+		Executions->count = 0;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(Oid);
+	info.entrysize = sizeof(RelationStats);
+	RelStats = ShmemInitHash("ParGRES Relation Statistics",
+							 STATS_MAX_RELATIONS, STATS_MAX_RELATIONS,
+							 &info, HASH_ELEM | HASH_BLOBS);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(KeyStatsKey);
+	info.entrysize = sizeof(KeyStats);
+	KeyStatsHash = ShmemInitHash("ParGRES Key Statistics",
+								 STATS_MAX_KEYS, STATS_MAX_KEYS,
+								 &info, HASH_ELEM | HASH_BLOBS);
+
+	if (found)
+	{
+		LWLockRegisterTranche(STATS->lock.tranche, (char *) "PargresStats");
+		return;
+	}
+
+	LWLockInitialize(&STATS->lock, LWLockNewTrancheId());
+	LWLockRegisterTranche(STATS->lock.tranche, (char *) "PargresStats");
+	STATS->stats_reset = GetCurrentTimestamp();
+	/* pargres.nnodes can grow on reload after the shared memory is created */
+	STATS->npeers = NODES_MAX_NUM;
+
+	for (i = 0; i < STAT_NCOUNTERS; i++)
+		pg_atomic_init_u64(&STATS->counters[i], 0);
+	for (i = 0; i < STATS_DISPATCH_BUCKETS; i++)
+		pg_atomic_init_u64(&STATS->dispatch[i], 0);
+	for (i = 0; i < STATS->npeers; i++)
+	{
+		pg_atomic_init_u64(&STATS->peers[i].tuples_sent, 0);
+		pg_atomic_init_u64(&STATS->peers[i].bytes_sent, 0);
+		pg_atomic_init_u64(&STATS->peers[i].tuples_received, 0);
+		pg_atomic_init_u64(&STATS->peers[i].bytes_received, 0);
+	}
+}
+
+void
+STATS_Count(pargres_counter counter)
+{
+	Assert(counter < STAT_NCOUNTERS);
+
+	if (STATS != NULL)
+		pg_atomic_fetch_add_u64(&STATS->counters[counter], 1);
+}
+
+/*
+ * Add the traffic of the finished exchange to the shared counters. relid is
+ * the relation, which is scanned under the exchange, or InvalidOid.
+ */
+void
+STATS_Report_exchange(ex_conn_t *conn, Oid relid, bool broadcast)
+{
+	uint64	tuples = 0;
+	uint64	bytes = 0;
+	int		node;
+
+	if ((STATS == NULL) || (conn->stats == NULL))
+		return;
+
+	for (node = 0; node < Min(nodes_at_cluster, STATS->npeers); node++)
+	{
+		ExchangePeerStats	*stats = &conn->stats[node];
+		PeerCounters		*peer = &STATS->peers[node];
+
+		pg_atomic_fetch_add_u64(&peer->tuples_sent, stats->tuples_sent);
+		pg_atomic_fetch_add_u64(&peer->bytes_sent, stats->bytes_sent);
+		pg_atomic_fetch_add_u64(&peer->tuples_received,
+								stats->tuples_received);
+		pg_atomic_fetch_add_u64(&peer->bytes_received, stats->bytes_received);
+
+		tuples += stats->tuples_sent;
+		bytes += stats->bytes_sent;
+	}
+
+	if (!OidIsValid(relid))
+		return;
+
+	LWLockAcquire(&STATS->lock, LW_EXCLUSIVE);
+	{
+		RelationStats	*entry;
+		bool			found;
+
+		/* Traffic of the relation is lost, if the hash table is full */
+		entry = (RelationStats *) hash_search(RelStats, &relid,
+											  HASH_ENTER_NULL, &found);
+		if (entry != NULL)
+		{
+			if (!found)
+				memset((char *) entry + sizeof(Oid), 0,
+					   sizeof(RelationStats) - sizeof(Oid));
+
+			if (broadcast)
+			{
+				entry->broadcasts++;
+				entry->broadcasted_tuples += tuples;
+				entry->broadcasted_bytes += bytes;
+			}
+			else
+			{
+				entry->redistributions++;
+				entry->redistributed_tuples += tuples;
+				entry->redistributed_bytes += bytes;
+			}
+		}
+	}
+	LWLockRelease(&STATS->lock);
+}
+
+/*
+ * Report the traffic of the finished exchange by its key column. The traffic
+ * is kept by the coordinator of the statement. Returns false, if the backend
+ * has no service connection to the coordinator: it is a parallel worker of a
+ * remote node.
+ */
+bool
+STATS_Report_key(Oid relid, AttrNumber attnum, bool broadcast, uint64 tuples,
+				 uint64 bytes)
+{
+	KeyTraffic	traffic;
+	char		*name;
+
+	if ((STATS == NULL) || !OidIsValid(relid))
+		return true;
+
+	if ((CoordNode != node_number) && (CoordSock == PGINVALID_SOCKET))
+		return false;
+
+	if ((name = get_rel_name(relid)) == NULL)
+		return true;
+
+	memset(&traffic, 0, sizeof(KeyTraffic));
+	StrNCpy(traffic.relname, name, NAMEDATALEN);
+	if ((attnum > 0) && ((name = get_attname(relid, attnum, true)) != NULL))
+		StrNCpy(traffic.attname, name, NAMEDATALEN);
+	traffic.broadcast = broadcast;
+	traffic.tuples = tuples;
+	traffic.bytes = bytes;
+
+	if (CoordNode == node_number)
+		STATS_Store_key_traffic(&traffic);
+	else
+		CONN_Send_message(CoordSock, CONN_MSG_KEY_TRAFFIC, &traffic,
+						  sizeof(KeyTraffic));
+	return true;
+}
+
+/*
+ * Add the traffic of the exchange at the node to the counters of its key.
+ */
+void
+STATS_Store_key_traffic(KeyTraffic *traffic)
+{
+	KeyStatsKey	key;
+	KeyStats	*entry;
+	bool		found;
+
+	if (STATS == NULL)
+		return;
+
+	memset(&key, 0, sizeof(KeyStatsKey));
+	key.relid = RelnameGetRelid(traffic->relname);
+	if (!OidIsValid(key.relid))
+		return;
+	if (traffic->attname[0] != '\0')
+		key.attnum = get_attnum(key.relid, traffic->attname);
+
+	LWLockAcquire(&STATS->lock, LW_EXCLUSIVE);
+
+	/* Traffic of the key is lost, if the hash table is full */
+	entry = (KeyStats *) hash_search(KeyStatsHash, &key, HASH_ENTER_NULL,
+									 &found);
+	if (entry != NULL)
+	{
+		if (!found)
+			memset((char *) entry + sizeof(KeyStatsKey), 0,
+				   sizeof(KeyStats) - sizeof(KeyStatsKey));
+
+		if (traffic->broadcast)
+		{
+			entry->broadcasts++;
+			entry->broadcasted_tuples += traffic->tuples;
+			entry->broadcasted_bytes += traffic->bytes;
+		}
+		else
+		{
+			entry->redistributions++;
+			entry->redistributed_tuples += traffic->tuples;
+			entry->redistributed_bytes += traffic->bytes;
+		}
+	}
+
+	LWLockRelease(&STATS->lock);
+}
+
+/*
+ * Time from the launch of the statement at remote instances to the receiving
+ * of all results.
+ */
+void
+STATS_Report_dispatch(instr_time elapsed)
+{
+	double	ms = INSTR_TIME_GET_MILLISEC(elapsed);
+	int		bucket = 0;
+
+	if (STATS == NULL)
+		return;
+
+	while ((bucket < STATS_DISPATCH_BUCKETS - 1) && (ms > (1 << bucket)))
+		bucket++;
+
+	pg_atomic_fetch_add_u64(&STATS->dispatch[bucket], 1);
+	pg_atomic_fetch_add_u64(&STATS->counters[STAT_QUERIES_DISPATCHED], 1);
+}
+
+/*
+ * Remember the execution of the statement at the node. The oldest execution is
+ * overwritten.
+ */
+void
+STATS_Store_execution(ExecutionStats *stats)
+{
+	if (STATS == NULL)
+		return;
+
+	LWLockAcquire(&STATS->lock, LW_EXCLUSIVE);
+	Executions->entries[Executions->next] = *stats;
+	Executions->next = (Executions->next + 1) % STATS_MAX_EXECUTIONS;
+	Executions->count = Min(Executions->count + 1, STATS_MAX_EXECUTIONS);
+	LWLockRelease(&STATS->lock);
+}
+
+static void
+check_stats(void)
+{
+	if (STATS == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pargres must be loaded via shared_preload_libraries")));
+}
+
+/*
+ * Prepare the materialized result of the set-returning function.
+ */
+static Tuplestorestate *
+init_srf(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext	oldcxt;
+	Tuplestorestate	*tupstore;
+
+	if ((rsinfo == NULL) || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcxt = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	*tupdesc = CreateTupleDescCopy(*tupdesc);
+	MemoryContextSwitchTo(oldcxt);
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+	return tupstore;
+}
+
+Datum
+pargres_stat_global(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[STAT_NCOUNTERS + 3];
+	bool		nulls[STAT_NCOUNTERS + 3] = {false};
+	int			i;
+
+	check_stats();
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	for (i = 0; i < STAT_NCOUNTERS; i++)
+		values[i] = Int64GetDatum(
+						(int64) pg_atomic_read_u64(&STATS->counters[i]));
+
+	LWLockAcquire(&PORTS->lock, LW_SHARED);
+	values[i++] = Int32GetDatum(PORTS->index);
+	values[i++] = Int32GetDatum(PORTS->size);
+	LWLockRelease(&PORTS->lock);
+
+	LWLockAcquire(&STATS->lock, LW_SHARED);
+	values[i++] = TimestampTzGetDatum(STATS->stats_reset);
+	LWLockRelease(&STATS->lock);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+Datum
+pargres_stat_peers(PG_FUNCTION_ARGS)
+{
+	TupleDesc		tupdesc;
+	Tuplestorestate	*tupstore;
+	int				node;
+
+	check_stats();
+	tupstore = init_srf(fcinfo, &tupdesc);
+
+	for (node = 0; node < Min(nodes_at_cluster, STATS->npeers); node++)
+	{
+		PeerCounters	*peer = &STATS->peers[node];
+		Datum			values[5];
+		bool			nulls[5] = {false};
+
+		if (node == node_number)
+			continue;
+
+		values[0] = Int32GetDatum(node);
+		values[1] = Int64GetDatum((int64) pg_atomic_read_u64(&peer->tuples_sent));
+		values[2] = Int64GetDatum((int64) pg_atomic_read_u64(&peer->bytes_sent));
+		values[3] = Int64GetDatum((int64) pg_atomic_read_u64(&peer->tuples_received));
+		values[4] = Int64GetDatum((int64) pg_atomic_read_u64(&peer->bytes_received));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
+
+Datum
+pargres_stat_dispatch(PG_FUNCTION_ARGS)
+{
+	TupleDesc		tupdesc;
+	Tuplestorestate	*tupstore;
+	int				bucket;
+
+	check_stats();
+	tupstore = init_srf(fcinfo, &tupdesc);
+
+	for (bucket = 0; bucket < STATS_DISPATCH_BUCKETS; bucket++)
+	{
+		Datum	values[2];
+		bool	nulls[2] = {false, false};
+
+		/* The last bucket has no upper bound */
+		if (bucket < STATS_DISPATCH_BUCKETS - 1)
+			values[0] = Float8GetDatum((double) (1 << bucket));
+		else
+			nulls[0] = true;
+		values[1] = Int64GetDatum(
+						(int64) pg_atomic_read_u64(&STATS->dispatch[bucket]));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
+
+Datum
+pargres_stat_relations(PG_FUNCTION_ARGS)
+{
+	TupleDesc		tupdesc;
+	Tuplestorestate	*tupstore;
+	HASH_SEQ_STATUS	status;
+	RelationStats	*entry;
+
+	check_stats();
+	tupstore = init_srf(fcinfo, &tupdesc);
+
+	LWLockAcquire(&STATS->lock, LW_SHARED);
+	hash_seq_init(&status, RelStats);
+	while ((entry = (RelationStats *) hash_seq_search(&status)) != NULL)
+	{
+		Datum	values[7];
+		bool	nulls[7] = {false};
+
+		values[0] = ObjectIdGetDatum(entry->relid);
+		values[1] = Int64GetDatum((int64) entry->redistributions);
+		values[2] = Int64GetDatum((int64) entry->redistributed_tuples);
+		values[3] = Int64GetDatum((int64) entry->redistributed_bytes);
+		values[4] = Int64GetDatum((int64) entry->broadcasts);
+		values[5] = Int64GetDatum((int64) entry->broadcasted_tuples);
+		values[6] = Int64GetDatum((int64) entry->broadcasted_bytes);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	LWLockRelease(&STATS->lock);
+
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
+
+Datum
+pargres_stat_executions(PG_FUNCTION_ARGS)
+{
+	TupleDesc		tupdesc;
+	Tuplestorestate	*tupstore;
+	int				i;
+
+	check_stats();
+	tupstore = init_srf(fcinfo, &tupdesc);
+
+	LWLockAcquire(&STATS->lock, LW_SHARED);
+	for (i = 0; i < Executions->count; i++)
+	{
+		ExecutionStats	*entry = &Executions->entries[i];
+		Datum			values[11];
+		bool			nulls[11] = {false};
+
+		values[0] = CStringGetTextDatum(entry->distributed_id);
+		values[1] = Int64GetDatum((int64) entry->queryid);
+		values[2] = Int32GetDatum(entry->node);
+		values[3] = Float8GetDatum(entry->total_time);
+		values[4] = Int64GetDatum((int64) entry->rows);
+		values[5] = Int64GetDatum(entry->shared_blks_hit);
+		values[6] = Int64GetDatum(entry->shared_blks_read);
+		values[7] = Int64GetDatum(entry->shared_blks_dirtied);
+		values[8] = Int64GetDatum(entry->shared_blks_written);
+		values[9] = Int64GetDatum(entry->temp_blks_read);
+		values[10] = Int64GetDatum(entry->temp_blks_written);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	LWLockRelease(&STATS->lock);
+
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
+
+/*
+ * Traffic by the key columns. Each node returns the traffic of statements,
+ * launched at it.
+ */
+Datum
+pargres_stat_keys(PG_FUNCTION_ARGS)
+{
+	TupleDesc		tupdesc;
+	Tuplestorestate	*tupstore;
+	HASH_SEQ_STATUS	status;
+	KeyStats		*entry;
+	KeyStats		*keys;
+	int				nkeys = 0;
+	int				i;
+
+	check_stats();
+	tupstore = init_srf(fcinfo, &tupdesc);
+
+	/* Catalog lookups are done after the lock is released */
+	keys = palloc(STATS_MAX_KEYS * sizeof(KeyStats));
+	LWLockAcquire(&STATS->lock, LW_SHARED);
+	hash_seq_init(&status, KeyStatsHash);
+	while ((entry = (KeyStats *) hash_seq_search(&status)) != NULL)
+		if (nkeys < STATS_MAX_KEYS)
+			keys[nkeys++] = *entry;
+	LWLockRelease(&STATS->lock);
+
+	for (i = 0; i < nkeys; i++)
+	{
+		Datum	values[9];
+		bool	nulls[9] = {false};
+		char	*name;
+
+		entry = &keys[i];
+		if ((name = get_rel_name(entry->key.relid)) == NULL)
+			continue;
+
+		values[0] = Int32GetDatum(node_number);
+		values[1] = CStringGetTextDatum(name);
+		if ((entry->key.attnum > 0) &&
+			((name = get_attname(entry->key.relid, entry->key.attnum,
+								 true)) != NULL))
+			values[2] = CStringGetTextDatum(name);
+		else
+			nulls[2] = true;
+		values[3] = Int64GetDatum((int64) entry->redistributions);
+		values[4] = Int64GetDatum((int64) entry->redistributed_tuples);
+		values[5] = Int64GetDatum((int64) entry->redistributed_bytes);
+		values[6] = Int64GetDatum((int64) entry->broadcasts);
+		values[7] = Int64GetDatum((int64) entry->broadcasted_tuples);
+		values[8] = Int64GetDatum((int64) entry->broadcasted_bytes);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	pfree(keys);
+
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
+
+static int
+key_stats_cmp(const void *a, const void *b)
+{
+	Oid	relid1 = ((const KeyStats *) a)->key.relid;
+	Oid	relid2 = ((const KeyStats *) b)->key.relid;
+
+	return (relid1 < relid2) ? -1 : ((relid1 > relid2) ? 1 : 0);
+}
+
+/*
+ * Recommend distribution keys by the traffic of the statements, launched at
+ * this instance. The recommended key is the column, which forced the most
+ * bytes of exchanges: the distribution by it makes these joins and groupings
+ * local. The relation is recommended to be replicated, if its broadcasts
+ * sent more bytes than copying of the whole relation to each node.
+ * Instances, which execute the statement by the coordinator's request, return
+ * nothing: the result is not duplicated by the gathering.
+ */
+Datum
+pargres_advise_distribution(PG_FUNCTION_ARGS)
+{
+	TupleDesc		tupdesc;
+	Tuplestorestate	*tupstore;
+	HASH_SEQ_STATUS	status;
+	KeyStats		*entry;
+	KeyStats		*keys;
+	int				nkeys = 0;
+	int				first;
+
+	check_stats();
+	tupstore = init_srf(fcinfo, &tupdesc);
+
+	if (CoordNode != node_number)
+	{
+		tuplestore_donestoring(tupstore);
+		return (Datum) 0;
+	}
+
+	keys = palloc(STATS_MAX_KEYS * sizeof(KeyStats));
+	LWLockAcquire(&STATS->lock, LW_SHARED);
+	hash_seq_init(&status, KeyStatsHash);
+	while ((entry = (KeyStats *) hash_seq_search(&status)) != NULL)
+		if (nkeys < STATS_MAX_KEYS)
+			keys[nkeys++] = *entry;
+	LWLockRelease(&STATS->lock);
+
+	qsort(keys, nkeys, sizeof(KeyStats), key_stats_cmp);
+	RELSTATS_Load();
+
+	for (first = 0; first < nkeys; )
+	{
+		Oid				relid = keys[first].key.relid;
+		char			*relname = get_rel_name(relid);
+		uint64			traffic = 0;
+		uint64			broadcasted = 0;
+		uint64			best_bytes = 0;
+		AttrNumber		best = InvalidAttrNumber;
+		fr_options_t	frOpts;
+		double			relation_bytes;
+		Datum			values[8];
+		bool			nulls[8] = {false};
+		char			*name;
+		int				i;
+
+		for (i = first; (i < nkeys) && (keys[i].key.relid == relid); i++)
+		{
+			uint64 bytes = keys[i].redistributed_bytes +
+						   keys[i].broadcasted_bytes;
+
+			traffic += bytes;
+			broadcasted += keys[i].broadcasted_bytes;
+
+			if ((keys[i].key.attnum > 0) && (bytes > best_bytes))
+			{
+				best = keys[i].key.attnum;
+				best_bytes = bytes;
+			}
+		}
+		first = i;
+
+		/* The relation is dropped */
+		if (relname == NULL)
+			continue;
+
+		frOpts = PLAN_Get_fragmentation(relname);
+		relation_bytes = RELSTATS_Global_size(relid);
+
+		values[0] = ObjectIdGetDatum(relid);
+		if ((frOpts.attno > 0) &&
+			((name = get_attname(relid, frOpts.attno, true)) != NULL))
+			values[1] = CStringGetTextDatum(name);
+		else
+			nulls[1] = true;
+
+		/* No traffic by known columns: the current key is kept */
+		if (best == InvalidAttrNumber)
+			best = frOpts.attno;
+		if ((best > 0) && ((name = get_attname(relid, best, true)) != NULL))
+			values[2] = CStringGetTextDatum(name);
+		else
+			nulls[2] = true;
+
+		values[3] = BoolGetDatum(broadcasted >
+								 relation_bytes * (nodes_at_cluster - 1));
+		values[4] = Int64GetDatum((int64) traffic);
+		values[5] = Int64GetDatum((best != frOpts.attno) ?
+												(int64) best_bytes : 0);
+		values[6] = Int64GetDatum((int64) broadcasted);
+		values[7] = Int64GetDatum((int64) relation_bytes);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	pfree(keys);
+	tuplestore_donestoring(tupstore);
+	return (Datum) 0;
+}
+
+Datum
+pargres_stat_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS	status;
+	RelationStats	*entry;
+	KeyStats		*key;
+	int				i;
+
+	check_stats();
+
+	for (i = 0; i < STAT_NCOUNTERS; i++)
+		pg_atomic_write_u64(&STATS->counters[i], 0);
+	for (i = 0; i < STATS_DISPATCH_BUCKETS; i++)
+		pg_atomic_write_u64(&STATS->dispatch[i], 0);
+	for (i = 0; i < STATS->npeers; i++)
+	{
+		pg_atomic_write_u64(&STATS->peers[i].tuples_sent, 0);
+		pg_atomic_write_u64(&STATS->peers[i].bytes_sent, 0);
+		pg_atomic_write_u64(&STATS->peers[i].tuples_received, 0);
+		pg_atomic_write_u64(&STATS->peers[i].bytes_received, 0);
+	}
+
+	LWLockAcquire(&STATS->lock, LW_EXCLUSIVE);
+	hash_seq_init(&status, RelStats);
+	while ((entry = (RelationStats *) hash_seq_search(&status)) != NULL)
+		hash_search(RelStats, &entry->relid, HASH_REMOVE, NULL);
+	hash_seq_init(&status, KeyStatsHash);
+	while ((key = (KeyStats *) hash_seq_search(&status)) != NULL)
+		hash_search(KeyStatsHash, &key->key, HASH_REMOVE, NULL);
+	Executions->next = 0;
+	Executions->count = 0;
+	STATS->stats_reset = GetCurrentTimestamp();
+	LWLockRelease(&STATS->lock);
+
+	PG_RETURN_VOID();
+}
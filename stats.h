@@ -0,0 +1,93 @@
+/*-------------------------------------------------------------------------
+ *
+ * stats.h
+ *	Cumulative statistics of the ParGRES activity
+ *
+ * Copyright (c) 2018, PostgreSQL Global Development Group
+ * Author: Andrey Lepikhov <a.lepikhov@postgrespro.ru>
+ *
+ * IDENTIFICATION
+ *	contrib/pargres/stats.h
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include "access/attnum.h"
+#include "portability/instr_time.h"
+
+#include "connection.h"
+#include "trace.h"
+
+
+/* Max number of relations with tracked exchange traffic */
+#define STATS_MAX_RELATIONS		(1000)
+
+/* Max number of the tracked (relation, key column) pairs */
+#define STATS_MAX_KEYS			(4 * STATS_MAX_RELATIONS)
+
+/* Number of the recent executions at all nodes, kept by the coordinator */
+#define STATS_MAX_EXECUTIONS	(1000)
+
+/*
+ * Buckets of the dispatch latency histogram. Upper bound of the bucket i is
+ * 2^i milliseconds, the last bucket is unbounded.
+ */
+#define STATS_DISPATCH_BUCKETS	(16)
+
+typedef enum
+{
+	STAT_EXCHANGES_OPENED = 0,
+	STAT_CLUSTER_SETUPS,
+	STAT_RECV_WAITS,
+	STAT_SEND_WAITS,
+	STAT_QUERIES_DISPATCHED,
+	STAT_NCOUNTERS
+} pargres_counter;
+
+/*
+ * Execution of the distributed statement at one node. Remote nodes send it to
+ * the coordinator by the CONN_MSG_EXEC_STATS message.
+ */
+typedef struct
+{
+	char	distributed_id[DISTRIBUTED_ID_LEN];
+	uint64	queryid; /* query id of the coordinator statement */
+	int		node;
+	double	total_time; /* ms */
+	uint64	rows;
+	int64	shared_blks_hit;
+	int64	shared_blks_read;
+	int64	shared_blks_dirtied;
+	int64	shared_blks_written;
+	int64	temp_blks_read;
+	int64	temp_blks_written;
+} ExecutionStats;
+
+/*
+ * Traffic of the exchange, forced by the join or grouping column of the
+ * relation. Remote nodes send it to the coordinator of the statement by the
+ * CONN_MSG_KEY_TRAFFIC message. Names are used: OIDs differ at the nodes.
+ */
+typedef struct
+{
+	char	relname[NAMEDATALEN];
+	char	attname[NAMEDATALEN]; /* empty, if the column is unknown */
+	bool	broadcast;
+	uint64	tuples;
+	uint64	bytes;
+} KeyTraffic;
+
+extern Size STATS_Shmem_size(void);
+extern void STATS_Shmem_init(void);
+extern void STATS_Count(pargres_counter counter);
+extern void STATS_Report_exchange(ex_conn_t *conn, Oid relid, bool broadcast);
+extern bool STATS_Report_key(Oid relid, AttrNumber attnum, bool broadcast,
+							 uint64 tuples, uint64 bytes);
+extern void STATS_Store_key_traffic(KeyTraffic *traffic);
+extern void STATS_Report_dispatch(instr_time elapsed);
+extern void STATS_Store_execution(ExecutionStats *stats);
+
+#endif /* STATS_H_ */
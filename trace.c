@@ -0,0 +1,364 @@
+/* ------------------------------------------------------------------------
+ *
+ * trace.c
+ *		Distributed query id and the cross-node tracing.
+ *
+ *		The coordinator assigns the id to each launched statement and passes
+ *		it to the remote instances by the comment at the head of the query
+ *		text (see TRACE_COMMENT_PREFIX) with the query id of the coordinator
+ *		statement. At the executor end each remote node sends statistics of
+ *		the execution to the coordinator, which stores them for the
+ *		pg_stat_pargres_statements view.
+ *		If pargres.trace is on, the id is marked by the ",trace" option and
+ *		each node records timestamped
+ *		events of the statement. At the executor end the events are written
+ *		into the file <pargres.trace_directory>/<id>.node<N>.<pid>.json as
+ *		Chrome trace events, one per line. scripts/merge-traces.sh merges
+ *		files of all nodes into one trace for chrome://tracing or Perfetto.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ * ------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/hash.h"
+#include "catalog/pg_type.h"
+#include "executor/instrument.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+
+#include "common.h"
+#include "connection.h"
+#include "stats.h"
+#include "trace.h"
+
+
+char	DistributedQueryId[DISTRIBUTED_ID_LEN] = "";
+bool	trace_active = false;
+
+/* Number of statements, launched by the backend */
+static uint32 query_counter = 0;
+
+/* The statement has the distributed id and is not finished yet */
+static bool		query_active = false;
+static uint64	coordinator_queryid = 0;
+static BufferUsage	buffers_start;
+
+/* Events of the statement */
+static StringInfo	trace_buf = NULL;
+
+/* Top-level executor of the statement and the time of its start */
+static QueryDesc	*trace_owner = NULL;
+static TimestampTz	executor_start;
+
+static void start_trace(bool enable);
+static void report_execution(QueryDesc *queryDesc, uint64 rows);
+static void write_trace(void);
+
+
+static void
+start_trace(bool enable)
+{
+	query_active = true;
+	trace_active = enable && (trace_directory[0] != '\0');
+	trace_owner = NULL;
+
+	if (!trace_active)
+		return;
+
+	if (trace_buf == NULL)
+	{
+		MemoryContext oldCxt = MemoryContextSwitchTo(TopMemoryContext);
+
+		trace_buf = makeStringInfo();
+		MemoryContextSwitchTo(oldCxt);
+	}
+	else
+		resetStringInfo(trace_buf);
+
+	/* Timelines of the nodes are named in the merged trace */
+	appendStringInfo(trace_buf,
+					 "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+					 "\"args\":{\"name\":\"node %d\"}}\n",
+					 node_number, node_number);
+}
+
+/*
+ * Assign the id to the statement, launched by the coordinator. The query id
+ * is set by pg_stat_statements after the parse analysis. If its hook runs
+ * after ours (pg_stat_statements is loaded after pargres in
+ * shared_preload_libraries), the statement launched at the parsing stage has
+ * no query id yet. Then the id is computed from the query text, so executions
+ * of the statement are still merged. Such ids do not match the queryid of
+ * pg_stat_statements: load pg_stat_statements first to join the views.
+ */
+void
+TRACE_New_query(uint64 queryId, const char *query)
+{
+	snprintf(DistributedQueryId, DISTRIBUTED_ID_LEN, "%d.%d.%u",
+			 node_number, MyProcPid, ++query_counter);
+
+	if (queryId == 0)
+		queryId = DatumGetUInt64(hash_any_extended((const unsigned char *) query,
+												   strlen(query), 0));
+
+	coordinator_queryid = queryId;
+	start_trace(pargres_trace);
+}
+
+/*
+ * Extract the id from the query text, launched by the coordinator. If the
+ * comment refers to the parameter, the id is taken from params.
+ */
+void
+TRACE_Accept_query(const char *text, ParamListInfo params)
+{
+	const char	*start;
+	const char	*end;
+	char		value[DISTRIBUTED_ID_LEN];
+	char		*option;
+	bool		trace = false;
+
+	if (strncmp(text, TRACE_COMMENT_PREFIX,
+				strlen(TRACE_COMMENT_PREFIX)) != 0)
+		return;
+
+	start = text + strlen(TRACE_COMMENT_PREFIX);
+	end = strstr(start, TRACE_COMMENT_SUFFIX);
+	if ((end == NULL) || (end - start >= DISTRIBUTED_ID_LEN))
+		return;
+
+	memcpy(value, start, end - start);
+	value[end - start] = '\0';
+
+	if (value[0] == '$')
+	{
+		int				paramno = atoi(value + 1);
+		ParamExternData	*prm;
+		ParamExternData	prmdata;
+
+		/* Parameters are not known at the parsing stage */
+		if ((params == NULL) || (paramno < 1) || (paramno > params->numParams))
+			return;
+
+		if (params->paramFetch != NULL)
+			prm = params->paramFetch(params, paramno, false, &prmdata);
+		else
+			prm = &params->params[paramno - 1];
+
+		if (prm->isnull || (prm->ptype != TEXTOID))
+			return;
+
+		text_to_cstring_buffer(DatumGetTextPP(prm->value), value,
+							   DISTRIBUTED_ID_LEN);
+	}
+
+	/* Options follow the id: q=<query id of the coordinator>, trace */
+	coordinator_queryid = 0;
+	if ((option = strchr(value, ',')) != NULL)
+		*option++ = '\0';
+
+	while (option != NULL)
+	{
+		char *next = strchr(option, ',');
+
+		if (next != NULL)
+			*next++ = '\0';
+
+		if (strcmp(option, "trace") == 0)
+			trace = true;
+		else if (strncmp(option, "q=", 2) == 0)
+			coordinator_queryid = strtou64(option + 2, NULL, 10);
+
+		option = next;
+	}
+
+	StrNCpy(DistributedQueryId, value, DISTRIBUTED_ID_LEN);
+	start_trace(trace);
+}
+
+/*
+ * Value of the id, passed to the remote instances.
+ */
+char *
+TRACE_Query_value(void)
+{
+	return psprintf("%s,q=" UINT64_FORMAT "%s", DistributedQueryId,
+					coordinator_queryid, trace_active ? ",trace" : "");
+}
+
+/*
+ * Comment with the id of the statement. If paramno > 0, the comment refers to
+ * the parameter with the id.
+ */
+char *
+TRACE_Query_comment(int paramno)
+{
+	if (paramno > 0)
+		return psprintf(TRACE_COMMENT_PREFIX "$%d" TRACE_COMMENT_SUFFIX,
+						paramno);
+
+	return psprintf(TRACE_COMMENT_PREFIX "%s" TRACE_COMMENT_SUFFIX,
+					TRACE_Query_value());
+}
+
+/*
+ * Forget the statement, failed before the executor end. Its events are not
+ * written and its execution is not reported. Called at the transaction abort.
+ */
+void
+TRACE_Reset(void)
+{
+	query_active = false;
+	trace_active = false;
+	trace_owner = NULL;
+}
+
+void
+TRACE_Executor_start(QueryDesc *queryDesc)
+{
+	/* Executors of nested statements are part of the top-level one */
+	if (!query_active || (trace_owner != NULL))
+		return;
+
+	trace_owner = queryDesc;
+	executor_start = GetCurrentTimestamp();
+	buffers_start = pgBufferUsage;
+}
+
+/*
+ * End of the executor. rows is the number of processed tuples, the executor
+ * state is destroyed already.
+ */
+void
+TRACE_Executor_end(QueryDesc *queryDesc, uint64 rows)
+{
+	if (!query_active || (trace_owner != queryDesc))
+		return;
+
+	report_execution(queryDesc, rows);
+
+	if (trace_active)
+	{
+		TRACE_Span("executor", executor_start);
+		write_trace();
+	}
+
+	query_active = false;
+	trace_active = false;
+	trace_owner = NULL;
+}
+
+/*
+ * Statistics of the execution at remote node are sent to the coordinator.
+ * The coordinator stores own statistics and the received ones.
+ */
+static void
+report_execution(QueryDesc *queryDesc, uint64 rows)
+{
+	ExecutionStats	stats;
+	long			secs;
+	int				usecs;
+
+	memset(&stats, 0, sizeof(ExecutionStats));
+	StrNCpy(stats.distributed_id, DistributedQueryId, DISTRIBUTED_ID_LEN);
+	stats.queryid = coordinator_queryid;
+	stats.node = node_number;
+	TimestampDifference(executor_start, GetCurrentTimestamp(), &secs, &usecs);
+	stats.total_time = secs * 1000.0 + usecs / 1000.0;
+	stats.rows = rows;
+	stats.shared_blks_hit = pgBufferUsage.shared_blks_hit -
+											buffers_start.shared_blks_hit;
+	stats.shared_blks_read = pgBufferUsage.shared_blks_read -
+											buffers_start.shared_blks_read;
+	stats.shared_blks_dirtied = pgBufferUsage.shared_blks_dirtied -
+											buffers_start.shared_blks_dirtied;
+	stats.shared_blks_written = pgBufferUsage.shared_blks_written -
+											buffers_start.shared_blks_written;
+	stats.temp_blks_read = pgBufferUsage.temp_blks_read -
+											buffers_start.temp_blks_read;
+	stats.temp_blks_written = pgBufferUsage.temp_blks_written -
+											buffers_start.temp_blks_written;
+
+	if (CoordNode == node_number)
+	{
+		STATS_Store_execution(&stats);
+		CONN_Receive_statistics();
+	}
+	else if (CoordSock != PGINVALID_SOCKET)
+		CONN_Send_message(CoordSock, CONN_MSG_EXEC_STATS, &stats,
+						  sizeof(ExecutionStats));
+}
+
+/*
+ * Record the event from start to the current time.
+ */
+void
+TRACE_Span(const char *name, TimestampTz start)
+{
+	if (!trace_active)
+		return;
+
+	appendStringInfo(trace_buf,
+					 "{\"name\":\"%s\",\"cat\":\"pargres\",\"ph\":\"X\","
+					 "\"ts\":" INT64_FORMAT ",\"dur\":" INT64_FORMAT ","
+					 "\"pid\":%d,\"tid\":%d,\"args\":{\"id\":\"%s\"}}\n",
+					 name, (int64) start,
+					 (int64) (GetCurrentTimestamp() - start),
+					 node_number, MyProcPid, DistributedQueryId);
+}
+
+void
+TRACE_Instant(const char *name)
+{
+	if (!trace_active)
+		return;
+
+	appendStringInfo(trace_buf,
+					 "{\"name\":\"%s\",\"cat\":\"pargres\",\"ph\":\"i\","
+					 "\"s\":\"t\",\"ts\":" INT64_FORMAT ","
+					 "\"pid\":%d,\"tid\":%d,\"args\":{\"id\":\"%s\"}}\n",
+					 name, (int64) GetCurrentTimestamp(),
+					 node_number, MyProcPid, DistributedQueryId);
+}
+
+static void
+write_trace(void)
+{
+	char	*path;
+	FILE	*file;
+
+	if ((MakePGDirectory(trace_directory) < 0) && (errno != EEXIST))
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not create trace directory \"%s\": %m",
+						trace_directory)));
+		return;
+	}
+
+	path = psprintf("%s/%s.node%d.%d.json", trace_directory,
+					DistributedQueryId, node_number, MyProcPid);
+
+	if ((file = AllocateFile(path, PG_BINARY_W)) == NULL)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not open trace file \"%s\": %m", path)));
+		return;
+	}
+
+	if (fwrite(trace_buf->data, 1, trace_buf->len, file) !=
+		(size_t) trace_buf->len)
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not write trace file \"%s\": %m", path)));
+
+	FreeFile(file);
+	pfree(path);
+}
@@ -0,0 +1,49 @@
+/*-------------------------------------------------------------------------
+ *
+ * trace.h
+ *	Distributed query id and the cross-node tracing
+ *
+ * Copyright (c) 2018, PostgreSQL Global Development Group
+ * Author: Andrey Lepikhov <a.lepikhov@postgrespro.ru>
+ *
+ * IDENTIFICATION
+ *	contrib/pargres/trace.h
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include "executor/execdesc.h"
+#include "nodes/params.h"
+#include "utils/timestamp.h"
+
+
+#define DISTRIBUTED_ID_LEN	(64)
+
+/*
+ * Statements, launched at remote instances, start with the comment, which
+ * contains the distributed query id and options. A prepared statement can't contain the id
+ * of each execution: the comment refers to the parameter with the id.
+ */
+#define TRACE_COMMENT_PREFIX	"/* pargres:"
+#define TRACE_COMMENT_SUFFIX	" */ "
+
+/* Id of the distributed statement, executed by the backend now */
+extern char DistributedQueryId[DISTRIBUTED_ID_LEN];
+
+/* The statement is traced */
+extern bool	trace_active;
+
+extern void TRACE_New_query(uint64 queryId, const char *query);
+extern void TRACE_Accept_query(const char *text, ParamListInfo params);
+extern char *TRACE_Query_value(void);
+extern char *TRACE_Query_comment(int paramno);
+extern void TRACE_Reset(void);
+extern void TRACE_Executor_start(QueryDesc *queryDesc);
+extern void TRACE_Executor_end(QueryDesc *queryDesc, uint64 rows);
+extern void TRACE_Span(const char *name, TimestampTz start);
+extern void TRACE_Instant(const char *name);
+
+#endif /* TRACE_H_ */